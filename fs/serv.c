@@ -46,6 +46,9 @@ struct OpenFile opentab[MAXOPEN] = {
 	{ 0, 0, 1, 0 }
 };
 
+// Number of Fd pages openfile_alloc allocates at once.
+#define OPENFILE_BATCH	16
+
 // Virtual address at which to receive page mappings containing client requests.
 union Fsipc *fsreq = (union Fsipc *)0x0ffff000;
 
@@ -65,13 +68,18 @@ serve_init(void)
 int
 openfile_alloc(struct OpenFile **o)
 {
-	int i, r;
+	int i, n, r;
 
 	// Find an available open-file table entry
 	for (i = 0; i < MAXOPEN; i++) {
 		switch (pageref(opentab[i].o_fd)) {
 		case 0:
-			if ((r = sys_page_alloc(0, opentab[i].o_fd, PTE_P|PTE_U|PTE_W)) < 0)
+			// Allocate the Fd pages of the next few unused
+			// entries along with this one.
+			for (n = 1; n < OPENFILE_BATCH && i + n < MAXOPEN &&
+				     !pageref(opentab[i + n].o_fd); n++)
+				;
+			if ((r = sys_page_alloc_range(0, opentab[i].o_fd, n * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
 				return r;
 			/* fall through */
 		case 1:
@@ -376,35 +384,65 @@ fshandler handlers[] = {
 void
 serve(void)
 {
+	// The body of a request that came in a register message
+	static union Fsipc fswords;
+	union Fsipc *args;
 	uint32_t req, whom;
-	int perm, r;
+	int perm, pg_perm, r;
 	void *pg;
 
+	if ((r = sys_env_set_ipc_words(0, &fswords)) < 0)
+		panic("serve: sys_env_set_ipc_words: %i", r);
+
+	// Each reply goes out together with waiting for the next
+	// request, which the kernel hands over without a pass of the
+	// scheduler when the client is waiting in ipc_call.
+	perm = 0;
+	req = ipc_recv((int32_t *) &whom, fsreq, &perm);
 	while (1) {
-		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
 		if (debug)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
 				req, whom, uvpt[PGNUM(fsreq)], (char *) fsreq);
 
-		// All requests must contain an argument page
-		if (!(perm & PTE_P)) {
+		// All requests must contain an argument page, or small
+		// arguments in a register message, see fsipc_words().
+		// Only requests whose body fits in the words may use one.
+		if (perm == IPC_WORDS) {
+			args = &fswords;
+			if (req != FSREQ_FLUSH && req != FSREQ_SET_SIZE &&
+			    req != FSREQ_SYNC) {
+				cprintf("Invalid register request %d from %08x\n",
+					req, whom);
+				args = NULL;
+			}
+		} else if (perm & PTE_P) {
+			args = fsreq;
+		} else {
 			cprintf("Invalid request from %08x: no argument page\n",
 				whom);
-			continue; // just leave it hanging...
+			// just leave it hanging...
+			perm = 0;
+			req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+			continue;
 		}
 
 		pg = NULL;
-		if (req == FSREQ_OPEN) {
-			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
+		pg_perm = 0;
+		if (!args) {
+			r = -E_INVAL;
+		} else if (req == FSREQ_OPEN) {
+			r = serve_open(whom, (struct Fsreq_open*)args, &pg, &pg_perm);
 		} else if (req < NHANDLERS && handlers[req]) {
-			r = handlers[req](whom, fsreq);
+			r = handlers[req](whom, args);
 		} else {
 			cprintf("Invalid request code %d from %08x\n", req, whom);
 			r = -E_INVAL;
 		}
-		ipc_send(whom, r, pg, perm);
-		sys_page_unmap(0, fsreq);
+		if (args == fsreq)
+			sys_page_unmap(0, fsreq);
+		perm = 0;
+		req = ipc_reply_wait(whom, r, pg, pg_perm, (envid_t *) &whom,
+				     fsreq, &perm);
 	}
 }
 
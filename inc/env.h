@@ -6,6 +6,7 @@
 #include <inc/types.h>
 #include <inc/trap.h>
 #include <inc/memlayout.h>
+#include <inc/syscall.h>
 
 typedef int32_t envid_t;
 
@@ -35,9 +36,22 @@ enum {
 	ENV_DYING,
 	ENV_RUNNABLE,
 	ENV_RUNNING,
-	ENV_NOT_RUNNABLE
+	ENV_NOT_RUNNABLE,
+	ENV_ZOMBIE		// Exited, status not yet collected by the parent
 };
 
+// Environment priorities, or nice levels.  An environment gets about
+// 1.25 times the CPU time of one a level above it.
+#define ENV_PRIO_MIN		(-20)
+#define ENV_PRIO_MAX		19
+#define ENV_PRIO_DEFAULT	0
+#define ENV_PRIO_FS		(-5)	// The file server
+
+// The exit status of an environment that did not exit by itself, but
+// was destroyed by another one or for a fault.  Those that exit pass
+// a status of 0 to 255.
+#define ENV_EXIT_KILLED		0x100
+
 // Special environment types
 enum EnvType {
 	ENV_TYPE_IDLE = 0,
@@ -46,6 +60,27 @@ enum EnvType {
 	ENV_TYPE_FS,		// File system server
 };
 
+// Resource accounting, for everybody to read through envs[].
+struct EnvStats {
+	uint32_t es_syscalls[NSYSCALL_CLASSES];	// System calls by class
+	uint32_t es_cow_faults;		// Copy-on-write faults resolved
+	uint32_t es_upcall_faults;	// Page faults passed to the upcall
+	uint32_t es_ipc_sent;		// IPC messages sent
+	uint32_t es_ipc_received;	// IPC messages received
+	uint32_t es_npages;		// Pages mapped in its address space
+};
+
+// Register messages.  An IPC send with perm IPC_WORDS carries the
+// IPC_NWORDS words at srcva instead of a page mapping; they are copied
+// to the receiver's env_ipc_wordsva, and it gets IPC_WORDS as the perm.
+// The kernel keeps them out of struct Env, which all can read.
+#define IPC_NWORDS	6
+#define IPC_WORDS	0x1000
+
+// The notification bits that sys_notify() may set, see
+// sys_wait_notify().
+#define NOTIFY_ALL	0x7fffffff
+
 struct Env {
 	struct Trapframe env_tf;	// Saved registers
 	struct Env *env_link;		// Next free Env
@@ -54,10 +89,42 @@ struct Env {
 	enum EnvType env_type;		// Indicates special system environments
 	unsigned env_status;		// Status of the environment
 	uint32_t env_runs;		// Number of times environment has run
+	unsigned env_rq_index;		// Run queue position, see kern/sched.c
+	int env_cpunum;			// CPU it runs or is queued on, or ran on
+	int env_cpu_pin;		// CPU it is kept on, or -1, see
+					// sched_set_cpu()
+
+	// Scheduling
+	int env_priority;		// Nice level, lower runs more
+	bool env_privileged;		// May raise priorities and admit to the
+					// real-time class, see env_create()
+	uint64_t env_runtime;		// TSC cycles spent running
+	struct EnvStats env_stats;	// Other resource usage
+	uint64_t env_vruntime;		// env_runtime scaled by priority
+	uint64_t env_tsc_start;		// TSC when last put on the CPU
+
+	// Real-time class, see kern/sched.c
+	uint64_t env_rt_budget;		// TSC cycles per period, 0 if not in it
+	uint64_t env_rt_period;		// Period in TSC cycles
+	uint64_t env_rt_deadline;	// TSC at the end of the current period
+	int64_t env_rt_left;		// Budget left, < 0 after an overrun
+
+	// Timed waits, see kern/timer.c
+	uint64_t env_timeout;		// Tick to wake up at
+	struct Env *env_timer_next;	// Timer wheel slot links
+	struct Env **env_timer_pprev;	// NULL if no timeout is pending
+
+	// Wait queues, see sched_wait()
+	struct Env *env_wq_next;	// Next env on the same wait queue
+	struct Env **env_wq_pprev;	// NULL if not on a wait queue
+	struct Env *env_exit_waiters;	// Envs in sys_env_wait() for this one
+	int env_exit_status;		// What they get when it is freed
+	unsigned env_nzombies;		// Children kept as ENV_ZOMBIE
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
 
 	// Exception handling
 	void *env_pgfault_upcall;	// Page fault upcall entry point
+	uintptr_t env_uxstacktop;	// Top of the user exception stack
 
 	// Lab 9 IPC
 	bool env_ipc_recving;		// Env is blocked receiving
@@ -65,6 +132,28 @@ struct Env {
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+	void *env_ipc_wordsva;		// Where register messages go, or NULL
+	bool env_ipc_words_in;		// One is received but not copied out
+
+	// Synchronous IPC, see sys_ipc_call()
+	struct Env *env_ipc_callers;	// Callers waiting for us to receive
+	uint32_t env_ipc_call_value;	// What we call with while waiting
+	void *env_ipc_call_srcva;
+	int env_ipc_call_perm;
+
+	// Asynchronous IPC, see ipc_mbox_put() in kern/syscall.c
+	struct IpcMsg *env_ipc_mbox;	// Messages sent while not receiving
+	struct IpcMsg **env_ipc_mbox_tail;
+	unsigned env_ipc_mbox_len;
+	unsigned env_ipc_mbox_sent;	// Ours still queued in any mailbox
+
+	// Notifications, see sys_notify()
+	uint32_t env_notify_pending;	// Bits notified and not yet taken
+	uint32_t env_notify_mask;	// Bits waited for, while waiting
+	struct Env *env_notify_waiters;	// Itself, while it waits
+
+	// Physical address of the word it waits on in sys_futex_wait()
+	physaddr_t env_futex_addr;
 };
 
 #endif // !JOS_INC_ENV_H
@@ -34,6 +34,10 @@ enum {
 	E_INVAL_REC	= 18,
 	E_DMGD_FILE	= 19,
 
+	E_PERM		= 20,	// Operation not permitted
+	E_BUSY		= 21,	// Resource is fully committed
+	E_TIMEOUT	= 22,	// Timed out waiting
+
 	MAXERROR
 };
 
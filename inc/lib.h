@@ -8,6 +8,7 @@
 #define JOS_INC_LIB_H 1
 
 #include <inc/types.h>
+#include <inc/x86.h>
 #include <inc/stdio.h>
 #include <inc/stdarg.h>
 #include <inc/string.h>
@@ -41,12 +42,34 @@ void	umain(int argc, char **argv);
 // libmain.c or entry.S
 extern const char *binaryname;
 extern const volatile int vsys[];
-extern const volatile struct Env *thisenv;
 extern const volatile struct Env envs[NENV];
 extern const volatile struct PageInfo pages[];
 
+#ifdef CONFIG_KSPACE
+extern const volatile struct Env *thisenv;
+#else
+// Threads sharing an address space, and sfork children, each need
+// their own thisenv.  It lives in the per-thread data page at
+// UTHREADDATA, away from any stack, in the entry of the thread whose
+// stack the code runs on: entry 0 for the main thread (the normal user
+// stack or the exception stack above it), 1 + slot for a thread slot.
+#define thisenv	(*thread_envp())
+
+static inline const volatile struct Env **
+thread_envp(void)
+{
+	const volatile struct Env **envp = (const volatile struct Env **) UTHREADDATA;
+	uintptr_t esp = read_esp();
+
+	if (esp >= UTHREADTOP)
+		return envp;
+	return envp + 1 + (UTHREADTOP - 1 - esp) / UTHREADSIZE;
+}
+#endif
+
 // exit.c
 void	exit(void);
+void	exit_status(int status);
 
 // pgfault.c
 void	set_pgfault_handler(void (*handler)(struct UTrapframe *utf));
@@ -59,20 +82,46 @@ void	sys_cputs(const char *string, size_t len);
 int	sys_cgetc(void);
 envid_t	sys_getenvid(void);
 int	sys_env_destroy(envid_t);
+int	sys_env_exit(int status);
+int	sys_env_wait(envid_t envid);
 void	sys_yield(void);
 static envid_t sys_exofork(void);
+envid_t	sys_fork(void);
+envid_t	sys_sfork(void);
+envid_t	sys_thread_create(void *eip, void *esp, void *uxstacktop);
 int	sys_env_set_status(envid_t env, int status);
+int	sys_env_set_priority(envid_t env, int priority);
+int	sys_env_set_deadline(envid_t env, unsigned budget_ms, unsigned period_ms);
+int	sys_env_set_cpu(envid_t env, int cpu);
 int	sys_env_set_trapframe(envid_t env, struct Trapframe *tf);
 int	sys_env_set_pgfault_upcall(envid_t env, void *upcall);
 int	sys_page_alloc(envid_t env, void *pg, int perm);
 int	sys_page_map(envid_t src_env, void *src_pg,
 		     envid_t dst_env, void *dst_pg, int perm);
 int	sys_page_unmap(envid_t env, void *pg);
+int	sys_page_alloc_range(envid_t env, void *va, size_t len, int perm);
+int	sys_page_map_range(envid_t src_env, void *src_va,
+			   envid_t dst_env, void *dst_va, size_t len, int perm);
+int	sys_page_unmap_range(envid_t env, void *va, size_t len);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_recv_until(void *rcv_pg, uint64_t deadline);
+int	sys_ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		     void *rcv_pg);
+int	sys_ipc_reply_wait(envid_t to_env, uint32_t value, void *pg, int perm,
+			   void *rcv_pg);
+int	sys_env_set_ipc_words(envid_t env, void *va);
+int	sys_sleep_until(uint64_t deadline);
+int	sys_notify(envid_t envid, uint32_t bits);
+int	sys_wait_notify(uint32_t mask);
+int	sys_futex_wait(volatile uint32_t *addr, uint32_t expected,
+		       uint64_t deadline);
+int	sys_futex_wake(volatile uint32_t *addr, unsigned n);
 int	sys_gettime(void);
 
 int	vsys_gettime(void);
+int	vsys_tsc_khz(void);
+void	sleep_ms(unsigned ms);
 
 int	sys_chdir(const char *dir, size_t len);
 int	sys_getcwd(char *dir);
@@ -96,13 +145,23 @@ sys_exofork(void)
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+int32_t ipc_recv_until(envid_t *from_env_store, void *pg, int *perm_store,
+		       uint64_t deadline);
+int32_t ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		 void *rcv_pg, int *perm_store);
+int32_t ipc_reply_wait(envid_t to_env, uint32_t value, void *pg, int perm,
+		       envid_t *from_env_store, void *rcv_pg, int *perm_store);
 envid_t	ipc_find_env(enum EnvType type);
 
 // fork.c
-#define	PTE_SHARE	0x400
 envid_t	fork(void);
 envid_t	sfork(void);	// Challenge!
 
+// thread.c
+envid_t	thread_create(void (*func)(void *), void *arg);
+void	thread_exit(void) __attribute__((noreturn));
+void	thread_join(envid_t thread);
+
 // fd.c
 int	close(int fd);
 ssize_t	read(int fd, void *buf, size_t nbytes);
@@ -139,7 +198,7 @@ int	pipe(int pipefds[2]);
 int	pipeisclosed(int pipefd);
 
 // wait.c
-void	wait(envid_t env);
+int	wait(envid_t env);
 
 /* File open modes */
 #define	O_RDONLY	0x0000		/* open for reading only */
@@ -93,6 +93,9 @@
 #define IOPHYSMEM	0x0A0000
 #define EXTPHYSMEM	0x100000
 
+// Physical address of startup code for non-boot CPUs (APs)
+#define MPENTRY_PADDR	0x7000
+
 // Amount of memory mapped by entrypgdir.
 #define BOOTMEMSIZE (12*1024*1024)
 
@@ -138,14 +141,26 @@
 #define USTACKTOP	(UTOP - USTACKSIZE - UXSTACKSIZE - PGSIZE)
 // Stack size (variable)
 #define USTACKSIZE  	(2*PGSIZE)
+// Per-thread data page below the normal user stack and a guard page:
+// thisenv of the main thread and of each thread slot (see inc/lib.h).
+#define UTHREADDATA	(USTACKTOP - USTACKSIZE - 2*PGSIZE)
+// Stacks of the other threads sharing the address space, one slot per
+// thread below the per-thread data (see lib/thread.c).  From the top,
+// a slot holds a guard page, an exception stack, another guard page
+// and the thread's stack.
+#define UTHREADTOP	UTHREADDATA
+#define UTHREADSTKSIZE	(4*PGSIZE)
+#define UTHREADSIZE	(UTHREADSTKSIZE + UXSTACKSIZE + 2*PGSIZE)
+#define NUTHREAD	16
+#define UTHREADBOTTOM	(UTHREADTOP - NUTHREAD * UTHREADSIZE)
 // Max number of open files in the file system at once
 #define MAXOPEN		1024
 #define FILEVA		0xD0000000
 
 #ifdef SANITIZE_USER_SHADOW_OFF
 // User stack and some other tables are located at higher addresses, so we need to map a separate shadow for it.
-#define SANITIZE_USER_EXTRA_SHADOW_BASE ((((USTACKTOP - USTACKSIZE) >> 3) + SANITIZE_USER_SHADOW_OFF) & ~(PGSIZE-1))
-#define SANITIZE_USER_EXTRA_SHADOW_SIZE ((ULIM - USTACKTOP - USTACKSIZE) >> 3)
+#define SANITIZE_USER_EXTRA_SHADOW_BASE (((UTHREADBOTTOM >> 3) + SANITIZE_USER_SHADOW_OFF) & ~(PGSIZE-1))
+#define SANITIZE_USER_EXTRA_SHADOW_SIZE ((ULIM - UTHREADBOTTOM) >> 3)
 
 // File system is located at another specific address space
 #define SANITIZE_USER_FS_SHADOW_BASE ((FILEVA >> 3) + SANITIZE_USER_SHADOW_OFF)
@@ -198,8 +213,15 @@ extern volatile pde_t uvpd[];     // VA of current page directory
  * with page2pa() in kern/pmap.h.
  */
 struct PageInfo {
-	// Next page on the free list.
+	// Next and previous block on the buddy free list.
+	// Only the first page of a free block is linked.
 	struct PageInfo *pp_link;
+	struct PageInfo *pp_prev;
+
+	// For a page directory, the number of user pages, 4KB each,
+	// mapped through it; for a page table, the number of pages it
+	// maps.  Set to 0 when either is allocated.
+	uint32_t pp_nresident;
 
 	// pp_ref is the count of pointers (usually in page table entries)
 	// to this page, for pages allocated using page_alloc.
@@ -207,6 +229,12 @@ struct PageInfo {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	// Buddy order of the block headed by this page (the block spans
+	// 1 << pp_order pages), valid for free blocks and allocated blocks.
+	uint8_t pp_order;
+	// PP_* flags, see kern/pmap.h.
+	uint8_t pp_flags;
 };
 
 #endif /* !__ASSEMBLER__ */
@@ -10,6 +10,9 @@ enum {
 	SYS_page_alloc,
 	SYS_page_map,
 	SYS_page_unmap,
+	SYS_page_alloc_range,
+	SYS_page_map_range,
+	SYS_page_unmap_range,
 	SYS_exofork,
 	SYS_env_set_status,
 	SYS_env_set_trapframe,
@@ -22,7 +25,32 @@ enum {
 	SYS_getcwd,
 	SYS_set_logatt,
 	SYS_get_logatt,
+	SYS_fork,
+	SYS_sfork,
+	SYS_thread_create,
+	SYS_env_set_priority,
+	SYS_env_set_deadline,
+	SYS_sleep_until,
+	SYS_env_wait,
+	SYS_env_set_cpu,
+	SYS_ipc_call,
+	SYS_ipc_reply_wait,
+	SYS_env_set_ipc_words,
+	SYS_notify,
+	SYS_wait_notify,
+	SYS_futex_wait,
+	SYS_futex_wake,
 	NSYSCALLS
 };
 
+/* system call classes, for accounting in struct EnvStats */
+enum {
+	SYSCALL_CLASS_ENV = 0,	// Environments and scheduling
+	SYSCALL_CLASS_MEM,	// Page mappings
+	SYSCALL_CLASS_IPC,
+	SYSCALL_CLASS_TIME,
+	SYSCALL_CLASS_IO,	// Console, working directory and log
+	NSYSCALL_CLASSES
+};
+
 #endif /* !JOS_INC_SYSCALL_H */
@@ -40,6 +40,10 @@
 #define IRQ_IDE         14
 #define IRQ_ERROR       19
 
+// Inter-processor interrupts, sent by lapic_ipi()
+#define IRQ_RESCHED     20	// Check the run queue, see sched_kick()
+#define IRQ_TLB         21	// Flush the TLB, see tlb_shootdown()
+
 #ifndef __ASSEMBLER__
 
 #include <inc/types.h>
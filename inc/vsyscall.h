@@ -4,6 +4,7 @@
 /* system call numbers */
 enum {
 	VSYS_gettime,
+	VSYS_tsc_khz,		// TSC frequency, for sys_sleep_until()
 	NVSYSCALLS
 };
 
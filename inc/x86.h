@@ -293,6 +293,33 @@ xchg(volatile uint32_t *addr, uint32_t newval)
 	return result;
 }
 
+// Atomically replace *addr with newval if it is oldval.  Returns the
+// value *addr had, which is oldval on success.
+static inline uint32_t
+cmpxchg(volatile uint32_t *addr, uint32_t oldval, uint32_t newval)
+{
+	uint32_t result;
+
+	asm volatile("lock; cmpxchgl %2, %0" :
+			"+m" (*addr), "=a" (result) :
+			"r" (newval), "1" (oldval) :
+			"cc", "memory");
+	return result;
+}
+
+// Atomically add inc to *addr.  Returns the value *addr had.
+static inline uint32_t
+xadd(volatile uint32_t *addr, uint32_t inc)
+{
+	uint32_t result;
+
+	asm volatile("lock; xaddl %0, %1" :
+			"=r" (result), "+m" (*addr) :
+			"0" (inc) :
+			"cc", "memory");
+	return result;
+}
+
 #define NMI_LOCK	0x80
 
 static inline void
@@ -12,10 +12,7 @@ static Header base = { .s = { .next = (Header *) space, .prev = (Header *) space
 static Header *freep = NULL; /* start of free list */
 
 static struct spinlock page_lock = {
-	.locked = 0,
-#ifdef DEBUG_SPINLOCK
-	.name = "page_lock",
-#endif
+	.name = "page_lock"
 };
 
 static void check_list(void)
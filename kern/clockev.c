@@ -0,0 +1,108 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/x86.h>
+#include <inc/trap.h>
+
+#include <kern/clockev.h>
+#include <kern/picirq.h>
+#include <kern/tsc.h>
+#include <kern/cpu.h>
+
+// The clock event device of each CPU is the timer of its local APIC,
+// which counts down once from the value loaded and raises IRQ_TIMER
+// at zero, see lapic_timer().
+//
+// Without a local APIC there is only the boot CPU, and it uses
+// channel 0 of the i8253/i8254 PIT in mode 0, interrupt on terminal
+// count, instead.  Its counter is 16 bits wide, so a deadline more
+// than about 55 ms away takes several interrupts; the scheduler
+// programs the rest after each.
+#define IO_PIT_CNT0	0x40
+#define IO_PIT_CMND	0x43
+#define PIT_SEL0_MODE0	0x30	// Channel 0, LSB then MSB, mode 0
+#define PIT_MAX_COUNT	0xffff
+
+// Deadlines further away are programmed as this many seconds.
+#define CLOCKEV_MAX_SEC	1000
+
+// TSC value at which the programmed interrupt comes on each CPU,
+// 0 if none.
+static uint64_t clockev_deadline[NCPU];
+
+void
+clockev_init(void)
+{
+	// Stop the PIT counter until the first deadline is programmed.
+	outb(IO_PIT_CMND, PIT_SEL0_MODE0);
+	if (!lapic_timer_khz)
+		irq_setmask_8259A(irq_mask_8259A & ~(1 << IRQ_TIMER));
+}
+
+// Count 'count' TSC cycles on the PIT, or the local APIC timer.
+// Returns how many TSC cycles that is, after rounding.
+static uint64_t
+clockev_start(uint64_t count)
+{
+	if (lapic_timer_khz) {
+		count = count * lapic_timer_khz / cpu_freq;
+		count = MAX(MIN(count, ~0u), 1);
+		lapic_timer(count);
+		return count * cpu_freq / lapic_timer_khz;
+	}
+
+	count = count * PIT_TICK_RATE / (cpu_freq * 1000ull);
+	count = MAX(MIN(count, PIT_MAX_COUNT), 1);
+	outb(IO_PIT_CMND, PIT_SEL0_MODE0);
+	outb(IO_PIT_CNT0, count & 0xff);
+	outb(IO_PIT_CNT0, count >> 8);
+	return count * cpu_freq * 1000ull / PIT_TICK_RATE;
+}
+
+static void
+clockev_stop(void)
+{
+	// Writing the PIT mode alone stops the counter.
+	if (lapic_timer_khz)
+		lapic_timer(0);
+	else
+		outb(IO_PIT_CMND, PIT_SEL0_MODE0);
+}
+
+// Have the timer interrupt come to this CPU at TSC value 'deadline',
+// or not at all if 'deadline' is 0.  An interrupt programmed already
+// for no later is kept: the scheduler only ever needs to be woken up
+// no later than it asks, so coming back early is harmless, and this
+// saves reprogramming the timer on every return to user mode.
+void
+clockev_program(uint64_t deadline)
+{
+	uint64_t *programmed = &clockev_deadline[cpunum()];
+	uint64_t now, count;
+
+	if (!deadline) {
+		if (*programmed) {
+			clockev_stop();
+			*programmed = 0;
+		}
+		return;
+	}
+
+	now = read_tsc();
+	if (*programmed && *programmed > now && *programmed <= deadline)
+		return;
+
+	count = deadline > now ? deadline - now : 0;
+	count = MIN(count, (uint64_t) CLOCKEV_MAX_SEC * 1000 * cpu_freq);
+	*programmed = now + clockev_start(count);
+}
+
+// Acknowledge the timer interrupt.
+void
+clockev_interrupt(void)
+{
+	clockev_deadline[cpunum()] = 0;
+	if (lapic_timer_khz)
+		lapic_eoi();
+	else
+		pic_send_eoi(IRQ_TIMER);
+}
@@ -0,0 +1,18 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_CLOCKEV_H
+#define JOS_KERN_CLOCKEV_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Clock events: one timer interrupt (IRQ_TIMER) at a TSC deadline,
+// instead of a periodic tick, on each CPU.
+
+void clockev_init(void);
+void clockev_program(uint64_t deadline);
+void clockev_interrupt(void);
+
+#endif	// !JOS_KERN_CLOCKEV_H
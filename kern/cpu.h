@@ -1,4 +1,3 @@
-
 #ifndef JOS_INC_CPU_H
 #define JOS_INC_CPU_H
 
@@ -7,12 +6,46 @@
 #include <inc/mmu.h>
 #include <inc/env.h>
 
-#define NCPU 1
+// Maximum number of CPUs
+#define NCPU 8
+
+// Values of status in struct CpuInfo
+enum {
+	CPU_UNUSED = 0,
+	CPU_STARTED,
+};
+
+// Per-CPU state
+struct CpuInfo {
+	uint8_t cpu_id;                 // Local APIC ID; index into cpus[] below
+	volatile unsigned cpu_status;   // The status of the CPU
+	struct Env *cpu_env;            // The currently-running environment.
+	struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
+	volatile bool cpu_tlb_flush;    // Asked to flush its TLB, see tlb_shootdown()
+};
+
+// Initialized in mpconfig.c
+extern struct CpuInfo cpus[NCPU];
+extern int ncpu;                    // Total number of CPUs in the system
+extern struct CpuInfo *bootcpu;     // The boot-strap processor (BSP)
+extern physaddr_t lapicaddr;        // Physical MMIO address of the local APIC
+
+// Per-CPU kernel stacks
+extern unsigned char percpu_kstacks[NCPU][KSTKSIZE];
+
+int cpunum(void);
+#define thiscpu (&cpus[cpunum()])
 
-extern struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
+void mp_init(void);
+void lapic_init(void);
+void lapic_startap(uint8_t apicid, uint32_t addr);
+void lapic_eoi(void);
+void lapic_ipi(uint8_t apicid, int vector);
 
-//kernel stack
-extern unsigned char kstack[KSTKSIZE];
+// The local APIC timer, see kern/clockev.c.  lapic_timer_khz is 0
+// without a local APIC.
+extern unsigned lapic_timer_khz;
+void lapic_timer(uint32_t count);
 
 extern char in_intr;
 extern bool in_clk_intr;
@@ -12,16 +12,16 @@
 #include <kern/trap.h>
 #include <kern/monitor.h>
 #include <kern/sched.h>
+#include <kern/syscall.h>
 #include <kern/cpu.h>
+#include <kern/spinlock.h>
 #include <kern/kdebug.h>
 
 #ifdef CONFIG_KSPACE
 struct Env env_array[NENV];
-struct Env *curenv = NULL;
 struct Env *envs = env_array;		// All environments
 #else
 struct Env *envs = NULL;		// All environments
-struct Env *curenv = NULL;		// The current env
 #endif
 static struct Env *env_free_list;	// Free environment list
 					// (linked by Env->env_link)
@@ -98,7 +98,8 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	// (i.e., does not refer to a _previous_ environment
 	// that used the same slot in the envs[] array).
 	e = &envs[ENVX(envid)];
-	if (e->env_status == ENV_FREE || e->env_id != envid) {
+	if (e->env_status == ENV_FREE || e->env_status == ENV_ZOMBIE ||
+	    e->env_id != envid) {
 		*env_store = 0;
 		return -E_BAD_ENV;
 	}
@@ -207,6 +208,7 @@ env_setup_vm(struct Env *e)
 
 	// LAB 8: Your code here.
 	p->pp_ref++;
+	p->pp_nresident = 0;
 	e->env_pgdir = (pde_t *) page2kva(p);
 	memcpy(e->env_pgdir, kern_pgdir, PGSIZE);
 
@@ -253,7 +255,18 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 #else
 	e->env_type = ENV_TYPE_USER;
 #endif
-	e->env_status = ENV_RUNNABLE;
+	// A child inherits the priority of its parent, which is curenv
+	// when it has a parent.
+	e->env_priority = (parent_id && curenv) ?
+		curenv->env_priority : ENV_PRIO_DEFAULT;
+	e->env_privileged = false;
+	e->env_runtime = 0;
+	memset(&e->env_stats, 0, sizeof(e->env_stats));
+	e->env_rt_budget = e->env_rt_period = e->env_rt_left = 0;
+	e->env_exit_status = ENV_EXIT_KILLED;
+	e->env_nzombies = 0;
+	e->env_cpu_pin = -1;
+	sched_set_status(e, ENV_RUNNABLE);
 	e->env_runs = 0;
 
 	// Clear out all the saved register state,
@@ -292,9 +305,20 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 
 	// Clear the page fault handler until user installs one.
 	e->env_pgfault_upcall = 0;
+	e->env_uxstacktop = UXSTACKTOP;
 
-	// Also clear the IPC receiving flag.
+	// Also clear the IPC receiving flag, and empty the mailbox.
 	e->env_ipc_recving = 0;
+	e->env_ipc_wordsva = NULL;
+	e->env_ipc_words_in = 0;
+	e->env_ipc_mbox = NULL;
+	e->env_ipc_mbox_tail = &e->env_ipc_mbox;
+	e->env_ipc_mbox_len = 0;
+	e->env_ipc_mbox_sent = 0;
+
+	// No notifications are pending.
+	e->env_notify_pending = 0;
+	e->env_notify_mask = 0;
 
 	// commit the allocation
 	env_free_list = e->env_link;
@@ -569,6 +593,12 @@ env_create(uint8_t *binary, size_t size, enum EnvType type)
 	load_icode(new_env, binary, size);
 	new_env->env_type = type;
 
+	// Environments the kernel starts itself may raise scheduling
+	// priorities above their own and admit environments to the
+	// real-time class.  Nothing they create inherits that, so no
+	// environment can take more of the CPU than it was given.
+	new_env->env_privileged = true;
+
 	// If this is the file server (type == ENV_TYPE_FS) give it I/O privileges.
 	// LAB 10: Your code here.
 	if (type == ENV_TYPE_FS)
@@ -578,19 +608,77 @@ env_create(uint8_t *binary, size_t size, enum EnvType type)
 		// to be done to ensure that the privilege level will
 		// be restored properly
 		new_env->env_tf.tf_eflags |= FL_IOPL_MASK;
+
+		// Clients wait for it, let it run ahead of them.
+		new_env->env_priority = ENV_PRIO_FS;
+		if ((err_code = sched_set_deadline(new_env, SCHED_FS_BUDGET_MS,
+						   SCHED_FS_PERIOD_MS)) < 0)
+		{
+			panic("env_create: sched_set_deadline: %i", err_code);
+		}
 	}
 }
 
+// Return 'e' to the free list.
+static void
+env_release(struct Env *e)
+{
+	sched_set_status(e, ENV_FREE);
+	e->env_link = env_free_list;
+	env_free_list = e;
+}
+
+// Is the parent of 'e' waiting for it in sys_env_wait()?
+static bool
+env_parent_waits(struct Env *e)
+{
+	struct Env *w;
+
+	for (w = e->env_exit_waiters; w; w = w->env_wq_next)
+		if (w->env_id == e->env_parent_id)
+			return true;
+	return false;
+}
+
+//
+// Collect the exit status of 'parent's zombie child 'envid' and free
+// it, see env_free().
+// Returns the status, or -E_BAD_ENV if envid is no zombie child of
+// 'parent'.
+//
+int
+env_reap(struct Env *parent, envid_t envid)
+{
+	struct Env *e = &envs[ENVX(envid)];
+	int status;
+
+	if (e->env_status != ENV_ZOMBIE || e->env_id != envid ||
+	    e->env_parent_id != parent->env_id)
+		return -E_BAD_ENV;
+
+	status = e->env_exit_status;
+	parent->env_nzombies--;
+	env_release(e);
+	return status;
+}
+
 //
 // Frees env e and all memory it uses.
 //
+// As in Unix, the Env itself stays behind as an ENV_ZOMBIE holding the
+// exit status if its parent is still around and not waiting for it
+// already, until the parent collects it with sys_env_wait() or goes
+// away itself.
+//
 void
 env_free(struct Env *e)
 {
+	struct Env *parent, *z;
 #ifndef CONFIG_KSPACE
 	pte_t *pt;
 	uint32_t pdeno, pteno;
 	physaddr_t pa;
+	bool shared;
 
 	// If freeing the current environment, switch to kern_pgdir
 	// before freeing the page directory, just in case the page
@@ -605,18 +693,36 @@ env_free(struct Env *e)
 #endif
 
 #ifndef CONFIG_KSPACE
+	// Threads share the page directory, and only the last one
+	// to go takes the address space down with it
+	shared = pa2page(PADDR(e->env_pgdir))->pp_ref > 1;
+
 	// Flush all mapped pages in the user portion of the address space
 	static_assert(UTOP % PTSIZE == 0, "Misaligned UTOP");
-	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
+	for (pdeno = 0; pdeno < PDX(UTOP) && !shared; pdeno++) {
 
 		// only look at mapped page tables
 		if (!(e->env_pgdir[pdeno] & PTE_P))
 			continue;
 
+		// a 4MB page has no page table
+		if (e->env_pgdir[pdeno] & PTE_PS) {
+			page_remove(e->env_pgdir, PGADDR(pdeno, 0, 0));
+			continue;
+		}
+
 		// find the pa and va of the page table
 		pa = PTE_ADDR(e->env_pgdir[pdeno]);
 		pt = (pte_t*) KADDR(pa);
 
+		// a page table shared since fork keeps its pages mapped
+		// for the others using it
+		if ((e->env_pgdir[pdeno] & PTE_COW) && pa2page(pa)->pp_ref > 1) {
+			e->env_pgdir[pdeno] = 0;
+			page_decref(pa2page(pa));
+			continue;
+		}
+
 		// unmap all PTEs in this page table
 		for (pteno = 0; pteno <= PTX(~0); pteno++) {
 			if (pt[pteno] & PTE_P)
@@ -633,10 +739,31 @@ env_free(struct Env *e)
 	e->env_pgdir = 0;
 	page_decref(pa2page(pa));
 #endif
-	// return the environment to the free list
-	e->env_status = ENV_FREE;
-	e->env_link = env_free_list;
-	env_free_list = e;
+	// its zombie children have nobody left to collect them
+	for (z = envs; e->env_nzombies && z < envs + NENV; z++)
+		if (z->env_status == ENV_ZOMBIE &&
+		    z->env_parent_id == e->env_id) {
+			e->env_nzombies--;
+			env_release(z);
+		}
+
+	// fail the calls still waiting for it to receive, and drop the
+	// messages in its mailbox and those it sent to other ones
+	sched_wake_all(&e->env_ipc_callers, -E_BAD_ENV);
+	ipc_mbox_flush(e);
+
+	// tell those waiting for it, and return the environment
+	// to the free list, or keep it for the parent
+	if (e->env_parent_id &&
+	    envid2env(e->env_parent_id, &parent, 0) == 0 &&
+	    !env_parent_waits(e)) {
+		sched_wake_all(&e->env_exit_waiters, e->env_exit_status);
+		sched_set_status(e, ENV_ZOMBIE);
+		parent->env_nzombies++;
+		return;
+	}
+	sched_wake_all(&e->env_exit_waiters, e->env_exit_status);
+	env_release(e);
 }
 
 //
@@ -648,6 +775,14 @@ void
 env_destroy(struct Env *e)
 {
 	//LAB 3: Your code here.
+	// If e is currently on another CPU, change its state to
+	// ENV_DYING.  A dying environment will be freed the next time
+	// it traps to the kernel, which sched_set_status() makes it do.
+	if (e != curenv && cpus[e->env_cpunum].cpu_env == e) {
+		sched_set_status(e, ENV_DYING);
+		return;
+	}
+
 	env_free(e);
 
 	// Transfer the control to the scheduler.
@@ -665,6 +800,7 @@ env_destroy(struct Env *e)
 void
 csys_exit(void)
 {
+	curenv->env_exit_status = 0;
 	env_destroy(curenv);
 }
 
@@ -768,16 +904,24 @@ env_run(struct Env *e)
 	{
 		if (curenv && curenv->env_status == ENV_RUNNING)
 		{
-			curenv->env_status = ENV_RUNNABLE;
+			sched_set_status(curenv, ENV_RUNNABLE);
 		}
 
 		curenv = e;
-		curenv->env_status = ENV_RUNNING;
 		curenv->env_runs++;
 	}
 
+	// Takes e off the run queue, also when it is curenv again.
+	sched_set_status(e, ENV_RUNNING);
+
 	//LAB 8: Your code here.
 	lcr3(PADDR(e->env_pgdir));
+	if (e->env_ipc_words_in)
+		ipc_words_copyout(e);
+	sched_timer_arm();
+	e->env_tsc_start = read_tsc();
+
+	unlock_kernel();
 	env_pop_tf(&e->env_tf);
 }
 
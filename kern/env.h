@@ -7,13 +7,14 @@
 #include <kern/cpu.h>
 
 extern struct Env *envs;		// All environments
-extern struct Env *curenv;
+#define curenv (thiscpu->cpu_env)		// Current environment
 extern struct Segdesc gdt[];
 
 void	env_init(void);
 void	env_init_percpu(void);
 int	env_alloc(struct Env **e, envid_t parent_id);
 void	env_free(struct Env *e);
+int	env_reap(struct Env *parent, envid_t envid);
 void	env_create(uint8_t *binary, size_t size, enum EnvType type);
 void	env_destroy(struct Env *e);	// Does not return if e == curenv
 
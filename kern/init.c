@@ -9,15 +9,21 @@
 #include <kern/tsc.h>
 #include <kern/console.h>
 #include <kern/pmap.h>
+#include <kern/kmalloc.h>
 #include <kern/env.h>
 #include <kern/trap.h>
 #include <kern/sched.h>
+#include <kern/syscall.h>
 #include <kern/cpu.h>
 #include <kern/picirq.h>
 #include <kern/kclock.h>
+#include <kern/clockev.h>
+#include <kern/spinlock.h>
 
 int *vsys;
 
+static void boot_aps(void);
+
 void
 i386_init(void)
 {
@@ -53,10 +59,16 @@ i386_init(void)
 	// Lab 6 memory management initialization functions
 	mem_init();
 #endif
+	kmem_init();
 
 	// user environment initialization functions
 	env_init();
 	trap_init();
+	ipc_init();
+
+	// Lab 4 multiprocessor initialization functions
+	mp_init();
+	lapic_init();
 
 	clock_idt_init();
 
@@ -65,11 +77,26 @@ i386_init(void)
 
 	// Initialize vsys[VSYS_gettime] before we start receiving
 	// IRQ_CLOCK interrupts
-	vsys[VSYS_gettime] = gettime();
+	time_init();
+	vsys[VSYS_gettime] = time_now();
+	vsys[VSYS_tsc_khz] = cpu_freq;
 
 	// Enable the IRQ_CLOCK interrupt
 	irq_setmask_8259A(irq_mask_8259A & ~(1 << IRQ_CLOCK));
 
+	// Enable the IRQ_TIMER interrupt.  It comes when the scheduler
+	// asks for it, see sched_timer_arm().
+	clockev_init();
+
+	// Test the locks while no other CPU can take them
+	check_spinlock();
+
+	// Acquire the big kernel lock before waking up APs
+	lock_kernel();
+
+	// Starting non-boot CPUs
+	boot_aps();
+
 #ifdef CONFIG_KSPACE
 	// Touch all you want.
 	ENV_CREATE_KERNEL_TYPE(prog_test1);
@@ -97,6 +124,61 @@ i386_init(void)
 	sched_yield();
 }
 
+// While boot_aps is booting a given CPU, it communicates the per-core
+// stack pointer that should be loaded by mpentry.S to that CPU in
+// this variable.
+void *mpentry_kstack;
+
+// Start the non-boot (AP) processors.
+static void
+boot_aps(void)
+{
+	extern unsigned char mpentry_start[], mpentry_end[];
+	void *code;
+	struct CpuInfo *c;
+
+	// Write entry code to unused memory at MPENTRY_PADDR
+	code = KADDR(MPENTRY_PADDR);
+	memmove(code, mpentry_start, mpentry_end - mpentry_start);
+
+	// Boot each AP one at a time
+	for (c = cpus; c < cpus + ncpu; c++) {
+		if (c == cpus + cpunum())  // We've started already.
+			continue;
+
+		// Tell mpentry.S what stack to use
+		mpentry_kstack = percpu_kstacks[c - cpus] + KSTKSIZE;
+		// Start the CPU at mpentry_start
+		lapic_startap(c->cpu_id, PADDR(code));
+		// Wait for the CPU to finish some basic setup in mp_main()
+		while(c->cpu_status != CPU_STARTED)
+			;
+	}
+}
+
+// Setup code for APs
+void
+mp_main(void)
+{
+	// We are in high EIP now, safe to switch to kern_pgdir, with
+	// the same cr4 flags as the boot CPU.
+	lcr4(rcr4() | CR4_PSE);
+	lcr3(PADDR(kern_pgdir));
+	lcr4(rcr4() | CR4_PGE);
+	cprintf("SMP: CPU %d starting\n", cpunum());
+
+	lapic_init();
+	env_init_percpu();
+	trap_init_percpu();
+	xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
+
+	// Now that we have finished some basic setup, take the kernel
+	// lock and look for an environment to run.  The timer is armed
+	// by whichever this CPU runs first, or by sched_halt().
+	lock_kernel();
+	sched_yield();
+}
+
 
 /*
  * Variable panicstr contains argument to first call to panic; used as flag
@@ -56,6 +56,8 @@ void mc146818_write(unsigned reg, unsigned datum);
 
 int gettime(void);
 int gettimestamp(void);
+void time_init(void);
+int time_now(void);
 
 #define BCD2BIN(bcd) ((((bcd)&15) + ((bcd)>>4)*10))
 
@@ -0,0 +1,497 @@
+// Slab allocator for kernel objects.
+//
+// kmem_cache_alloc() hands out objects of one size from a cache,
+// kmalloc() picks one of the power-of-two size class caches or, for
+// large sizes, takes whole pages.  Allocation and free are O(1): a
+// cache keeps its slabs with free objects on a list, and a slab keeps
+// its free objects on a list threaded through the objects themselves.
+
+#include <inc/types.h>
+#include <inc/stdio.h>
+#include <inc/assert.h>
+#include <inc/string.h>
+#include <inc/memlayout.h>
+
+#include <kern/pmap.h>
+#include <kern/kmalloc.h>
+
+// Every slab is one page and starts with this header.
+struct kmem_slab {
+	struct kmem_cache *sl_cache;	// Cache the slab belongs to
+	struct kmem_slab *sl_next;	// Links on kc_partial
+	struct kmem_slab *sl_prev;
+	void *sl_free;			// Free objects, linked through
+					// their first word
+	unsigned sl_inuse;		// Objects handed out
+};
+
+#define KMALLOC_NCLASSES	8	// KMALLOC_MIN_SIZE .. KMALLOC_MAX_SLAB
+
+static const char *kmalloc_names[KMALLOC_NCLASSES] = {
+	"kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+	"kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048",
+};
+
+static struct kmem_cache kmalloc_caches[KMALLOC_NCLASSES];
+static struct kmem_cache kmem_cache_cache;	// Caches are objects too
+static struct kmem_cache *kmem_caches;		// All caches
+static struct spinlock kmem_lock;		// Protects kmem_caches
+static bool kmem_ready;
+
+static void check_kmem(void);
+
+// --------------------------------------------------------------
+// Pages backing the slabs and large kmalloc() blocks.
+// --------------------------------------------------------------
+
+#ifdef CONFIG_KSPACE
+
+// There is no physical page allocator with CONFIG_KSPACE, so the pages
+// come from a static arena, one at a time.
+#define KMEM_ARENA_PAGES	32
+
+static uint8_t kmem_arena[KMEM_ARENA_PAGES * PGSIZE]
+	__attribute__((aligned(PGSIZE)));
+static void *kmem_arena_free;	// Free pages, linked through their first word
+static struct spinlock kmem_arena_lock;
+
+static void
+kmem_page_init(void)
+{
+	int i;
+
+	spin_initlock(&kmem_arena_lock);
+	for (i = KMEM_ARENA_PAGES; i-- > 0; ) {
+		*(void **) &kmem_arena[i * PGSIZE] = kmem_arena_free;
+		kmem_arena_free = &kmem_arena[i * PGSIZE];
+	}
+}
+
+static void *
+kmem_page_get(int order, int alloc_flags)
+{
+	void *va;
+
+	if (order > 0)
+		return NULL;
+
+	spin_lock(&kmem_arena_lock);
+	if ((va = kmem_arena_free))
+		kmem_arena_free = *(void **) va;
+	spin_unlock(&kmem_arena_lock);
+
+	if (va && (alloc_flags & ALLOC_ZERO))
+		memset(va, 0, PGSIZE);
+	return va;
+}
+
+static void
+kmem_page_put(void *va)
+{
+	spin_lock(&kmem_arena_lock);
+	*(void **) va = kmem_arena_free;
+	kmem_arena_free = va;
+	spin_unlock(&kmem_arena_lock);
+}
+
+#else
+
+static void
+kmem_page_init(void)
+{
+}
+
+static void *
+kmem_page_get(int order, int alloc_flags)
+{
+	struct PageInfo *pp;
+
+	// Order 0 goes through page_alloc() to use the zero pool.
+	pp = order ? page_alloc_order(order, alloc_flags) :
+		     page_alloc(alloc_flags);
+	if (!pp)
+		return NULL;
+
+	pp->pp_ref++;
+	return page2kva(pp);
+}
+
+static void
+kmem_page_put(void *va)
+{
+	// The block order is kept in the page, page_free() knows it.
+	page_decref(pa2page(PADDR(va)));
+}
+
+#endif
+
+// --------------------------------------------------------------
+// Caches and slabs.
+// --------------------------------------------------------------
+
+// Fill in cp and add it to kmem_caches.
+// Returns 0, leaving cp out, if the objects do not fit in a slab.
+static int
+kmem_cache_setup(struct kmem_cache *cp, const char *name, size_t size,
+		 size_t align)
+{
+	if (align < sizeof(void *))
+		align = sizeof(void *);
+	assert((align & (align - 1)) == 0);
+
+	memset(cp, 0, sizeof(*cp));
+	cp->kc_name = name;
+	cp->kc_align = align;
+	cp->kc_size = ROUNDUP(MAX(size, sizeof(void *)), align);
+	cp->kc_offset = ROUNDUP(sizeof(struct kmem_slab), align);
+	cp->kc_perslab = cp->kc_offset < PGSIZE ?
+		(PGSIZE - cp->kc_offset) / cp->kc_size : 0;
+
+	if (!cp->kc_perslab)
+		return 0;
+	__spin_initlock(&cp->kc_lock, name);
+
+	spin_lock(&kmem_lock);
+	cp->kc_next = kmem_caches;
+	kmem_caches = cp;
+	spin_unlock(&kmem_lock);
+	return 1;
+}
+
+static void
+kmem_slab_link(struct kmem_cache *cp, struct kmem_slab *sp)
+{
+	sp->sl_prev = NULL;
+	sp->sl_next = cp->kc_partial;
+	if (sp->sl_next)
+		sp->sl_next->sl_prev = sp;
+	cp->kc_partial = sp;
+}
+
+static void
+kmem_slab_unlink(struct kmem_cache *cp, struct kmem_slab *sp)
+{
+	if (sp->sl_prev)
+		sp->sl_prev->sl_next = sp->sl_next;
+	else
+		cp->kc_partial = sp->sl_next;
+	if (sp->sl_next)
+		sp->sl_next->sl_prev = sp->sl_prev;
+	sp->sl_next = sp->sl_prev = NULL;
+}
+
+// Get a page and carve it into free objects for cp.
+static struct kmem_slab *
+kmem_slab_new(struct kmem_cache *cp)
+{
+	struct kmem_slab *sp;
+	char *obj;
+	unsigned i;
+
+	if (!(sp = kmem_page_get(0, 0)))
+		return NULL;
+
+	sp->sl_cache = cp;
+	sp->sl_next = sp->sl_prev = NULL;
+	sp->sl_free = NULL;
+	sp->sl_inuse = 0;
+
+	// Thread the list from the last object down, so that objects
+	// are handed out in address order.
+	for (i = cp->kc_perslab; i-- > 0; ) {
+		obj = (char *) sp + cp->kc_offset + i * cp->kc_size;
+		*(void **) obj = sp->sl_free;
+		sp->sl_free = obj;
+	}
+
+	cp->kc_nslabs++;
+	return sp;
+}
+
+//
+// Set up the size class caches for kmalloc().
+// Must be called after mem_init() and before any other kmem function.
+//
+void
+kmem_init(void)
+{
+	int i;
+
+	spin_initlock(&kmem_lock);
+	kmem_page_init();
+
+	kmem_cache_setup(&kmem_cache_cache, "kmem_cache",
+			 sizeof(struct kmem_cache), 0);
+	for (i = 0; i < KMALLOC_NCLASSES; i++)
+		kmem_cache_setup(&kmalloc_caches[i], kmalloc_names[i],
+				 KMALLOC_MIN_SIZE << i, 0);
+	kmem_ready = 1;
+
+	check_kmem();
+}
+
+//
+// Create a cache of objects of 'size' bytes, aligned to 'align'
+// (a power of two, 0 for the natural word alignment).
+// Returns NULL if the objects do not fit in a slab or out of memory.
+//
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size, size_t align)
+{
+	struct kmem_cache *cp;
+
+	assert(kmem_ready);
+
+	if (!(cp = kmem_cache_alloc(&kmem_cache_cache, 0)))
+		return NULL;
+
+	if (!kmem_cache_setup(cp, name, size, align)) {
+		kmem_cache_free(&kmem_cache_cache, cp);
+		return NULL;
+	}
+	return cp;
+}
+
+//
+// Destroy a cache created by kmem_cache_create().
+// All its objects must have been freed.
+//
+void
+kmem_cache_destroy(struct kmem_cache *cp)
+{
+	struct kmem_cache **cpp;
+
+	if (cp->kc_inuse)
+		panic("kmem_cache_destroy: %s has %u objects in use",
+		      cp->kc_name, cp->kc_inuse);
+
+	// With no objects in use the only slab left is the empty one.
+	assert(!cp->kc_partial);
+	if (cp->kc_empty)
+		kmem_page_put(cp->kc_empty);
+
+	spin_lock(&kmem_lock);
+	for (cpp = &kmem_caches; *cpp != cp; cpp = &(*cpp)->kc_next)
+		;
+	*cpp = cp->kc_next;
+	spin_unlock(&kmem_lock);
+
+	spin_destroylock(&cp->kc_lock);
+	kmem_cache_free(&kmem_cache_cache, cp);
+}
+
+//
+// Allocate an object from cp.  If (alloc_flags & ALLOC_ZERO), the
+// object is filled with '\0' bytes.  Returns NULL if out of memory.
+//
+void *
+kmem_cache_alloc(struct kmem_cache *cp, int alloc_flags)
+{
+	struct kmem_slab *sp;
+	void *obj;
+
+	spin_lock(&cp->kc_lock);
+
+	if (!(sp = cp->kc_partial)) {
+		if ((sp = cp->kc_empty))
+			cp->kc_empty = NULL;
+		else if (!(sp = kmem_slab_new(cp))) {
+			spin_unlock(&cp->kc_lock);
+			return NULL;
+		}
+		kmem_slab_link(cp, sp);
+	}
+
+	obj = sp->sl_free;
+	sp->sl_free = *(void **) obj;
+	if (++sp->sl_inuse == cp->kc_perslab)
+		kmem_slab_unlink(cp, sp);
+
+	cp->kc_inuse++;
+	cp->kc_nalloc++;
+
+	spin_unlock(&cp->kc_lock);
+
+	if (alloc_flags & ALLOC_ZERO)
+		memset(obj, 0, cp->kc_size);
+	return obj;
+}
+
+//
+// Return an object to the cache it was allocated from.
+// One fully free slab is kept for the next allocation, further ones
+// give their page back.
+//
+void
+kmem_cache_free(struct kmem_cache *cp, void *obj)
+{
+	struct kmem_slab *sp;
+
+	sp = ROUNDDOWN(obj, PGSIZE);
+
+	// Check under the lock: a concurrent free may release the slab.
+	spin_lock(&cp->kc_lock);
+	if (sp->sl_cache != cp || !sp->sl_inuse)
+		panic("kmem_cache_free: %p is not an object of %s",
+		      obj, cp->kc_name);
+
+	// A full slab gets a free object again.
+	if (sp->sl_inuse-- == cp->kc_perslab)
+		kmem_slab_link(cp, sp);
+
+	*(void **) obj = sp->sl_free;
+	sp->sl_free = obj;
+	cp->kc_inuse--;
+
+	if (!sp->sl_inuse) {
+		kmem_slab_unlink(cp, sp);
+		if (!cp->kc_empty)
+			cp->kc_empty = sp;
+		else {
+			cp->kc_nslabs--;
+			kmem_page_put(sp);
+		}
+	}
+
+	spin_unlock(&cp->kc_lock);
+}
+
+//
+// Allocate 'size' bytes of kernel memory.  Sizes up to KMALLOC_MAX_SLAB
+// come from the smallest size class cache that fits, larger ones are
+// page aligned blocks of contiguous pages.  If (alloc_flags &
+// ALLOC_ZERO), the memory is filled with '\0' bytes.
+// Returns NULL if out of memory.
+//
+void *
+kmalloc(size_t size, int alloc_flags)
+{
+	int i, order;
+
+	if (size <= KMALLOC_MAX_SLAB) {
+		for (i = 0; (KMALLOC_MIN_SIZE << i) < size; i++)
+			;
+		return kmem_cache_alloc(&kmalloc_caches[i], alloc_flags);
+	}
+
+	for (order = 0; (PGSIZE << order) < size; order++)
+		if (order == PAGE_MAX_ORDER)
+			return NULL;
+	return kmem_page_get(order, alloc_flags);
+}
+
+//
+// Free memory allocated by kmalloc().  kfree(NULL) does nothing.
+//
+void
+kfree(void *ptr)
+{
+	struct kmem_slab *sp;
+
+	if (!ptr)
+		return;
+
+	// Slab objects never start a page, the slab header does.
+	if (PGOFF(ptr) == 0) {
+		kmem_page_put(ptr);
+		return;
+	}
+
+	sp = ROUNDDOWN(ptr, PGSIZE);
+	kmem_cache_free(sp->sl_cache, ptr);
+}
+
+//
+// Print the state of all caches, for the kernel monitor.
+//
+void
+kmem_print(void)
+{
+	struct kmem_cache *cp;
+
+	cprintf("%-16s %6s %6s %6s %10s\n",
+		"cache", "size", "inuse", "slabs", "allocs");
+
+	spin_lock(&kmem_lock);
+	for (cp = kmem_caches; cp; cp = cp->kc_next)
+		cprintf("%-16s %6u %6u %6u %10u\n", cp->kc_name,
+			cp->kc_size, cp->kc_inuse, cp->kc_nslabs,
+			cp->kc_nalloc);
+	spin_unlock(&kmem_lock);
+}
+
+// --------------------------------------------------------------
+// Checking functions.
+// --------------------------------------------------------------
+
+static void
+check_kmem(void)
+{
+	struct kmem_cache *cp;
+	void *objs[2 * PGSIZE / 24];
+	char *p, *q;
+	unsigned i, n;
+
+	// a cache spills over into a second slab ...
+	assert((cp = kmem_cache_create("check_kmem", 24, 8)));
+	assert(cp->kc_size == 24 && cp->kc_perslab > 1);
+	n = cp->kc_perslab + 1;
+	assert(n <= sizeof(objs) / sizeof(objs[0]));
+	for (i = 0; i < n; i++) {
+		assert((objs[i] = kmem_cache_alloc(cp, ALLOC_ZERO)));
+		assert(((uintptr_t) objs[i] & 7) == 0);
+		assert(PGOFF(objs[i]) != 0);
+		assert(*(uint32_t *) objs[i] == 0);
+		memset(objs[i], 0x5a, 24);
+		if (i)
+			assert(objs[i] != objs[i - 1]);
+	}
+	assert(cp->kc_nslabs == 2 && cp->kc_inuse == n);
+	assert(ROUNDDOWN(objs[0], PGSIZE) != ROUNDDOWN(objs[n - 1], PGSIZE));
+
+	// ... hands freed objects out again ...
+	kmem_cache_free(cp, objs[1]);
+	assert(kmem_cache_alloc(cp, 0) == objs[1]);
+
+	// ... and keeps one empty slab once everything is freed
+	for (i = 0; i < n; i++)
+		kmem_cache_free(cp, objs[i]);
+	assert(cp->kc_inuse == 0 && cp->kc_nslabs == 1);
+	kmem_cache_destroy(cp);
+
+	// too large for a slab
+	assert(!kmem_cache_create("check_kmem", PGSIZE, 0));
+
+	// kmalloc size classes
+	assert((p = kmalloc(1, 0)));
+	assert((q = kmalloc(KMALLOC_MIN_SIZE + 1, ALLOC_ZERO)));
+	assert(((struct kmem_slab *) ROUNDDOWN(p, PGSIZE))->sl_cache->kc_size ==
+	       KMALLOC_MIN_SIZE);
+	assert(((struct kmem_slab *) ROUNDDOWN(q, PGSIZE))->sl_cache->kc_size ==
+	       2 * KMALLOC_MIN_SIZE);
+	for (i = 0; i < 2 * KMALLOC_MIN_SIZE; i++)
+		assert(q[i] == 0);
+	kfree(p);
+	kfree(q);
+
+	// kmalloc of more than a slab takes whole pages
+	assert((p = kmalloc(KMALLOC_MAX_SLAB + 1, ALLOC_ZERO)));
+	assert(PGOFF(p) == 0);
+	memset(p, 0x5a, KMALLOC_MAX_SLAB + 1);
+	kfree(p);
+	kfree(NULL);
+
+#ifndef CONFIG_KSPACE
+	{
+		size_t nfree = page_nfree();
+
+		assert((p = kmalloc(3 * PGSIZE, 0)));
+		assert(page_nfree() == nfree - 4);
+		memset(p, 0x5a, 3 * PGSIZE);
+		kfree(p);
+		assert(page_nfree() == nfree);
+	}
+#endif
+
+	cprintf("check_kmem() succeeded!\n");
+}
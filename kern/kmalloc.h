@@ -0,0 +1,51 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_KMALLOC_H
+#define JOS_KERN_KMALLOC_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <kern/spinlock.h>
+
+struct kmem_slab;
+
+// A cache of equally sized objects.  Objects are carved out of slabs,
+// one page each, that start with a struct kmem_slab header, so the
+// slab of any object is found by rounding its address down to PGSIZE.
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_size;			// Object size, rounded up to kc_align
+	size_t kc_align;		// Object alignment, a power of two
+	size_t kc_offset;		// Offset of the first object in a slab
+	unsigned kc_perslab;		// Number of objects in a slab
+
+	struct kmem_slab *kc_partial;	// Slabs with free objects
+	struct kmem_slab *kc_empty;	// A fully free slab kept around
+	struct spinlock kc_lock;
+
+	unsigned kc_nslabs;		// Slabs owned by the cache
+	unsigned kc_inuse;		// Objects handed out
+	uint32_t kc_nalloc;		// Allocations ever served
+
+	struct kmem_cache *kc_next;	// All caches, for kmem_print()
+};
+
+// kmalloc() sizes up to KMALLOC_MAX_SLAB come from the size class
+// caches, larger ones get whole pages.
+#define KMALLOC_MIN_SIZE	16
+#define KMALLOC_MAX_SLAB	2048
+
+void	kmem_init(void);
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align);
+void	kmem_cache_destroy(struct kmem_cache *cp);
+void	*kmem_cache_alloc(struct kmem_cache *cp, int alloc_flags);
+void	kmem_cache_free(struct kmem_cache *cp, void *obj);
+
+void	*kmalloc(size_t size, int alloc_flags);
+void	kfree(void *ptr);
+
+void	kmem_print(void);
+
+#endif	// !JOS_KERN_KMALLOC_H
@@ -12,7 +12,10 @@
 #include <kern/kdebug.h>
 #include <kern/tsc.h>
 #include <kern/pmap.h>
+#include <kern/kmalloc.h>
 #include <kern/trap.h>
+#include <kern/sched.h>
+#include <kern/spinlock.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -31,7 +34,11 @@ static struct Command commands[] = {
 	{ "backtrace", "Display the backtrace", mon_backtrace },
 	{ "timer_start", "Start the timer", mon_timer_start },
 	{ "timer_stop", "Stop the timer", mon_timer_stop },
-	{ "lppage", "Display the physical page list", mon_lppage }
+	{ "lppage", "Display the physical page list", mon_lppage },
+	{ "pgstat", "Display physical page allocator statistics", mon_pgstat },
+	{ "kmem", "Display kernel object cache statistics", mon_kmem },
+	{ "quantum", "Display or set the scheduling time slice in ms", mon_quantum },
+	{ "locks", "Display lock contention statistics, most contended first", mon_locks }
 };
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
 
@@ -154,6 +161,61 @@ mon_lppage(int argc, char **argv, struct Trapframe *tf)
 	return 0;
 }
 
+int
+mon_pgstat(int argc, char **argv, struct Trapframe *tf)
+{
+	cprintf("free pages: %u of %u\n", page_nfree(), npages);
+	cprintf("zero pool: %u hits, %u misses, %u pages zeroed when idle\n",
+		page_zero_stats.hits, page_zero_stats.misses,
+		page_zero_stats.filled);
+
+	return 0;
+}
+
+int
+mon_kmem(int argc, char **argv, struct Trapframe *tf)
+{
+	kmem_print();
+
+	return 0;
+}
+
+int
+mon_quantum(int argc, char **argv, struct Trapframe *tf)
+{
+	long ms;
+	char *end;
+
+	if (argc > 2) {
+		cprintf("usage: quantum [ms]\n");
+		return 0;
+	}
+
+	if (argc == 2) {
+		ms = strtol(argv[1], &end, 10);
+		if (*end || ms <= 0) {
+			cprintf("quantum: bad time slice '%s'\n", argv[1]);
+			return 0;
+		}
+		sched_quantum_ms = ms;
+	}
+
+	cprintf("time slice: %u ms\n", sched_quantum_ms);
+	return 0;
+}
+
+int
+mon_locks(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc > 2 || (argc == 2 && strcmp(argv[1], "reset"))) {
+		cprintf("usage: locks [reset]\n");
+		return 0;
+	}
+
+	spin_print_stats(argc == 2);
+	return 0;
+}
+
 /***** Kernel monitor command interpreter *****/
 
 #define WHITESPACE "\t\r\n "
@@ -19,5 +19,9 @@ int mon_echo(int argc, char **argv, struct Trapframe *tf);
 int mon_timer_start(int argc, char **argv, struct Trapframe *tf);
 int mon_timer_stop(int argc, char **argv, struct Trapframe *tf);
 int mon_lppage(int argc, char **argv, struct Trapframe *tf);
+int mon_pgstat(int argc, char **argv, struct Trapframe *tf);
+int mon_kmem(int argc, char **argv, struct Trapframe *tf);
+int mon_quantum(int argc, char **argv, struct Trapframe *tf);
+int mon_locks(int argc, char **argv, struct Trapframe *tf);
 
 #endif	// !JOS_KERN_MONITOR_H
@@ -12,6 +12,7 @@
 #include <kern/pmap.h>
 #include <kern/kclock.h>
 #include <kern/env.h>
+#include <kern/cpu.h>
 
 #ifdef SANITIZE_SHADOW_BASE
 // asan unpoison routine used for whitelisting regions.
@@ -28,14 +29,17 @@ static size_t npages_basemem;	// Amount of base memory (in pages)
 int *vsys;  // Virtual syscall space
 pde_t *kern_pgdir;		// Kernel's initial page directory
 struct PageInfo *pages;		// Physical page state array
-static struct PageInfo *page_free_list;	// Free list of physical pages
-struct PageInfo *page_free_list_top;
+static struct PageInfo *page_free_area[PAGE_NORDERS]; // Buddy free lists
+static size_t npages_free;	// Number of pages in all free blocks
+static struct PageInfo *page_zero_list;	// Free pages that are already zeroed
+static size_t npages_zero;	// Length of page_zero_list
+struct PageZeroStats page_zero_stats;
 char *cwd;			// Current working directory path
 size_t cwd_len;			// Current working directory path's length
 unsigned login_attempts;
 
-// This variable is used by user_mem_assert() and
-// user_mem_check()
+// This variable is used by user_mem_assert(), user_mem_check(),
+// copy_from_user() and copy_to_user()
 static uintptr_t invalid_user_va;
 
 // --------------------------------------------------------------
@@ -90,6 +94,7 @@ i386_detect_memory(void)
 static void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
 static void check_page_free_list(bool only_low_memory);
 static void check_page_alloc(void);
+static void mem_init_mp(void);
 static void check_kern_pgdir(void);
 static physaddr_t check_va2pa(pde_t *pgdir, uintptr_t va);
 static void check_page(void);
@@ -106,7 +111,7 @@ static void check_page_installed_pgdir(void);
 //
 // If we're out of memory, boot_alloc should panic.
 // This function may ONLY be used during initialization,
-// before the page_free_list list has been set up.
+// before the buddy free lists have been set up.
 static void *
 boot_alloc(uint32_t n)
 {
@@ -274,19 +279,8 @@ mem_init(void)
 		ROUNDUP(NCWD * sizeof(char), PGSIZE),
 		PADDR(cwd), PTE_U | PTE_P);
 
-	//////////////////////////////////////////////////////////////////////
-	// Use the physical memory that 'bootstack' refers to as the kernel
-	// stack.  The kernel stack grows down from virtual address KSTACKTOP.
-	// We consider the entire range from [KSTACKTOP-PTSIZE, KSTACKTOP)
-	// to be the kernel stack, but break this into two pieces:
-	//     * [KSTACKTOP-KSTKSIZE, KSTACKTOP) -- backed by physical memory
-	//     * [KSTACKTOP-PTSIZE, KSTACKTOP-KSTKSIZE) -- not backed; so if
-	//       the kernel overflows its stack, it will fault rather than
-	//       overwrite memory.  Known as a "guard page".
-	//     Permissions: kernel RW, user NONE
-	// Your code goes here:
-	boot_map_region(kern_pgdir, KSTACKTOP - KSTKSIZE, KSTKSIZE, 
-		PADDR(bootstack), PTE_W | PTE_P);
+	// Initialize the SMP-related parts of the memory map
+	mem_init_mp();
 
 	//////////////////////////////////////////////////////////////////////
 	// Map all of physical memory at KERNBASE.
@@ -295,10 +289,12 @@ mem_init(void)
 	// We might not have 2^32 - KERNBASE bytes of physical memory, but
 	// we just set up the mapping anyway.
 	// Permissions: kernel RW, user NONE
+	// The region is mapped with 4MB pages, which saves the page tables
+	// and keeps the TLB from filling up with kernel entries.
 	// Your code goes here:
 	boot_map_region(kern_pgdir, KERNBASE, 
 		ROUNDUP((1ULL << 32) - KERNBASE, PGSIZE), 
-		0, PTE_W | PTE_P);
+		0, PTE_W | PTE_P | PTE_PS | PTE_G);
 
 	// Check that the initial page directory has been set up correctly.
 	check_kern_pgdir();
@@ -310,7 +306,13 @@ mem_init(void)
 	//
 	// If the machine reboots at this point, you've probably set up your
 	// kern_pgdir wrong.
+	//
+	// The 4MB pages of kern_pgdir need page size extensions turned on
+	// first.  Global pages are enabled only afterwards, so that no
+	// entry_pgdir translation outlives the switch.
+	lcr4(rcr4() | CR4_PSE);
 	lcr3(PADDR(kern_pgdir));
+	lcr4(rcr4() | CR4_PGE);
 
 	check_page_free_list(0);
 
@@ -327,17 +329,106 @@ mem_init(void)
 	check_page_installed_pgdir();
 }
 
+// Modify mappings in kern_pgdir to support SMP
+//   - Map the per-CPU stacks in the region [KSTACKTOP-PTSIZE, KSTACKTOP)
+//
+static void
+mem_init_mp(void)
+{
+	// Map per-CPU stacks starting at KSTACKTOP, for up to 'NCPU' CPUs.
+	//
+	// For CPU i, use the physical memory that 'percpu_kstacks[i]' refers
+	// to as its kernel stack. CPU i's kernel stack grows down from virtual
+	// address kstacktop_i = KSTACKTOP - i * (KSTKSIZE + KSTKGAP), and is
+	// divided into two pieces, just like the single stack you set up in
+	// mem_init:
+	//     * [kstacktop_i - KSTKSIZE, kstacktop_i)
+	//          -- backed by physical memory
+	//     * [kstacktop_i - (KSTKSIZE + KSTKGAP), kstacktop_i - KSTKSIZE)
+	//          -- not backed; so if the kernel overflows its stack,
+	//             it will fault rather than overwrite another CPU's stack.
+	//             Known as a "guard page".
+	//     Permissions: kernel RW, user NONE
+	// Like all kernel-only mappings they are global, so their TLB
+	// entries survive the lcr3 of a context switch.
+	uintptr_t kstacktop_i;
+	int i;
+
+	for (i = 0; i < NCPU; i++)
+	{
+		kstacktop_i = KSTACKTOP - i * (KSTKSIZE + KSTKGAP);
+		boot_map_region(kern_pgdir, kstacktop_i - KSTKSIZE, KSTKSIZE,
+			PADDR(percpu_kstacks[i]), PTE_W | PTE_P | PTE_G);
+	}
+}
+
 // --------------------------------------------------------------
 // Tracking of physical pages.
 // The 'pages' array has one 'struct PageInfo' entry per physical page.
-// Pages are reference counted, and free pages are kept on a linked list.
+// Pages are reference counted, and free pages are kept by a buddy
+// allocator: page_free_area[o] is a doubly-linked list of free blocks
+// of 1 << o naturally aligned pages.  Only the first page of a free
+// block is on a list; it carries PP_FREE and the block order.
 // --------------------------------------------------------------
 
+static void
+page_list_add(struct PageInfo *pp, int order)
+{
+	pp->pp_order = order;
+	pp->pp_flags |= PP_FREE;
+	pp->pp_prev = NULL;
+	pp->pp_link = page_free_area[order];
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp;
+	page_free_area[order] = pp;
+}
+
+static void
+page_list_del(struct PageInfo *pp)
+{
+	if (pp->pp_prev)
+		pp->pp_prev->pp_link = pp->pp_link;
+	else
+		page_free_area[pp->pp_order] = pp->pp_link;
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp->pp_prev;
+
+	pp->pp_link = NULL;
+	pp->pp_prev = NULL;
+	pp->pp_flags &= ~PP_FREE;
+}
+
+// Put the block of 1 << order pages starting at pp on the free lists,
+// merging it with its buddy for as long as the buddy is free too.
+static void
+buddy_free(struct PageInfo *pp, int order)
+{
+	size_t idx, bidx;
+	struct PageInfo *buddy;
+
+	npages_free += 1 << order;
+
+	for (idx = pp - pages; order < PAGE_MAX_ORDER; order++) {
+		bidx = idx ^ (1 << order);
+		if (bidx >= npages)
+			break;
+
+		buddy = &pages[bidx];
+		if (!(buddy->pp_flags & PP_FREE) || buddy->pp_order != order)
+			break;
+
+		page_list_del(buddy);
+		idx &= ~(1 << order);
+	}
+
+	page_list_add(&pages[idx], order);
+}
+
 //
 // Initialize page structure and memory free list.
 // After this is done, NEVER use boot_alloc again.  ONLY use the page
 // allocator functions below to allocate and deallocate physical
-// memory via the page_free_list.
+// memory via the buddy free lists.
 //
 void
 page_init(void)
@@ -359,115 +450,229 @@ page_init(void)
 	// Change the code to reflect this.
 	// NB: DO NOT actually touch the physical memory corresponding to
 	// free pages!
-	size_t i;
+	size_t i, first_free;
 
-	// i = 1 skips IDT and BIOS
-	page_free_list_top = &pages[1];
+	first_free = PADDR(boot_alloc(0)) / PGSIZE;
 
-	pages[0].pp_ref = 1;
-
-	for (i = 1; i < npages_basemem; i++)
-	{
-		pages[i].pp_ref = 0;
-		pages[i].pp_link = page_free_list;
-		page_free_list = &pages[i];
-	}
-
-	for (i = IOPHYSMEM / PGSIZE; i < EXTPHYSMEM / PGSIZE; i++)
+	// Pages are released from the top down, so that buddies merge
+	// into maximal blocks and the lowest block of every order ends
+	// up at the head of its list.  Early boot only has the low
+	// BOOTMEMSIZE mapped, so those pages have to be handed out first.
+	for (i = npages; i-- > 0; )
 	{
-		pages[i].pp_ref = 1;
-	}
-
-	for (i = EXTPHYSMEM / PGSIZE; i < npages; i++)
-	{	
-		if (i < PADDR(boot_alloc(0)) / PGSIZE)
+		if (i == 0 || i == MPENTRY_PADDR / PGSIZE ||
+			(i >= npages_basemem && i < first_free))
 		{
+			// Page 0, the AP startup code, the IO hole,
+			// the kernel and the boot_alloc'ed structures.
 			pages[i].pp_ref = 1;
 		}
 		else
 		{
 			pages[i].pp_ref = 0;
-			pages[i].pp_link = page_free_list;
-			page_free_list = &pages[i];
+			buddy_free(&pages[i], 0);
 		}
 	}
 }
 
 //
-// Allocates a physical page.  If (alloc_flags & ALLOC_ZERO), fills the entire
-// returned physical page with '\0' bytes.  Does NOT increment the reference
-// count of the page - the caller must do these if necessary (either explicitly
-// or via page_insert).
-//
-// Be sure to set the pp_link field of the allocated page to NULL so
-// page_free can check for double-free bugs.
+// Allocates a block of 1 << order physically contiguous pages, aligned
+// to its size.  If (alloc_flags & ALLOC_ZERO), fills the whole block
+// with '\0' bytes.  Does NOT increment the reference count of the
+// block - the caller must do these if necessary (either explicitly
+// or via page_insert).  The reference count of a block lives in its
+// first page, and page_free() releases the whole block.
 //
-// Returns NULL if out of free memory.
+// Returns NULL if there is no free block that large.
 //
-// Hint: use page2kva and memset
 struct PageInfo *
-page_alloc(int alloc_flags)
+page_alloc_order(int order, int alloc_flags)
 {
-	// Fill this function in
 	struct PageInfo *page;
+	int o;
 
-	if (!(page = page_free_list))
+	if (order < 0 || order > PAGE_MAX_ORDER)
 	{
 		return NULL;
 	}
 
-	if (!(page_free_list = page_free_list->pp_link))
+	// Take the smallest free block that fits.
+	for (o = order; o <= PAGE_MAX_ORDER && !page_free_area[o]; o++)
 	{
-		page_free_list_top = NULL;
+		;
 	}
 
-	page->pp_link = NULL;
-	
+	if (o > PAGE_MAX_ORDER)
+	{
+		// Pages held by the zero pool may be all that keeps
+		// the block we want from merging.
+		if (order > 0 && page_zero_drain())
+		{
+			return page_alloc_order(order, alloc_flags);
+		}
+		return NULL;
+	}
+
+	page = page_free_area[o];
+	page_list_del(page);
+
+	// Split it, giving the upper halves back to the free lists.
+	while (o > order)
+	{
+		o--;
+		page_list_add(page + (1 << o), o);
+	}
+
+	page->pp_order = order;
+	npages_free -= 1 << order;
+
 #ifdef SANITIZE_SHADOW_BASE
 	if (alloc_flags & ALLOC_ZERO)
 	{
-		__nosan_memset(page2kva(page), 0, PGSIZE);
+		__nosan_memset(page2kva(page), 0, PGSIZE << order);
 	}
 	// Unpoison allocated memory before accessing it!
-	platform_asan_unpoison(page2kva(page), PGSIZE);
+	platform_asan_unpoison(page2kva(page), PGSIZE << order);
 #else
 	if (alloc_flags & ALLOC_ZERO)
 	{
-		memset(page2kva(page), 0, PGSIZE);
+		memset(page2kva(page), 0, PGSIZE << order);
 	}
 #endif
 
 	return page;
 }
 
+// Take a page off the zero pool, or return NULL if it is empty.
+static struct PageInfo *
+page_zero_get(void)
+{
+	struct PageInfo *page;
+
+	if (!(page = page_zero_list))
+	{
+		return NULL;
+	}
+
+	page_zero_list = page->pp_link;
+	npages_zero--;
+	page->pp_link = NULL;
+	page->pp_flags &= ~PP_ZERO;
+
+	return page;
+}
+
+//
+// Allocates a physical page.  If (alloc_flags & ALLOC_ZERO), fills the entire
+// returned physical page with '\0' bytes.  Does NOT increment the reference
+// count of the page - the caller must do these if necessary (either explicitly
+// or via page_insert).
+//
+// The pp_link field of the allocated page is NULL, so page_free
+// can check for double-free bugs.
+//
+// Returns NULL if out of free memory.
+//
+struct PageInfo *
+page_alloc(int alloc_flags)
+{
+	struct PageInfo *page;
+
+	if (alloc_flags & ALLOC_ZERO)
+	{
+		if ((page = page_zero_get()))
+		{
+			page_zero_stats.hits++;
+			return page;
+		}
+		page_zero_stats.misses++;
+	}
+
+	if ((page = page_alloc_order(0, alloc_flags)))
+	{
+		return page;
+	}
+
+	// Out of unzeroed pages, the zero pool is all that is left.
+	return page_zero_get();
+}
+
 //
-// Return a page to the free list.
+// Return a block to the free lists.
 // (This function should only be called when pp->pp_ref reaches 0.)
 //
 void
 page_free(struct PageInfo *pp)
 {
-	// Fill this function in
-	// Hint: You may want to panic if pp->pp_ref is nonzero or
-	// pp->pp_link is not NULL.
-	
 	if (pp->pp_ref)
 	{
 		panic("page_free: pp_ref is nonzero");
 	}
 
-	if (pp->pp_link)
+	if (pp->pp_link || (pp->pp_flags & (PP_FREE | PP_ZERO)))
 	{
-		panic("page_free: pp_link is not NULL");
+		panic("page_free: page is already free");
 	}
 
-	pp->pp_link = page_free_list;
-	page_free_list = pp;
+	pp->pp_flags &= ~PP_PTSHARE;
+	buddy_free(pp, pp->pp_order);
+}
+
+//
+// Return the number of free physical pages.
+//
+size_t
+page_nfree(void)
+{
+	return npages_free + npages_zero;
+}
+
+//
+// Zero one free page and move it to the zero pool, so that a later
+// page_alloc(ALLOC_ZERO) does not have to.  Called by the idle loop.
+// Returns 0 once the pool is full or there is no free page left.
+//
+int
+page_zero_fill(void)
+{
+	struct PageInfo *page;
+
+	if (npages_zero >= PAGE_ZERO_POOL_MAX)
+	{
+		return 0;
+	}
 
-	if (!page_free_list_top)
+	if (!(page = page_alloc_order(0, ALLOC_ZERO)))
 	{
-		page_free_list_top = pp;
+		return 0;
 	}
+
+	page->pp_flags |= PP_ZERO;
+	page->pp_link = page_zero_list;
+	page_zero_list = page;
+	npages_zero++;
+	page_zero_stats.filled++;
+
+	return 1;
+}
+
+//
+// Give every page on the zero pool back to the buddy allocator.
+// Returns the number of pages released.
+//
+size_t
+page_zero_drain(void)
+{
+	struct PageInfo *page;
+	size_t n = 0;
+
+	while ((page = page_zero_get()))
+	{
+		buddy_free(page, 0);
+		n++;
+	}
+
+	return n;
 }
 
 //
@@ -481,6 +686,78 @@ page_decref(struct PageInfo* pp)
 		page_free(pp);
 }
 
+//
+// fork shares page tables between parent and child instead of copying
+// them, see pgdir_fork().  The page directory entries of a shared page
+// table have PTE_COW set and PTE_W clear, so a write anywhere in the
+// 4MB region faults, and the page table's pp_ref counts the page
+// directories using it.  The pages it maps are counted once, however
+// many address spaces see them through it.
+//
+// Give 'pde' a page table of its own, if it shares one: copy the table
+// if somebody else still uses it, or just make it writable again.  On
+// copying, pages that were writable become copy-on-write in both
+// tables, since there are two tables mapping them now.
+//
+// Returns 0 on success, -E_NO_MEM if out of memory.
+//
+static int
+page_table_unshare(pde_t *pde)
+{
+	struct PageInfo *pp, *copy;
+	pte_t *pt, *new_pt;
+	int i;
+
+	if ((*pde & (PTE_P | PTE_PS | PTE_COW)) != (PTE_P | PTE_COW))
+	{
+		return 0;
+	}
+
+	pp = pa2page(PTE_ADDR(*pde));
+
+	if (pp->pp_ref > 1)
+	{
+		if (!(copy = page_alloc(0)))
+		{
+			return -E_NO_MEM;
+		}
+
+		pt = (pte_t *) page2kva(pp);
+		new_pt = (pte_t *) page2kva(copy);
+
+		for (i = 0; i < NPTENTRIES; i++)
+		{
+			if ((pt[i] & (PTE_P | PTE_W | PTE_SHARE)) ==
+				(PTE_P | PTE_W))
+			{
+				pt[i] = (pt[i] & ~PTE_W) | PTE_COW;
+			}
+
+			if (pt[i] & PTE_P)
+			{
+				pa2page(PTE_ADDR(pt[i]))->pp_ref++;
+			}
+
+			new_pt[i] = pt[i];
+		}
+
+		copy->pp_ref++;
+		copy->pp_nresident = pp->pp_nresident;
+		pp->pp_ref--;
+		*pde = (pde_t) (page2pa(copy) | PTE_P | PTE_W | PTE_U);
+	}
+	else
+	{
+		*pde = (*pde & ~PTE_COW) | PTE_W;
+	}
+
+	// The whole 4MB region may be in the TLB read-only, and the pages
+	// of the other users of the table may have lost PTE_W.
+	tlb_flush(NULL);
+
+	return 0;
+}
+
 // Given 'pgdir', a pointer to a page directory, pgdir_walk returns
 // a pointer to the page table entry (PTE) for linear address 'va'.
 // This requires walking the two-level page table structure.
@@ -503,6 +780,15 @@ page_decref(struct PageInfo* pp)
 // Hint 3: look at inc/mmu.h for useful macros that mainipulate page
 // table and page directory entries.
 //
+// If 'va' is mapped by a 4MB page, there is no page table, and
+// pgdir_walk returns a pointer to the page directory entry itself.
+// Such an entry has PTE_PS set.
+//
+// A page table shared with other address spaces after fork is
+// read-only.  Callers pass create when they are going to change the
+// entry, and then a shared page table is made private first, which
+// can fail for lack of memory too.  See page_table_unshare().
+//
 pte_t *
 pgdir_walk(pde_t *pgdir, const void *va, int create)
 {
@@ -512,6 +798,16 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 
 	pde = &pgdir[PDX(va)];
 
+	if (*pde & PTE_PS)
+	{
+		return (pte_t *) pde;
+	}
+
+	if (create && page_table_unshare(pde) < 0)
+	{
+		return NULL;
+	}
+
 	if (!(*pde & PTE_P))
 	{
 		if (!create)
@@ -525,6 +821,7 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 		}
 
 		p->pp_ref++;
+		p->pp_nresident = 0;
 		*pde = (pde_t) (page2pa(p) | PTE_P | PTE_W | PTE_U);
 	}
 
@@ -541,6 +838,9 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 // above UTOP. As such, it should *not* change the pp_ref field on the
 // mapped pages.
 //
+// If perm has PTE_PS, the parts of the region that are 4MB aligned in
+// both va and pa are mapped with 4MB pages, the rest with 4KB pages.
+//
 // Hint: the TA solution uses pgdir_walk
 static void
 boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm)
@@ -551,17 +851,134 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
 
 	for (i = 0, size /= PGSIZE; i < size; i++)
 	{
+		if ((perm & PTE_PS) && !(va & (PTSIZE - 1)) &&
+			!(pa & (PTSIZE - 1)) && size - i >= NPTENTRIES)
+		{
+			pgdir[PDX(va)] = (pde_t) (pa | perm | PTE_P);
+			i += NPTENTRIES - 1;
+			va += PTSIZE;
+			pa += PTSIZE;
+			continue;
+		}
+
 		if (!(pte = pgdir_walk(pgdir, (void *) va, 1)))
 		{
 			panic("boot_map_region: pgdir_walk failure");
 		}
 		
-		*pte = (pte_t) (pa | perm | PTE_P);
+		*pte = (pte_t) (pa | (perm & ~PTE_PS) | PTE_P);
 		va += PGSIZE;
 		pa += PGSIZE;
 	}
 }
 
+//
+// Count 'n' more (or fewer) user pages mapped in 'pgdir', in
+// pp_nresident of the page directory.
+//
+static void
+pgdir_count(pde_t *pgdir, int n)
+{
+	pa2page(PADDR(pgdir))->pp_nresident += n;
+}
+
+//
+// Count 'n' more (or fewer) pages mapped in 'pgdir' at 'va': in the
+// page directory, and in the page table too unless 'va' lies in a 4MB
+// page.  A page table shared by fork is counted whole at once then,
+// see pgdir_fork().
+//
+static void
+pte_count(pde_t *pgdir, const void *va, int n)
+{
+	pgdir_count(pgdir, n);
+	if (!(pgdir[PDX(va)] & PTE_PS))
+	{
+		pa2page(PTE_ADDR(pgdir[PDX(va)]))->pp_nresident += n;
+	}
+}
+
+//
+// Return the number of user pages, 4KB each, mapped in 'pgdir'.
+//
+unsigned
+pgdir_npages(pde_t *pgdir)
+{
+	return pa2page(PADDR(pgdir))->pp_nresident;
+}
+
+//
+// Unmap every page mapped through the page table for the 4MB region
+// containing 'va', then free the page table itself.
+//
+static void
+page_table_remove(pde_t *pgdir, void *va)
+{
+	uintptr_t base;
+	pte_t *pt;
+	physaddr_t pa;
+	bool shared;
+	int i;
+
+	base = ROUNDDOWN((uintptr_t) va, PTSIZE);
+	pa = PTE_ADDR(pgdir[PDX(va)]);
+	pt = (pte_t *) KADDR(pa);
+
+	// The pages stay mapped for the others sharing the page table.
+	shared = (pgdir[PDX(va)] & PTE_COW) && pa2page(pa)->pp_ref > 1;
+
+	for (i = 0; i < NPTENTRIES && !shared; i++)
+	{
+		if (pt[i] & PTE_P)
+		{
+			page_remove(pgdir, (void *) (base + i * PGSIZE));
+		}
+	}
+
+	if (shared)
+	{
+		pgdir_count(pgdir, -pa2page(pa)->pp_nresident);
+	}
+
+	pgdir[PDX(va)] = 0;
+	page_decref(pa2page(pa));
+	tlb_invalidate(pgdir, (void *) base);
+}
+
+//
+// Map the block of PAGE_MAX_ORDER pages headed by 'pp' as a 4MB page
+// at 'va'.  See page_insert().
+//
+static int
+page_insert_large(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
+{
+	pde_t *pde;
+
+	if (((uintptr_t) va & (PTSIZE - 1)) || pp->pp_order != PAGE_MAX_ORDER)
+	{
+		return -E_INVAL;
+	}
+
+	pde = &pgdir[PDX(va)];
+
+	// Same as in page_insert(): reinserting pp must not free it.
+	pp->pp_ref++;
+
+	if (*pde & PTE_PS)
+	{
+		page_remove(pgdir, va);
+	}
+	else if (*pde & PTE_P)
+	{
+		page_table_remove(pgdir, va);
+	}
+
+	*pde = (pde_t) (page2pa(pp) | PTE_P | PTE_PS | perm);
+	pgdir_count(pgdir, NPTENTRIES);
+
+	return 0;
+}
+
 //
 // Map the physical page 'pp' at virtual address 'va'.
 // The permissions (the low 12 bits) of the page table entry
@@ -580,9 +997,15 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
 // frequently leads to subtle bugs; there's an elegant way to handle
 // everything in one code path.
 //
+// If perm has PTE_PS, 'pp' must head a block of PAGE_MAX_ORDER pages,
+// which is mapped as one 4MB page at the 4MB aligned 'va'.  Whatever
+// was mapped in that 4MB region before is unmapped.  Likewise, mapping
+// a 4KB page inside a 4MB page unmaps the whole 4MB page.
+//
 // RETURNS:
 //   0 on success
 //   -E_NO_MEM, if page table couldn't be allocated
+//   -E_INVAL, if a 4MB page is misaligned or too small
 //
 // Hint: The TA solution is implemented using pgdir_walk, page_remove,
 // and page2pa.
@@ -593,10 +1016,29 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 	// Fill this function in
 	pte_t *pte;
 
+	if (perm & PTE_PS)
+	{
+		return page_insert_large(pgdir, pp, va, perm);
+	}
+
+	// A 4MB page in the way has to go before there can be a page
+	// table.  Take the reference first, as below.
+	if (pgdir[PDX(va)] & PTE_PS)
+	{
+		pp->pp_ref++;
+		page_remove(pgdir, va);
+		pp->pp_ref--;
+	}
+
 	if (!(pte = pgdir_walk(pgdir, va, 1)))
 	{
 		return -E_NO_MEM;
 	}
+
+	if (perm & PTE_SHARE)
+	{
+		pa2page(PTE_ADDR(pgdir[PDX(va)]))->pp_flags |= PP_PTSHARE;
+	}
 	
 	// We do this BEFORE calling page_remove(), because that way
 	// the ref count won't reach zero in page_decref(), hence the
@@ -610,6 +1052,7 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 	}
 
 	*pte = (pte_t) (page2pa(pp) | PTE_P | perm);
+	pte_count(pgdir, va, 1);
 
 	return 0;
 }
@@ -622,6 +1065,8 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 // but should not be used by most callers.
 //
 // Return NULL if there is no page mapped at va.
+// For a 4MB page this is the first page of the block, and the pte
+// stored is the page directory entry.
 //
 // Hint: the TA solution uses pgdir_walk and pa2page.
 //
@@ -647,6 +1092,13 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 //
 // Unmaps the physical page at virtual address 'va'.
 // If there is no physical page at that address, silently does nothing.
+// If 'va' lies in a 4MB page, the whole 4MB page is unmapped.
+// If 'va' lies in a page table shared after fork, the table is made
+// private first, which is the only way this can fail.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if a shared page table couldn't be copied
 //
 // Details:
 //   - The ref count on the physical page should decrement.
@@ -659,7 +1111,7 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 // Hint: The TA solution is implemented using page_lookup,
 // 	tlb_invalidate, and page_decref.
 //
-void
+int
 page_remove(pde_t *pgdir, void *va)
 {
 	// Fill this function in
@@ -669,28 +1121,335 @@ page_remove(pde_t *pgdir, void *va)
 	// Do nothing
 	if (!(page = page_lookup(pgdir, va, &pte)))
 	{
-		return;
+		return 0;
+	}
+
+	if (!(pte = pgdir_walk(pgdir, va, 1)))
+	{
+		return -E_NO_MEM;
 	}
 
 	// Decrement the ref count.
 	// page_decref() frees the physical page automatically
 	// once ref count reaches zero
 	page_decref(page);
+	pte_count(pgdir, va, (*pte & PTE_PS) ? -NPTENTRIES : -1);
 	
 	*pte = (pte_t) 0;
 	tlb_invalidate(pgdir, va);
+
+	return 0;
+}
+
+//
+// Give dst a copy of the 4MB page that src maps at page directory
+// entry 'pdeno', or the page itself if 'share'.  See pgdir_fork().
+//
+static int
+pgdir_fork_large(pde_t *dst, pde_t *src, uint32_t pdeno, bool share)
+{
+	struct PageInfo *pp, *copy = NULL;
+	int err;
+
+	pp = pa2page(PTE_ADDR(src[pdeno]));
+
+	if (!share && !(src[pdeno] & PTE_SHARE) && (src[pdeno] & PTE_W))
+	{
+		if (!(copy = page_alloc_order(PAGE_MAX_ORDER, 0)))
+		{
+			return -E_NO_MEM;
+		}
+		memcpy(page2kva(copy), page2kva(pp), PTSIZE);
+		pp = copy;
+	}
+
+	if ((err = page_insert(dst, pp, PGADDR(pdeno, 0, 0),
+		(src[pdeno] & PTE_SYSCALL) | PTE_PS)) < 0 && copy)
+	{
+		page_free(copy);
+	}
+
+	return err;
+}
+
+//
+// Duplicate the user part of address space 'src' into the fresh
+// address space 'dst', for fork.  Page tables are shared whole,
+// read-only, and copied only once either side writes to the region
+// they map (see page_table_unshare()), so fork costs next to nothing
+// per page.
+//
+// Two kinds of page tables are still copied right away, entry by
+// entry: the one holding the user exception stack, which is left out
+// of the child, and those mapping PTE_SHARE pages, whose pp_ref user
+// space reads through pageref().  There, shared (PTE_SHARE) and
+// read-only pages are mapped as they are, and writable and
+// copy-on-write pages become read-only PTE_COW pages on both sides, to
+// be copied on the first write.
+//
+// Page directory entries that are not present are skipped whole.
+// 4MB pages are never copy-on-write, private writable ones are copied
+// right away.
+//
+// For sfork, 'share' maps every page below the thread stacks
+// (UTHREADBOTTOM) as it is, like PTE_SHARE pages, so that only the
+// stacks and the per-thread data page are private.  Copy-on-write pages there are resolved in src
+// first, or the two would part on the next write.  No page tables are
+// shared then.
+//
+// Returns 0 on success, -E_NO_MEM if out of memory.  On failure dst
+// holds part of the address space, which env_free() cleans up.
+//
+int
+pgdir_fork(pde_t *dst, pde_t *src, bool share)
+{
+	uint32_t pdeno, pteno;
+	struct PageInfo *pp;
+	pte_t *pt, pte;
+	void *va;
+	bool flush = 0;
+	int perm, err = 0;
+
+	for (pdeno = 0; pdeno < PDX(UTOP) && !err; pdeno++)
+	{
+		if (!(src[pdeno] & PTE_P))
+		{
+			continue;
+		}
+
+		if (src[pdeno] & PTE_PS)
+		{
+			err = pgdir_fork_large(dst, src, pdeno, share);
+			continue;
+		}
+
+		if (share && (err = page_table_unshare(&src[pdeno])) < 0)
+		{
+			break;
+		}
+
+		pp = pa2page(PTE_ADDR(src[pdeno]));
+
+		if (!share && pdeno != PDX(UXSTACKTOP - PGSIZE) &&
+			!(pp->pp_flags & PP_PTSHARE))
+		{
+			if (src[pdeno] & PTE_W)
+			{
+				src[pdeno] = (src[pdeno] & ~PTE_W) | PTE_COW;
+				flush = 1;
+			}
+			dst[pdeno] = src[pdeno];
+			pp->pp_ref++;
+			pgdir_count(dst, pp->pp_nresident);
+			continue;
+		}
+
+		pt = (pte_t *) page2kva(pp);
+
+		for (pteno = 0; pteno < NPTENTRIES; pteno++)
+		{
+			pte = pt[pteno];
+			va = PGADDR(pdeno, pteno, 0);
+
+			if (!(pte & PTE_P) || va == (void *) (UXSTACKTOP - PGSIZE))
+			{
+				continue;
+			}
+
+			if (share && (uintptr_t) va < UTHREADBOTTOM &&
+				(pte & PTE_COW))
+			{
+				if ((err = page_cow_fault(src, va)) < 0)
+				{
+					break;
+				}
+				pte = pt[pteno];
+			}
+
+			perm = pte & PTE_SYSCALL;
+
+			if (!(pte & PTE_SHARE) && (pte & (PTE_W | PTE_COW)) &&
+				!(share && (uintptr_t) va < UTHREADBOTTOM))
+			{
+				perm = (perm & ~PTE_W) | PTE_COW;
+				if (pte & PTE_W)
+				{
+					pt[pteno] = (pte & ~PTE_W) | PTE_COW;
+					flush = 1;
+				}
+			}
+
+			if ((err = page_insert(dst, pa2page(PTE_ADDR(pte)),
+				va, perm)) < 0)
+			{
+				break;
+			}
+		}
+	}
+
+	// One cr3 reload instead of an invlpg per page made read-only.
+	// The global kernel entries survive it.
+	if (flush)
+	{
+		tlb_flush(src);
+	}
+
+	return err;
+}
+
+//
+// Resolve a write fault at 'va' on a PTE_COW page.  A page that is
+// still shared gets copied, one that nobody else maps any longer is
+// just made writable again.  Either way the mapping loses PTE_COW.
+// A write fault on any writable page in a shared page table makes the
+// table private first.  One on a user page that is already writable
+// is spurious: a thread sharing 'pgdir' on another CPU resolved the
+// same fault first, while this one waited for the kernel lock.
+//
+// Returns 0 on success, or if the write can just be retried, -E_INVAL
+// if 'va' is not a copy-on-write page, -E_NO_MEM if out of memory.
+//
+int
+page_cow_fault(pde_t *pgdir, void *va)
+{
+	struct PageInfo *pp, *copy;
+	pte_t *pte;
+	int perm;
+
+	va = ROUNDDOWN(va, PGSIZE);
+
+	if ((uintptr_t) va >= UTOP || !(pte = pgdir_walk(pgdir, va, 0)) ||
+		(*pte & (PTE_P | PTE_PS)) != PTE_P)
+	{
+		return -E_INVAL;
+	}
+
+	// The fault dropped the stale TLB entry, if there was one.
+	if ((*pte & (PTE_W | PTE_U)) == (PTE_W | PTE_U) &&
+		!(pgdir[PDX(va)] & PTE_COW))
+	{
+		return 0;
+	}
+
+	if (!(*pte & PTE_COW) &&
+		!((*pte & PTE_W) && (pgdir[PDX(va)] & PTE_COW)))
+	{
+		return -E_INVAL;
+	}
+
+	if (!(pte = pgdir_walk(pgdir, va, 1)))
+	{
+		return -E_NO_MEM;
+	}
+
+	// The page was writable, only the page table was shared.
+	if (*pte & PTE_W)
+	{
+		return 0;
+	}
+
+	pp = pa2page(PTE_ADDR(*pte));
+	perm = (*pte & PTE_SYSCALL & ~PTE_COW) | PTE_W;
+
+	if (pp->pp_ref == 1)
+	{
+		*pte = page2pa(pp) | perm;
+		tlb_invalidate(pgdir, va);
+		return 0;
+	}
+
+	if (!(copy = page_alloc(0)))
+	{
+		return -E_NO_MEM;
+	}
+
+	memcpy(page2kva(copy), page2kva(pp), PGSIZE);
+
+	// The page table is there, so this cannot fail.
+	return page_insert(pgdir, copy, va, perm);
 }
 
 //
 // Invalidate a TLB entry, but only if the page tables being
 // edited are the ones currently in use by the processor.
+// Kernel mappings above UTOP are global and shared by all address
+// spaces, so those are always invalidated.  invlpg drops global
+// entries too.
 //
 void
 tlb_invalidate(pde_t *pgdir, void *va)
 {
 	// Flush the entry only if we're modifying the current address space.
-	if (!curenv || curenv->env_pgdir == pgdir)
+	if (!curenv || curenv->env_pgdir == pgdir || (uintptr_t) va >= UTOP)
 		invlpg(va);
+
+	// Threads of the same process may run in it on other CPUs.
+	if ((uintptr_t) va < UTOP)
+	{
+		tlb_shootdown(pgdir);
+	}
+}
+
+//
+// Flush all the TLB entries of 'pgdir', or of every address space if
+// 'pgdir' is NULL, on all CPUs.  The global kernel entries stay.
+//
+void
+tlb_flush(pde_t *pgdir)
+{
+	if (!pgdir || rcr3() == PADDR(pgdir))
+	{
+		lcr3(rcr3());
+	}
+
+	tlb_shootdown(pgdir);
+}
+
+//
+// Make the other CPUs running in 'pgdir', or all that run an
+// environment if 'pgdir' is NULL, flush their TLBs, and wait until
+// they have.  The caller holds the kernel lock, so each of them is
+// either in user mode, where the IRQ_TLB interrupt reaches it, or
+// waiting for the lock with interrupts off, and then lock_kernel()
+// does the flush.  A CPU without an environment runs in kern_pgdir.
+//
+void
+tlb_shootdown(pde_t *pgdir)
+{
+	struct CpuInfo *c;
+
+	for (c = cpus; c < cpus + ncpu; c++)
+	{
+		if (c == thiscpu || !c->cpu_env ||
+			(pgdir && c->cpu_env->env_pgdir != pgdir))
+		{
+			continue;
+		}
+
+		c->cpu_tlb_flush = 1;
+		lapic_ipi(c->cpu_id, IRQ_OFFSET + IRQ_TLB);
+	}
+
+	for (c = cpus; c < cpus + ncpu; c++)
+	{
+		while (c->cpu_tlb_flush)
+		{
+			asm volatile("pause");
+		}
+	}
+}
+
+//
+// Do the flush tlb_shootdown() asked this CPU for, if any.
+//
+void
+tlb_shootdown_handle(void)
+{
+	if (thiscpu->cpu_tlb_flush)
+	{
+		lcr3(rcr3());
+		thiscpu->cpu_tlb_flush = 0;
+	}
 }
 
 //
@@ -705,7 +1464,9 @@ mmio_map_region(physaddr_t pa, size_t size)
 	// beginning of the MMIO region.  Because this is static, its
 	// value will be preserved between calls to mmio_map_region
 	// (just like nextfree in boot_alloc).
-	static uintptr_t base = MMIOBASE; base=base;
+	static uintptr_t base = MMIOBASE;
+	uintptr_t result;
+	size_t offset;
 
 	// Reserve size bytes of virtual memory starting at base and
 	// map physical pages [pa,pa+size) to virtual addresses
@@ -724,14 +1485,118 @@ mmio_map_region(physaddr_t pa, size_t size)
 	//
 	// Hint: The staff solution uses boot_map_region.
 	//
+	// The mappings are global like the rest of the kernel's.
+	//
 	// Your code here:
-	panic("mmio_map_region not implemented");
+	offset = PGOFF(pa);
+	size = ROUNDUP(size + offset, PGSIZE);
+
+	if (size > MMIOLIM - base)
+	{
+		panic("mmio_map_region: out of MMIO space");
+	}
+
+	boot_map_region(kern_pgdir, base, size, pa - offset,
+		PTE_PCD | PTE_PWT | PTE_W | PTE_G);
+
+	result = base;
+	base += size;
+
+	return (void *) (result + offset);
 }
 
 // --------------------------------------------------------------
 // Checking user memory.
 // --------------------------------------------------------------
 
+//
+// Copy 'len' bytes from 'src' to 'dst', where one of them is user
+// memory of the current environment.  A page fault on the user side
+// is resumed by page_fault_handler() at label 2, so this returns the
+// number of bytes that could not be copied.
+//
+static size_t
+user_copy(void *dst, const void *src, size_t len)
+{
+	asm volatile("1:	rep movsb\n"
+		     "2:\n"
+		     ".pushsection __ex_table, \"a\"\n"
+		     "	.long 1b, 2b\n"
+		     ".popsection\n"
+		     : "+D" (dst), "+S" (src), "+c" (len)
+		     :
+		     : "memory", "cc");
+	return len;
+}
+
+//
+// Copy 'len' bytes from the current environment's memory at 'usrc'
+// into the kernel buffer 'dst'.  There is no separate permission
+// check: the user addresses are only bounded by ULIM, and the copy
+// itself faults on anything the environment cannot read.
+//
+// Returns 0 on success, -E_FAULT if some of [usrc, usrc+len) is not
+// readable.  The first such address is then reported by
+// user_mem_fault().
+//
+int
+copy_from_user(void *dst, const void *usrc, size_t len)
+{
+	size_t left;
+
+	if ((uintptr_t) usrc >= ULIM || len > ULIM - (uintptr_t) usrc)
+	{
+		invalid_user_va = (uintptr_t) usrc;
+		return -E_FAULT;
+	}
+
+	if ((left = user_copy(dst, usrc, len)))
+	{
+		invalid_user_va = (uintptr_t) usrc + len - left;
+		return -E_FAULT;
+	}
+
+	return 0;
+}
+
+//
+// Copy 'len' bytes from the kernel buffer 'src' into the current
+// environment's memory at 'udst'.  The same as copy_from_user()
+// otherwise; writes to read-only user pages fault since CR0_WP is on.
+//
+int
+copy_to_user(void *udst, const void *src, size_t len)
+{
+	size_t left;
+
+	if ((uintptr_t) udst >= ULIM || len > ULIM - (uintptr_t) udst)
+	{
+		invalid_user_va = (uintptr_t) udst;
+		return -E_FAULT;
+	}
+
+	if ((left = user_copy(udst, src, len)))
+	{
+		invalid_user_va = (uintptr_t) udst + len - left;
+		return -E_FAULT;
+	}
+
+	return 0;
+}
+
+//
+// Report the failed access to user memory found by user_mem_check(),
+// copy_from_user() or copy_to_user(), and destroy 'env'.
+// If env is the current environment, this function will not return.
+//
+void
+user_mem_fault(struct Env *env)
+{
+	cprintf("[%08x] user_mem_check assertion failure for va %08x\n",
+		env->env_id, invalid_user_va);
+	env_destroy(env);
+}
+
 //
 // Checks that environment 'env' is allowed to access the range
 // of memory [va, va+len) with permissions 'perm | PTE_U | PTE_P'.
@@ -747,9 +1612,7 @@ user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 		return;
 	}
 
-	cprintf("[%08x] user_mem_check assertion failure for va %08x\n",
-		env->env_id, invalid_user_va);
-	env_destroy(env);
+	user_mem_fault(env);
 }
 
 //
@@ -775,6 +1638,7 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 {
 	const void *va_bottom, *va_top;
 	pte_t *pte;
+	pte_t pte_perm;
 
 	va_bottom = ROUNDDOWN(va, PGSIZE);
 	va_top = ROUNDUP(va + len, PGSIZE);
@@ -792,9 +1656,15 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 	for (; va_bottom < va_top; va_bottom += PGSIZE)
 	{
 		pte = pgdir_walk(env->env_pgdir, va_bottom, 0);
+		pte_perm = pte ? *pte : 0;
+
+		// A copy-on-write page is writable: the kernel's first write
+		// to it makes it private, see page_fault_handler().
+		if (pte_perm & PTE_COW)
+			pte_perm |= PTE_W;
 
 		// *pte should have at least perm permissions.
-		if (!pte || !(*pte) || (*pte & perm) != perm)
+		if (!pte_perm || (pte_perm & perm) != perm)
 		{
 			invalid_user_va = (uintptr_t)
 				((va_bottom < va) ? va : va_bottom);
@@ -811,81 +1681,106 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 // --------------------------------------------------------------
 
 //
-// Check that the pages on the page_free_list are reasonable.
+// Check that the pages on the buddy free lists are reasonable.
 //
 static void
 check_page_free_list(bool only_low_memory)
 {
-	struct PageInfo *pp;
+	struct PageInfo *head, *pp;
 	unsigned pdx_limit = only_low_memory ? 1 : NPDENTRIES;
 	int nfree_basemem = 0, nfree_extmem = 0;
+	size_t nfree = 0;
 	char *first_free_page;
+	int order, i;
 
-	if (!page_free_list)
-		panic("'page_free_list' is a null pointer!");
-
-	if (only_low_memory) {
-		// Move pages with lower addresses first in the free
-		// list, since entry_pgdir does not map all pages.
-		struct PageInfo *pp1, *pp2;
-		struct PageInfo **tp[2] = { &pp1, &pp2 };
-		for (pp = page_free_list; pp; pp = pp->pp_link) {
-			int pagetype = PDX(page2pa(pp)) >= pdx_limit;
-			*tp[pagetype] = pp;
-			tp[pagetype] = &pp->pp_link;
-		}
-		*tp[1] = 0;
-		*tp[0] = pp2;
-		page_free_list = pp1;
-	}
+	if (!npages_free)
+		panic("the buddy free lists are empty!");
 
-	// if there's a page that shouldn't be on the free list,
-	// try to make sure it eventually causes trouble.
-	for (pp = page_free_list; pp; pp = pp->pp_link) {
-		if (PDX(page2pa(pp)) < pdx_limit) {
+	first_free_page = (char *) boot_alloc(0);
+	for (order = 0; order < PAGE_NORDERS; order++) {
+		for (head = page_free_area[order]; head; head = head->pp_link) {
+			// check that we didn't corrupt the free lists themselves
+			assert(head >= pages);
+			assert(head + (1 << order) <= pages + npages);
+			assert(((char *) head - (char *) pages) % sizeof(*head) == 0);
+			assert(((head - pages) & ((1 << order) - 1)) == 0);
+			assert(head->pp_flags & PP_FREE);
+			assert(head->pp_order == order);
+			assert(!head->pp_link || head->pp_link->pp_prev == head);
+
+			for (i = 0, pp = head; i < (1 << order); i++, pp++) {
+				// if there's a page that shouldn't be free,
+				// try to make sure it eventually causes trouble.
+				if (PDX(page2pa(pp)) < pdx_limit) {
 #ifdef SANITIZE_SHADOW_BASE
-			// This is technically invalid memory, access it via unsanitized routine.
-			__nosan_memset(page2kva(pp), 0x97, 128);
+					// This is technically invalid memory, access it via unsanitized routine.
+					__nosan_memset(page2kva(pp), 0x97, 128);
 #else
-			memset(page2kva(pp), 0x97, 128);
+					memset(page2kva(pp), 0x97, 128);
 #endif
+				}
+
+				// check a few pages that shouldn't be free
+				assert(page2pa(pp) != 0);
+				assert(page2pa(pp) != IOPHYSMEM);
+				assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
+				assert(page2pa(pp) != EXTPHYSMEM);
+				assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
+				assert(pp->pp_ref == 0);
+				assert(is_pagefree(pp));
+
+				if (page2pa(pp) < EXTPHYSMEM)
+					++nfree_basemem;
+				else
+					++nfree_extmem;
+				++nfree;
+			}
 		}
 	}
 
-	first_free_page = (char *) boot_alloc(0);
-	for (pp = page_free_list; pp; pp = pp->pp_link) {
-		// check that we didn't corrupt the free list itself
-		assert(pp >= pages);
-		assert(pp < pages + npages);
-		assert(((char *) pp - (char *) pages) % sizeof(*pp) == 0);
-
-		// check a few pages that shouldn't be on the free list
-		assert(page2pa(pp) != 0);
-		assert(page2pa(pp) != IOPHYSMEM);
-		assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
-		assert(page2pa(pp) != EXTPHYSMEM);
-		assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
-
-		if (page2pa(pp) < EXTPHYSMEM)
-			++nfree_basemem;
-		else
-			++nfree_extmem;
-	}
-
 	assert(nfree_basemem > 0);
 	assert(nfree_extmem > 0);
+	assert(nfree == npages_free);
+}
+
+// Temporarily take every free page away from the allocator.
+// The stolen pages are chained through pp_link.
+static struct PageInfo *
+check_steal_free_pages(void)
+{
+	struct PageInfo *pp, *fl = NULL;
+
+	while ((pp = page_alloc(0))) {
+		pp->pp_link = fl;
+		fl = pp;
+	}
+	return fl;
+}
+
+// Give the pages taken by check_steal_free_pages() back.
+static void
+check_return_free_pages(struct PageInfo *fl)
+{
+	struct PageInfo *pp;
+
+	while ((pp = fl)) {
+		fl = pp->pp_link;
+		pp->pp_link = NULL;
+		page_free(pp);
+	}
 }
 
 //
-// Check the physical page allocator (page_alloc(), page_free(),
-// and page_init()).
+// Check the physical page allocator (page_alloc(), page_alloc_order(),
+// page_free(), and page_init()).
 //
 static void
 check_page_alloc(void)
 {
-	struct PageInfo *pp, *pp0, *pp1, *pp2;
-	int nfree;
+	struct PageInfo *pp, *pp0, *pp1, *pp2, *pb;
+	size_t nfree;
 	struct PageInfo *fl;
+	uint32_t hits;
 	char *c;
 	int i;
 
@@ -893,8 +1788,7 @@ check_page_alloc(void)
 		panic("'pages' is a null pointer!");
 
 	// check number of free pages
-	for (pp = page_free_list, nfree = 0; pp; pp = pp->pp_link)
-		++nfree;
+	nfree = page_nfree();
 
 	// should be able to allocate three pages
 	pp0 = pp1 = pp2 = 0;
@@ -909,12 +1803,16 @@ check_page_alloc(void)
 	assert(page2pa(pp1) < npages*PGSIZE);
 	assert(page2pa(pp2) < npages*PGSIZE);
 
+	// a block of order 1 to check buddy merging with
+	assert((pb = page_alloc_order(1, 0)));
+	assert(((pb - pages) & 1) == 0);
+
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	fl = check_steal_free_pages();
 
 	// should be no free memory
 	assert(!page_alloc(0));
+	assert(page_nfree() == 0);
 
 	// free and re-allocate?
 	page_free(pp0);
@@ -938,32 +1836,57 @@ check_page_alloc(void)
 	for (i = 0; i < PGSIZE; i++)
 		assert(c[i] == 0);
 
+	// an order 1 block splits into its two pages...
+	page_free(pb);
+	assert(is_pagefree(pb) && is_pagefree(pb + 1));
+	assert(!page_alloc_order(2, 0));
+	assert((pp = page_alloc(0)) && pp == pb);
+	assert(!is_pagefree(pb) && is_pagefree(pb + 1));
+	assert((pp = page_alloc(0)) && pp == pb + 1);
+	assert(!page_alloc(0));
+
+	// ... which merge back once both are free
+	page_free(pb + 1);
+	page_free(pb);
+	assert(page_nfree() == 2);
+	assert((pp = page_alloc_order(1, 0)) && pp == pb);
+	assert(pb->pp_order == 1);
+	assert(!page_alloc(0));
+
 	// give free list back
-	page_free_list = fl;
+	check_return_free_pages(fl);
 
 	// free the pages we took
+	page_free(pb);
 	page_free(pp0);
 	page_free(pp1);
 	page_free(pp2);
 
 	// number of free pages should be the same
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		--nfree;
-	assert(nfree == 0);
-
-	// struct PageInfo *alc = page_alloc(0), *store = alc;
-
-	// while ((alc = page_alloc(0)))
-	// {
-	// 	if (PGNUM(PADDR(page2kva(alc))) > PGNUM(PADDR(page2kva(store))))
-	// 	{
-	// 		store = alc;
-	// 	}
-	// }
-
-	// page_free(store);
-	// alc = page_alloc(0);
-	// page_free(alc);
+	assert(page_nfree() == nfree);
+
+	// larger blocks are aligned to their size and zeroed as a whole
+	assert((pb = page_alloc_order(3, ALLOC_ZERO)));
+	assert(((pb - pages) & 7) == 0);
+	assert(page_nfree() == nfree - 8);
+	c = page2kva(pb);
+	for (i = 0; i < 8 * PGSIZE; i++)
+		assert(c[i] == 0);
+	page_free(pb);
+	assert(page_nfree() == nfree);
+	assert(!page_alloc_order(PAGE_MAX_ORDER + 1, 0));
+
+	// zeroed pages from the idle loop serve ALLOC_ZERO requests
+	hits = page_zero_stats.hits;
+	assert(page_zero_fill());
+	assert(page_nfree() == nfree);
+	assert((pp = page_alloc(ALLOC_ZERO)));
+	assert(page_zero_stats.hits == hits + 1);
+	c = page2kva(pp);
+	for (i = 0; i < PGSIZE; i++)
+		assert(c[i] == 0);
+	page_free(pp);
+	assert(page_nfree() == nfree);
 
 	cprintf("check_page_alloc() succeeded!\n");
 }
@@ -999,9 +1922,17 @@ check_kern_pgdir(void)
 		assert(check_va2pa(pgdir, KERNBASE + i) == i);
 
 	// check kernel stack
-	for (i = 0; i < KSTKSIZE; i += PGSIZE)
-		assert(check_va2pa(pgdir, KSTACKTOP - KSTKSIZE + i) == PADDR(bootstack) + i);
-	assert(check_va2pa(pgdir, KSTACKTOP - PTSIZE) == ~0);
+	// (updated in lab 4 to check per-CPU kernel stacks)
+	for (n = 0; n < NCPU; n++) {
+		uint32_t base = KSTACKTOP - (KSTKSIZE + KSTKGAP) * (n + 1);
+		for (i = 0; i < KSTKSIZE; i += PGSIZE) {
+			assert(check_va2pa(pgdir, base + KSTKGAP + i)
+				== PADDR(percpu_kstacks[n]) + i);
+			assert(*pgdir_walk(pgdir, (void *) (base + KSTKGAP + i), 0) & PTE_G);
+		}
+		for (i = 0; i < KSTKGAP; i += PGSIZE)
+			assert(check_va2pa(pgdir, base + i) == ~0);
+	}
 
 	// check PDE permissions
 	for (i = 0; i < NPDENTRIES; i++) {
@@ -1019,6 +1950,8 @@ check_kern_pgdir(void)
 			if (i >= PDX(KERNBASE)) {
 				assert(pgdir[i] & PTE_P);
 				assert(pgdir[i] & PTE_W);
+				assert(pgdir[i] & PTE_PS);
+				assert(pgdir[i] & PTE_G);
 			} else
 				assert(pgdir[i] == 0);
 			break;
@@ -1040,6 +1973,8 @@ check_va2pa(pde_t *pgdir, uintptr_t va)
 	pgdir = &pgdir[PDX(va)];
 	if (!(*pgdir & PTE_P))
 		return ~0;
+	if (*pgdir & PTE_PS)
+		return PTE_ADDR(*pgdir) + (va & (PTSIZE - 1) & ~(PGSIZE - 1));
 	p = (pte_t*) KADDR(PTE_ADDR(*pgdir));
 	if (!(p[PTX(va)] & PTE_P))
 		return ~0;
@@ -1068,8 +2003,7 @@ check_page(void)
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	fl = check_steal_free_pages();
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -1189,7 +2123,7 @@ check_page(void)
 	pp0->pp_ref = 0;
 
 	// give free list back
-	page_free_list = fl;
+	check_return_free_pages(fl);
 
 	// free the pages we took
 	page_free(pp0);
@@ -1204,6 +2138,8 @@ static void
 check_page_installed_pgdir(void)
 {
 	struct PageInfo *pp0, *pp1, *pp2;
+	pde_t *pgdir;
+	pte_t *ptep;
 
 	// check that we can read and write installed pages
 	pp1 = pp2 = 0;
@@ -1234,5 +2170,120 @@ check_page_installed_pgdir(void)
 	// free the pages we took
 	page_free(pp0);
 
+	// a 4MB page replaces the page table below it ...
+	assert((pp1 = page_alloc(0)));
+	assert(page_insert(kern_pgdir, pp1, (void*) PGSIZE, PTE_W) == 0);
+	assert((pp0 = pa2page(PTE_ADDR(kern_pgdir[0]))));
+	assert((pp2 = page_alloc_order(PAGE_MAX_ORDER, 0)));
+	assert(page_insert(kern_pgdir, pp2, (void*) PGSIZE, PTE_W | PTE_PS) < 0);
+	assert(page_insert(kern_pgdir, pp2, (void*) 0, PTE_W | PTE_PS) == 0);
+	assert(is_pagefree(pp0) && is_pagefree(pp1));
+	assert(kern_pgdir[0] & PTE_PS);
+	assert(pp2->pp_ref == 1);
+	assert(page_lookup(kern_pgdir, (void*) PGSIZE, NULL) == pp2);
+	assert(check_va2pa(kern_pgdir, PTSIZE - PGSIZE) ==
+	       page2pa(pp2) + PTSIZE - PGSIZE);
+	*(uint32_t *)(PTSIZE - 4) = 0x04040404U;
+	assert(*(uint32_t *)((char *) page2kva(pp2) + PTSIZE - 4) == 0x04040404U);
+
+	// ... and is unmapped as a whole
+	page_remove(kern_pgdir, (void*) PGSIZE);
+	assert(kern_pgdir[0] == 0);
+	assert(pp2->pp_ref == 0);
+	assert(is_pagefree(pp2) && is_pagefree(pp2 + NPTENTRIES - 1));
+
+	// a shared copy-on-write page is copied on a write fault ...
+	assert((pp1 = page_alloc(0)));
+	memset(page2kva(pp1), 5, PGSIZE);
+	assert(page_insert(kern_pgdir, pp1, (void*) PGSIZE, PTE_COW) == 0);
+	assert(page_insert(kern_pgdir, pp1, (void*) (2*PGSIZE), PTE_COW) == 0);
+	assert(page_cow_fault(kern_pgdir, (void*) 0) == -E_INVAL);
+	assert(page_cow_fault(kern_pgdir, (void*) (PGSIZE + 4)) == 0);
+	assert(pp1->pp_ref == 1);
+	assert((pp2 = page_lookup(kern_pgdir, (void*) PGSIZE, &ptep)) != pp1);
+	assert((*ptep & (PTE_W | PTE_COW)) == PTE_W);
+	assert(*(uint32_t *)PGSIZE == 0x05050505U);
+	*(uint32_t *)PGSIZE = 0x06060606U;
+	assert(*(uint32_t *)page2kva(pp1) == 0x05050505U);
+
+	// ... and made writable in place once it is no longer shared
+	assert(page_cow_fault(kern_pgdir, (void*) (2*PGSIZE)) == 0);
+	assert(page_lookup(kern_pgdir, (void*) (2*PGSIZE), &ptep) == pp1);
+	assert((*ptep & (PTE_W | PTE_COW)) == PTE_W);
+	assert(page_cow_fault(kern_pgdir, (void*) (2*PGSIZE)) == -E_INVAL);
+
+	// a fault on a user page resolved already by another CPU is
+	// retried, and leaves the page alone
+	assert(page_insert(kern_pgdir, pp1, (void*) (2*PGSIZE),
+			   PTE_COW | PTE_U) == 0);
+	assert(page_cow_fault(kern_pgdir, (void*) (2*PGSIZE)) == 0);
+	assert(page_cow_fault(kern_pgdir, (void*) (2*PGSIZE)) == 0);
+	assert(page_lookup(kern_pgdir, (void*) (2*PGSIZE), &ptep) == pp1);
+	assert((*ptep & (PTE_W | PTE_U | PTE_COW)) == (PTE_W | PTE_U));
+	assert(pp1->pp_ref == 1);
+	page_remove(kern_pgdir, (void*) PGSIZE);
+	page_remove(kern_pgdir, (void*) (2*PGSIZE));
+	assert(pp1->pp_ref == 0 && pp2->pp_ref == 0);
+
+	// forcibly take the page table back
+	pp0 = pa2page(PTE_ADDR(kern_pgdir[0]));
+	kern_pgdir[0] = 0;
+	pp0->pp_ref = 0;
+	page_free(pp0);
+
+	// fork shares page tables ...
+	assert((pp0 = page_alloc(ALLOC_ZERO)));
+	assert((pp1 = page_alloc(0)));
+	pgdir = (pde_t *) page2kva(pp0);
+	memset(page2kva(pp1), 7, PGSIZE);
+	assert(page_insert(kern_pgdir, pp1, (void*) PGSIZE, PTE_W | PTE_U) == 0);
+	pp0->pp_nresident = 0;
+	assert(pgdir_fork(pgdir, kern_pgdir, 0) == 0);
+	assert(pgdir[0] == kern_pgdir[0]);
+	assert((pgdir[0] & (PTE_W | PTE_COW)) == PTE_COW);
+	pp2 = pa2page(PTE_ADDR(pgdir[0]));
+	assert(pp2->pp_ref == 2 && pp1->pp_ref == 1);
+	assert(pp2->pp_nresident == 1 && pgdir_npages(pgdir) == 1);
+
+	// ... copies them when either side writes ...
+	assert(page_cow_fault(kern_pgdir, (void*) PGSIZE) == 0);
+	assert(PTE_ADDR(kern_pgdir[0]) != page2pa(pp2));
+	assert((kern_pgdir[0] & (PTE_W | PTE_COW)) == PTE_W);
+	assert(pp2->pp_ref == 1);
+	assert(pa2page(PTE_ADDR(kern_pgdir[0]))->pp_nresident == 1);
+	assert(page_lookup(kern_pgdir, (void*) PGSIZE, NULL) != pp1);
+	assert(pp1->pp_ref == 1);
+	*(uint32_t *)PGSIZE = 0x08080808U;
+	assert(*(uint32_t *)page2kva(pp1) == 0x07070707U);
+
+	// ... and takes the last one back in place
+	assert(page_cow_fault(pgdir, (void*) PGSIZE) == 0);
+	assert(PTE_ADDR(pgdir[0]) == page2pa(pp2));
+	assert((pgdir[0] & (PTE_W | PTE_COW)) == PTE_W);
+	assert(page_lookup(pgdir, (void*) PGSIZE, &ptep) == pp1);
+	assert((*ptep & (PTE_W | PTE_COW)) == PTE_W);
+
+	// page tables mapping PTE_SHARE pages are copied right away
+	page_remove(kern_pgdir, (void*) PGSIZE);
+	assert(page_insert(kern_pgdir, pp1, (void*) PGSIZE,
+			   PTE_W | PTE_U | PTE_SHARE) == 0);
+	page_remove(pgdir, (void*) PGSIZE);
+	pgdir[0] = 0;
+	page_decref(pp2);
+	assert(pp1->pp_ref == 1);
+	assert(pgdir_fork(pgdir, kern_pgdir, 0) == 0);
+	assert(PTE_ADDR(pgdir[0]) != PTE_ADDR(kern_pgdir[0]));
+	assert(kern_pgdir[0] & PTE_W);
+	assert(pp1->pp_ref == 2);
+
+	// take everything back
+	page_remove(kern_pgdir, (void*) PGSIZE);
+	page_remove(pgdir, (void*) PGSIZE);
+	assert(is_pagefree(pp1));
+	page_decref(pa2page(PTE_ADDR(pgdir[0])));
+	page_decref(pa2page(PTE_ADDR(kern_pgdir[0])));
+	kern_pgdir[0] = 0;
+	page_free(pp0);
+
 	cprintf("check_page_installed_pgdir() succeeded!\n");
 }
@@ -14,7 +14,6 @@ extern char bootstacktop[], bootstack[];
 
 extern struct PageInfo *pages;
 extern size_t npages;
-extern struct PageInfo *page_free_list_top;
 
 extern pde_t *kern_pgdir;
 
@@ -52,22 +51,63 @@ enum {
 	ALLOC_ZERO = 1<<0,
 };
 
+// The buddy allocator hands out blocks of 1 << order contiguous,
+// naturally aligned pages, from a single page up to PTSIZE.
+#define PAGE_MAX_ORDER	10
+#define PAGE_NORDERS	(PAGE_MAX_ORDER + 1)
+
+enum {
+	// Page heads a block on one of the buddy free lists.
+	PP_FREE = 1<<0,
+	// Page is free, zeroed, and on the zero pool.
+	PP_ZERO = 1<<1,
+	// Page is a page table that maps PTE_SHARE pages, which fork
+	// must not share, so that pageref() stays exact for them.
+	PP_PTSHARE = 1<<2,
+};
+
+// The idle loop keeps up to this many zeroed pages around for
+// page_alloc(ALLOC_ZERO).
+#define PAGE_ZERO_POOL_MAX	256
+
+struct PageZeroStats {
+	uint32_t hits;		// ALLOC_ZERO requests served by the pool
+	uint32_t misses;	// ALLOC_ZERO requests zeroed on the spot
+	uint32_t filled;	// Pages zeroed by the idle loop
+};
+
+extern struct PageZeroStats page_zero_stats;
+
 void	mem_init(void);
 
 void	page_init(void);
 struct PageInfo *page_alloc(int alloc_flags);
+struct PageInfo *page_alloc_order(int order, int alloc_flags);
 void	page_free(struct PageInfo *pp);
+size_t	page_nfree(void);
+int	page_zero_fill(void);
+size_t	page_zero_drain(void);
 int	page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
-void	page_remove(pde_t *pgdir, void *va);
+int	page_remove(pde_t *pgdir, void *va);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
 void	page_decref(struct PageInfo *pp);
 
 void	tlb_invalidate(pde_t *pgdir, void *va);
+void	tlb_flush(pde_t *pgdir);
+void	tlb_shootdown(pde_t *pgdir);
+void	tlb_shootdown_handle(void);
 
 void *	mmio_map_region(physaddr_t pa, size_t size);
 
+unsigned pgdir_npages(pde_t *pgdir);
+int	pgdir_fork(pde_t *dst, pde_t *src, bool share);
+int	page_cow_fault(pde_t *pgdir, void *va);
+
 int	user_mem_check(struct Env *env, const void *va, size_t len, int perm);
 void	user_mem_assert(struct Env *env, const void *va, size_t len, int perm);
+void	user_mem_fault(struct Env *env);
+int	copy_from_user(void *dst, const void *usrc, size_t len);
+int	copy_to_user(void *udst, const void *src, size_t len);
 
 static inline physaddr_t
 page2pa(struct PageInfo *pp)
@@ -89,10 +129,26 @@ page2kva(struct PageInfo *pp)
 	return KADDR(page2pa(pp));
 }
 
+// A page is free if it is on the zero pool or lies inside a free buddy
+// block.  Such a block of order o starts at the page index rounded down
+// to 1 << o.
 static inline int
 is_pagefree(struct PageInfo *pp)
 {
-	return (pp->pp_link || (pp == page_free_list_top)) ? 1 : 0;
+	size_t i, head;
+	int order;
+
+	if (pp->pp_flags & PP_ZERO)
+		return 1;
+
+	i = pp - pages;
+	for (order = 0; order < PAGE_NORDERS; order++) {
+		head = i & ~((1 << order) - 1);
+		if ((pages[head].pp_flags & PP_FREE) &&
+		    pages[head].pp_order >= order)
+			return 1;
+	}
+	return 0;
 }
 
 pte_t *pgdir_walk(pde_t *pgdir, const void *va, int create);
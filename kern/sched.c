@@ -1,21 +1,665 @@
 #include <inc/assert.h>
+#include <inc/error.h>
 #include <inc/x86.h>
 #include <kern/env.h>
 #include <kern/monitor.h>
+#include <kern/pmap.h>
+#include <kern/sched.h>
+#include <kern/tsc.h>
+#include <kern/clockev.h>
+#include <kern/timer.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
 
+void sched_halt(void) __attribute__((noreturn));
+static void sched_idle(void) __attribute__((noreturn));
 
-struct Taskstate cpu_ts;
-void sched_halt(void);
+// Weighted fair sharing.  Every environment accumulates virtual
+// runtime: the TSC cycles it spent in user mode, scaled by
+// SCHED_WEIGHT_DEFAULT / its weight, so that an environment with twice
+// the weight ages half as fast.  The scheduler runs the runnable
+// environment with the least virtual runtime, which gives each its
+// weighted share of the CPU.  Weights follow the nice levels of
+// ENV_PRIO_MIN..ENV_PRIO_MAX, each level about 1.25 times the next.
+#define SCHED_WEIGHT_DEFAULT	1024
+
+static const uint32_t sched_prio_weight[ENV_PRIO_MAX - ENV_PRIO_MIN + 1] = {
+	/* -20 */ 88761, 71755, 56483, 46273, 36291,
+	/* -15 */ 29154, 23254, 18705, 14949, 11916,
+	/* -10 */ 9548, 7620, 6100, 4904, 3906,
+	/*  -5 */ 3121, 2501, 1991, 1586, 1277,
+	/*   0 */ 1024, 820, 655, 526, 423,
+	/*   5 */ 335, 272, 215, 172, 137,
+	/*  10 */ 110, 87, 70, 56, 45,
+	/*  15 */ 36, 29, 23, 18, 15,
+};
+
+// An environment that wakes up after blocking is placed at most this
+// many milliseconds of virtual runtime before the busiest ones, so
+// that environments that mostly wait, like servers, get to run soon
+// after their request comes in but cannot save up CPU time by sleeping.
+#define SCHED_WAKEUP_CREDIT_MS	5
+
+// The time slice: how long an environment runs before the timer
+// checks whether another one is owed the CPU, if there is another.
+unsigned sched_quantum_ms = SCHED_QUANTUM_MS;
+
+// The real-time class.  An environment admitted to it by
+// sched_set_deadline() gets a budget of CPU time in every period,
+// which starts when the previous one ends.  While it has budget left,
+// it runs ahead of all fair share environments, earliest deadline
+// (end of period) first.  Once the budget is spent it falls back to
+// fair sharing until its next period, so it cannot starve the rest.
+// The budget is only checked on traps, so an environment can overrun
+// it; the overrun is taken from the budgets of the next periods.
+// Admission keeps the budgets within SCHED_RT_UTIL_MAX of one CPU,
+// so that every admitted environment can get its budget on time
+// wherever it is queued.
+#define SCHED_RT_MAX		16	// Admitted environments at most
+#define SCHED_RT_UNIT		1024	// Utilization of the whole CPU
+#define SCHED_RT_UTIL_MAX	(SCHED_RT_UNIT * 3 / 4)
+
+static struct Env *sched_rt_envs[SCHED_RT_MAX];
+static unsigned sched_rt_nenvs;
+static unsigned sched_rt_util;
+
+// The run queues: the ENV_RUNNABLE environments in binary min-heaps,
+// real-time ones with budget left ordered by env_rt_deadline, the
+// others by env_vruntime, env_rq_index being each one's position.
+// An environment is on one exactly when it is ENV_RUNNABLE, which
+// sched_set_status() keeps true, so the next one to run is found in
+// constant time and queued or dequeued in O(log n), whatever NENV is.
+struct runq {
+	struct Env *rq_envs[NENV];
+	unsigned rq_len;
+};
+
+// Each CPU has run queues of its own, on which env_cpunum puts an
+// environment, and a lower bound of the virtual runtime of the
+// environments on them, which never decreases.  New and woken
+// environments start from it.  An environment stays on the CPU it
+// last ran on, where its working set may still be in the cache,
+// unless another CPU is idle; a CPU that runs out of environments
+// steals one from the busiest, see sched_steal().  All of it is
+// protected by the kernel lock.
+struct sched_cpu {
+	struct runq sc_rt_runq, sc_fair_runq;
+	uint64_t sc_min_vruntime;
+};
+
+static struct sched_cpu sched_cpus[NCPU];
+
+#define thissched (&sched_cpus[cpunum()])
+
+// Number of environments that are ENV_RUNNABLE, ENV_RUNNING or
+// ENV_DYING, for sched_halt().
+static unsigned sched_nactive;
+
+static bool
+status_active(unsigned status)
+{
+	return status == ENV_RUNNABLE || status == ENV_RUNNING ||
+	       status == ENV_DYING;
+}
+
+// Does 'e' run in the real-time class at the moment?
+static bool
+env_rt(struct Env *e)
+{
+	return e->env_rt_left > 0;
+}
+
+static uint64_t
+runq_key(struct Env *e)
+{
+	return env_rt(e) ? e->env_rt_deadline : e->env_vruntime;
+}
+
+static struct runq *
+runq_of(struct Env *e)
+{
+	struct sched_cpu *sc = &sched_cpus[e->env_cpunum];
+
+	return env_rt(e) ? &sc->sc_rt_runq : &sc->sc_fair_runq;
+}
+
+// Should 'a' run before 'b'?
+static bool
+env_before(struct Env *a, struct Env *b)
+{
+	if (env_rt(a) != env_rt(b))
+		return env_rt(a);
+	return runq_key(a) < runq_key(b);
+}
+
+static void
+runq_place(struct runq *rq, unsigned i, struct Env *e)
+{
+	rq->rq_envs[i] = e;
+	e->env_rq_index = i;
+}
+
+static void
+runq_sift_up(struct runq *rq, unsigned i)
+{
+	struct Env *e = rq->rq_envs[i];
+	struct Env *parent;
+
+	while (i > 0 && runq_key(e) < runq_key(parent = rq->rq_envs[(i - 1) / 2])) {
+		runq_place(rq, i, parent);
+		i = (i - 1) / 2;
+	}
+	runq_place(rq, i, e);
+}
+
+static void
+runq_sift_down(struct runq *rq, unsigned i)
+{
+	struct Env *e = rq->rq_envs[i];
+	struct Env **envs = rq->rq_envs;
+	unsigned child;
+
+	while ((child = 2 * i + 1) < rq->rq_len) {
+		if (child + 1 < rq->rq_len &&
+		    runq_key(envs[child + 1]) < runq_key(envs[child]))
+			child++;
+		if (runq_key(e) <= runq_key(envs[child]))
+			break;
+		runq_place(rq, i, envs[child]);
+		i = child;
+	}
+	runq_place(rq, i, e);
+}
+
+static void
+runq_insert(struct Env *e)
+{
+	struct runq *rq = runq_of(e);
+
+	assert(rq->rq_len < NENV);
+	runq_place(rq, rq->rq_len, e);
+	runq_sift_up(rq, rq->rq_len++);
+}
+
+static void
+runq_remove(struct Env *e)
+{
+	struct runq *rq = runq_of(e);
+	unsigned i = e->env_rq_index;
+
+	assert(i < rq->rq_len && rq->rq_envs[i] == e);
+	if (i != --rq->rq_len) {
+		runq_place(rq, i, rq->rq_envs[rq->rq_len]);
+		runq_sift_up(rq, i);
+		runq_sift_down(rq, rq->rq_envs[i]->env_rq_index);
+	}
+}
+
+// The runnable environment for 'sc' to run next, or NULL.
+static struct Env *
+runq_first(struct sched_cpu *sc)
+{
+	if (sc->sc_rt_runq.rq_len)
+		return sc->sc_rt_runq.rq_envs[0];
+	if (sc->sc_fair_runq.rq_len)
+		return sc->sc_fair_runq.rq_envs[0];
+	return NULL;
+}
+
+static void
+update_min_vruntime(void)
+{
+	struct sched_cpu *sc = thissched;
+	struct runq *rq = &sc->sc_fair_runq;
+	uint64_t vruntime;
+
+	if (curenv && curenv->env_status == ENV_RUNNING) {
+		vruntime = curenv->env_vruntime;
+		if (rq->rq_len && rq->rq_envs[0]->env_vruntime < vruntime)
+			vruntime = rq->rq_envs[0]->env_vruntime;
+	} else if (rq->rq_len)
+		vruntime = rq->rq_envs[0]->env_vruntime;
+	else
+		return;
+
+	if (vruntime > sc->sc_min_vruntime)
+		sc->sc_min_vruntime = vruntime;
+}
+
+// Is 'e' put on the CPU by another CPU than this one?  It goes on
+// running there until that CPU traps.
+static bool
+env_on_other_cpu(struct Env *e)
+{
+	return e->env_cpunum != cpunum() && cpus[e->env_cpunum].cpu_env == e;
+}
+
+// How many environments CPU 'cpu' has to run, the one on it included.
+static unsigned
+sched_load(int cpu)
+{
+	struct sched_cpu *sc = &sched_cpus[cpu];
+	struct Env *e = cpus[cpu].cpu_env;
+
+	return sc->sc_rt_runq.rq_len + sc->sc_fair_runq.rq_len +
+		(e && e->env_status == ENV_RUNNING);
+}
+
+// Move 'e', which is on no run queue, to the run queues of 'cpu',
+// keeping how far its virtual runtime is ahead of or behind the others.
+static void
+sched_migrate(struct Env *e, int cpu)
+{
+	int64_t lag;
+
+	if (e->env_cpunum == cpu)
+		return;
+
+	lag = e->env_vruntime - sched_cpus[e->env_cpunum].sc_min_vruntime;
+	lag += sched_cpus[cpu].sc_min_vruntime;
+	e->env_vruntime = MAX(lag, 0);
+	e->env_cpunum = cpu;
+}
+
+// The CPU to queue 'e' on when it becomes runnable.
+static int
+sched_pick_cpu(struct Env *e)
+{
+	int i;
+
+	if (e->env_cpu_pin >= 0)
+		return e->env_cpu_pin;
+	if (!sched_load(e->env_cpunum))
+		return e->env_cpunum;
+	for (i = 0; i < ncpu; i++)
+		if (cpus[i].cpu_status == CPU_STARTED && !sched_load(i))
+			return i;
+	return e->env_cpunum;
+}
+
+// Have CPU 'cpu' trap into the kernel to look at its run queues.
+static void
+sched_kick(int cpu)
+{
+	if (cpu != cpunum())
+		lapic_ipi(cpus[cpu].cpu_id, IRQ_OFFSET + IRQ_RESCHED);
+}
+
+// Take the first fair share environment that is not pinned to its CPU
+// from the run queue of the busiest CPU, if that has at least two more
+// to run than this one.  Real-time environments stay where they are.
+static void
+sched_steal(void)
+{
+	int i, busiest = cpunum();
+	struct runq *rq;
+	struct Env *e;
+
+	for (i = 0; i < ncpu; i++)
+		if (sched_cpus[i].sc_fair_runq.rq_len &&
+		    sched_load(i) > sched_load(busiest))
+			busiest = i;
+	if (sched_load(busiest) < sched_load(cpunum()) + 2)
+		return;
+
+	rq = &sched_cpus[busiest].sc_fair_runq;
+	e = NULL;
+	for (i = 0; i < rq->rq_len; i++)
+		if (rq->rq_envs[i]->env_cpu_pin < 0 &&
+		    (!e || env_before(rq->rq_envs[i], e)))
+			e = rq->rq_envs[i];
+	if (!e)
+		return;
+	runq_remove(e);
+	sched_migrate(e, cpunum());
+	runq_insert(e);
+}
+
+// Start a new period for the real-time environments whose period is
+// over, adding the budgets of the periods past, up to a full budget.
+static void
+sched_rt_replenish(void)
+{
+	uint64_t now = read_tsc();
+	uint64_t periods;
+	struct Env *e;
+	bool queued;
+	unsigned i;
+
+	for (i = 0; i < sched_rt_nenvs; i++) {
+		e = sched_rt_envs[i];
+		if (now < e->env_rt_deadline)
+			continue;
+
+		if ((queued = e->env_status == ENV_RUNNABLE))
+			runq_remove(e);
+		periods = (now - e->env_rt_deadline) / e->env_rt_period + 1;
+		e->env_rt_deadline += periods * e->env_rt_period;
+		e->env_rt_left = MIN(e->env_rt_left +
+				     (int64_t) (periods * e->env_rt_budget),
+				     (int64_t) e->env_rt_budget);
+		if (queued)
+			runq_insert(e);
+	}
+}
+
+static unsigned
+rt_util(uint64_t budget, uint64_t period)
+{
+	return period ? (budget * SCHED_RT_UNIT + period - 1) / period : 0;
+}
+
+// Admit 'e' to the real-time class with a budget of 'budget_ms' every
+// 'period_ms' milliseconds, change its budget and period if it is
+// admitted already, or take it out of the class if 'budget_ms' is 0.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if budget_ms exceeds period_ms.
+//	-E_BUSY if admitting 'e' would oversubscribe the CPU.
+int
+sched_set_deadline(struct Env *e, unsigned budget_ms, unsigned period_ms)
+{
+	uint64_t budget = (uint64_t) budget_ms * cpu_freq;
+	uint64_t period = (uint64_t) period_ms * cpu_freq;
+	unsigned util, old_util;
+	bool queued;
+	unsigned i;
+
+	if (!budget_ms)
+		budget = period = 0;
+	else if (budget_ms > period_ms)
+		return -E_INVAL;
+
+	util = rt_util(budget, period);
+	old_util = rt_util(e->env_rt_budget, e->env_rt_period);
+	if (sched_rt_util - old_util + util > SCHED_RT_UTIL_MAX ||
+	    (!old_util && util && sched_rt_nenvs == SCHED_RT_MAX))
+		return -E_BUSY;
+
+	if (old_util && !util) {
+		for (i = 0; sched_rt_envs[i] != e; i++)
+			;
+		sched_rt_envs[i] = sched_rt_envs[--sched_rt_nenvs];
+	} else if (!old_util && util)
+		sched_rt_envs[sched_rt_nenvs++] = e;
+	sched_rt_util += util - old_util;
+
+	if ((queued = e->env_status == ENV_RUNNABLE))
+		runq_remove(e);
+	e->env_rt_budget = e->env_rt_left = budget;
+	e->env_rt_period = period;
+	e->env_rt_deadline = read_tsc() + period;
+	if (queued)
+		runq_insert(e);
+
+	return 0;
+}
+
+// Keep 'e' on CPU 'cpu' from now on, or let it move again if 'cpu'
+// is -1.  A runnable 'e' moves to that CPU's run queues at once, a
+// running one on its next trap, see sched_resume(), and a blocked one
+// when it wakes up.
+//
+// Returns 0 on success, -E_INVAL if 'cpu' is not a started CPU or -1.
+int
+sched_set_cpu(struct Env *e, int cpu)
+{
+	if (cpu < -1 || cpu >= ncpu ||
+	    (cpu >= 0 && cpus[cpu].cpu_status != CPU_STARTED))
+		return -E_INVAL;
+
+	e->env_cpu_pin = cpu;
+	if (cpu >= 0 && e->env_status == ENV_RUNNABLE &&
+	    e->env_cpunum != cpu) {
+		runq_remove(e);
+		sched_migrate(e, cpu);
+		runq_insert(e);
+		sched_kick(cpu);
+	} else if (cpu >= 0 && env_on_other_cpu(e) && e->env_cpunum != cpu)
+		sched_kick(e->env_cpunum);
+	return 0;
+}
+
+// Block 'e' on the wait queue 'wq', a list of environments linked
+// through env_wq_next, until sched_wake_all(wq).
+void
+sched_wait(struct Env **wq, struct Env *e)
+{
+	assert(!e->env_wq_pprev);
+
+	sched_set_status(e, ENV_NOT_RUNNABLE);
+	if ((e->env_wq_next = *wq))
+		(*wq)->env_wq_pprev = &e->env_wq_next;
+	e->env_wq_pprev = wq;
+	*wq = e;
+}
+
+static void
+sched_wait_cancel(struct Env *e)
+{
+	if (!e->env_wq_pprev)
+		return;
+
+	if (e->env_wq_next)
+		e->env_wq_next->env_wq_pprev = e->env_wq_pprev;
+	*e->env_wq_pprev = e->env_wq_next;
+	e->env_wq_next = NULL;
+	e->env_wq_pprev = NULL;
+}
+
+// Take the environment that has waited longest off wait queue 'wq',
+// leaving it blocked, and return it, or NULL if 'wq' is empty.
+struct Env *
+sched_wait_dequeue(struct Env **wq)
+{
+	struct Env *e;
+
+	if (!(e = *wq))
+		return NULL;
+	while (e->env_wq_next)
+		e = e->env_wq_next;
+	sched_wait_cancel(e);
+	return e;
+}
+
+// Make all the environments on wait queue 'wq' runnable, with 'ret'
+// as the return value of the system call they blocked in.
+void
+sched_wake_all(struct Env **wq, int32_t ret)
+{
+	struct Env *e;
+
+	while ((e = *wq)) {
+		sched_wait_cancel(e);
+		e->env_tf.tf_regs.reg_eax = ret;
+		sched_set_status(e, ENV_RUNNABLE);
+	}
+}
+
+// Change the status of 'e'.  All changes of env_status but the
+// initial ENV_FREE go through here to keep the run queues up to date.
+// A new environment starts with the least virtual runtime of the
+// runnable ones, a woken one gets SCHED_WAKEUP_CREDIT_MS on them.
+// One that stops being blocked loses its timeout and leaves its wait
+// queue, a freed or zombie one leaves the real-time class.  Another
+// CPU that gets an environment to run or has to stop running its own
+// is interrupted to reschedule.
+void
+sched_set_status(struct Env *e, unsigned status)
+{
+	uint64_t credit, min_vruntime;
+	struct Env *cur;
+	int cpu;
+
+	// Woken up before the CPU it blocked on switched away from it.
+	if (status == ENV_RUNNABLE && env_on_other_cpu(e))
+		status = ENV_RUNNING;
+	else if (status != ENV_RUNNING && env_on_other_cpu(e))
+		sched_kick(e->env_cpunum);
+
+	if (status != ENV_NOT_RUNNABLE) {
+		timer_cancel(e);
+		sched_wait_cancel(e);
+	}
+	if ((status == ENV_FREE || status == ENV_ZOMBIE) && e->env_rt_budget)
+		sched_set_deadline(e, 0, 0);
+
+	if (e->env_status == ENV_RUNNABLE)
+		runq_remove(e);
+	if (status == ENV_RUNNABLE) {
+		credit = (uint64_t) SCHED_WAKEUP_CREDIT_MS * cpu_freq;
+		if (e->env_status == ENV_FREE) {
+			e->env_cpunum = cpunum();
+			cpu = sched_pick_cpu(e);
+			e->env_cpunum = cpu;
+			e->env_vruntime = sched_cpus[cpu].sc_min_vruntime;
+		} else if (e->env_status != ENV_RUNNING) {
+			cpu = sched_pick_cpu(e);
+			sched_migrate(e, cpu);
+			min_vruntime = sched_cpus[cpu].sc_min_vruntime;
+			if (e->env_vruntime + credit < min_vruntime)
+				e->env_vruntime = min_vruntime - credit;
+		} else {
+			cpu = e->env_cpu_pin >= 0 ?
+				e->env_cpu_pin : e->env_cpunum;
+			sched_migrate(e, cpu);
+		}
+		runq_insert(e);
+
+		cur = cpus[cpu].cpu_env;
+		if (!cur || cur->env_status != ENV_RUNNING ||
+		    (env_rt(e) && env_before(e, cur)))
+			sched_kick(cpu);
+	}
+
+	sched_nactive += status_active(status);
+	sched_nactive -= status_active(e->env_status);
+	e->env_status = status;
+}
+
+// Charge 'e' for the time since env_run() last put it on the CPU,
+// and publish its page count in env_stats.  Called on every trap
+// from it.
+void
+sched_account(struct Env *e)
+{
+	uint64_t now = read_tsc();
+	uint64_t delta = now - e->env_tsc_start;
+
+	e->env_tsc_start = now;
+	e->env_runtime += delta;
+	e->env_vruntime += delta * SCHED_WEIGHT_DEFAULT /
+		sched_prio_weight[e->env_priority - ENV_PRIO_MIN];
+	if (e->env_rt_budget)
+		e->env_rt_left -= delta;
+	e->env_stats.es_npages = pgdir_npages(e->env_pgdir);
+	update_min_vruntime();
+}
+
+// The timer ticked.  Start new real-time periods, and preempt the
+// current environment if a runnable one is owed the CPU before it,
+// otherwise let it go on.
+void
+sched_tick(void)
+{
+	struct Env *first;
+
+	timer_run();
+	sched_rt_replenish();
+	if (!runq_first(thissched))
+		sched_steal();
+	first = runq_first(thissched);
+	if (curenv && curenv->env_status == ENV_RUNNING &&
+	    !(first && env_before(first, curenv)))
+		return;
+
+	sched_yield();
+}
+
+// Program the timer for the next scheduling event after the current
+// environment is put on the CPU: the end of its time slice if another
+// environment is waiting, the end of its real-time budget, the start
+// of a period that lets a waiting real-time environment run, or a
+// timeout.  Every CPU wakes up for the timeouts, whichever runs them.
+// Without any of these the timer is stopped; the RTC tick keeps the
+// time in vsys current.
+void
+sched_timer_arm(void)
+{
+	uint64_t now = read_tsc();
+	uint64_t deadline = ~0ull;
+	struct Env *e;
+	unsigned i;
+
+	if (timer_next())
+		deadline = MIN(deadline, timer_next());
+
+	if (runq_first(thissched))
+		deadline = MIN(deadline,
+			       now + (uint64_t) sched_quantum_ms * cpu_freq);
+	if (env_rt(curenv))
+		deadline = MIN(deadline, now + curenv->env_rt_left);
+
+	for (i = 0; i < sched_rt_nenvs; i++) {
+		e = sched_rt_envs[i];
+		if (e->env_cpunum == cpunum() && !env_rt(e) &&
+		    (e->env_status == ENV_RUNNABLE ||
+				   e->env_status == ENV_RUNNING))
+			deadline = MIN(deadline, e->env_rt_deadline);
+	}
+
+	clockev_program(deadline == ~0ull ? 0 : deadline);
+}
+
+// Return to the current environment after a trap, unless a real-time
+// environment it woke up, say by IPC, is to run before it, it cannot
+// run any more, or it is pinned to another CPU.
+void
+sched_resume(void)
+{
+	struct Env *first = runq_first(thissched);
+
+	if (curenv && curenv->env_status == ENV_RUNNING &&
+	    curenv->env_cpu_pin >= 0 && curenv->env_cpu_pin != cpunum())
+		sched_set_status(curenv, ENV_RUNNABLE);
+	if (curenv && curenv->env_status == ENV_RUNNING &&
+	    !(first && env_rt(first) && env_before(first, curenv)))
+		env_run(curenv);
+
+	sched_yield();
+}
+
+// Run 'e', which the current environment has just woken up and now
+// waits for, say with a synchronous IPC call, on this CPU right away
+// instead of looking through the run queues.  Falls back to
+// sched_yield() if 'e' did not become runnable or a real-time
+// environment is to run before it.
+void
+sched_handoff(struct Env *e)
+{
+	struct Env *first = runq_first(thissched);
+
+	if (e->env_status != ENV_RUNNABLE ||
+	    (first && env_rt(first) && env_before(first, e)))
+		sched_yield();
+
+	runq_remove(e);
+	sched_migrate(e, cpunum());
+	runq_insert(e);
+	env_run(e);
+}
 
 // Choose a user environment to run and run it.
 void
 sched_yield(void)
 {
-	// Implement simple round-robin scheduling.
-	//
-	// Search through 'envs' for an ENV_RUNNABLE environment in
-	// circular fashion starting just after the env was
-	// last running.  Switch to the first such environment found.
+	struct Env *first;
+
+	// Run the real-time environment with the earliest deadline,
+	// or else the fair share one with the least virtual runtime,
+	// of this CPU's run queues, stealing one if they are empty.
+	// env_run() puts the current one, if still ENV_RUNNING, back
+	// on a run queue.
 	//
 	// If no envs are runnable, but the environment previously
 	// running is still ENV_RUNNING, it's okay to
@@ -26,27 +670,13 @@ sched_yield(void)
 	// below to halt the cpu.
 
 	// LAB 3: Your code here.
-	// env_run(&envs[0]);
-	
-	unsigned int i, curenv_idx;
-
-	curenv_idx = (curenv) ? ENVX(curenv->env_id) : 0;
-
-	for (i = curenv_idx; i < NENV; i++)
-	{
-		if (envs[i].env_status == ENV_RUNNABLE)
-		{
-			env_run(envs + i);
-		}
-	}
-
-	for (i = 0; i < curenv_idx; i++)
-	{	
-		if (envs[i].env_status == ENV_RUNNABLE)
-		{
-			env_run(envs + i);
-		}
-	}
+	timer_run();
+	sched_rt_replenish();
+	update_min_vruntime();
+	if (!runq_first(thissched))
+		sched_steal();
+	if ((first = runq_first(thissched)))
+		env_run(first);
 
 	if (curenv && curenv->env_status == ENV_RUNNING)
 	{
@@ -63,33 +693,59 @@ sched_yield(void)
 void
 sched_halt(void)
 {
-	int i;
-
 	// For debugging and testing purposes, if there are no runnable
 	// environments in the system, then drop into the kernel monitor.
-	for (i = 0; i < NENV; i++) {
-		if ((envs[i].env_status == ENV_RUNNABLE ||
-		     envs[i].env_status == ENV_RUNNING ||
-		     envs[i].env_status == ENV_DYING))
-			break;
-	}
-	if (i == NENV) {
+	if (!sched_nactive) {
 		cprintf("No runnable environments in the system!\n");
 		while (1)
 			monitor(NULL);
 	}
 
-	// Mark that no environment is running on CPU
+	// Mark that no environment is running on CPU, and do not keep
+	// the page directory of one that may be freed on another.
 	curenv = NULL;
+	lcr3(PADDR(kern_pgdir));
 
-	// Reset stack pointer, enable interrupts and then halt.
+	// Nothing is due until the next timeout, if any, or until an
+	// interrupt makes an environment runnable, so do not tick.
+	clockev_program(timer_next());
+
+	unlock_kernel();
+
+	// Reset stack pointer and go idle.
 	asm volatile (
 		"movl $0, %%ebp\n"
 		"movl %0, %%esp\n"
 		"pushl $0\n"
 		"pushl $0\n"
-		"sti\n"
-		"hlt\n"
-	: : "a" (cpu_ts.ts_esp0));
+		"call *%1\n"
+	: : "a" (thiscpu->cpu_ts.ts_esp0), "c" (sched_idle));
+	panic("sched_halt: sched_idle returned");
+}
+
+// Use the idle time to zero free pages for page_alloc(ALLOC_ZERO),
+// then halt until the next interrupt.  Interrupts are let in between
+// pages; the trap they cause never returns here, it reenters
+// sched_halt() on a fresh stack if there is still nothing to run.
+// The kernel lock is only held for each page.
+static void
+sched_idle(void)
+{
+	int filled;
+
+	for (;;) {
+		lock_kernel();
+		filled = page_zero_fill();
+		unlock_kernel();
+		if (!filled)
+			break;
+		asm volatile("sti\n"
+			     "nop\n"
+			     "cli\n");
+	}
+
+	asm volatile("sti\n"
+		     "hlt\n");
+	panic("sched_idle: woke up without an interrupt");
 }
 
@@ -6,7 +6,32 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
-// This function does not return.
+#include <inc/types.h>
+
+struct Env;
+
+// The real-time budget of the file server, see sched_set_deadline().
+#define SCHED_FS_BUDGET_MS	10
+#define SCHED_FS_PERIOD_MS	50
+
+// The default time slice, see sched_quantum_ms.
+#define SCHED_QUANTUM_MS	10
+
+extern unsigned sched_quantum_ms;
+
+// These functions do not return.
 void sched_yield(void) __attribute__((noreturn));
+void sched_resume(void) __attribute__((noreturn));
+void sched_handoff(struct Env *e) __attribute__((noreturn));
+
+void sched_set_status(struct Env *e, unsigned status);
+void sched_wait(struct Env **wq, struct Env *e);
+struct Env *sched_wait_dequeue(struct Env **wq);
+void sched_wake_all(struct Env **wq, int32_t ret);
+int sched_set_deadline(struct Env *e, unsigned budget_ms, unsigned period_ms);
+int sched_set_cpu(struct Env *e, int cpu);
+void sched_account(struct Env *e);
+void sched_tick(void);
+void sched_timer_arm(void);
 
 #endif	// !JOS_KERN_SCHED_H
@@ -8,14 +8,27 @@
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 #include <kern/kdebug.h>
+#include <kern/pmap.h>
 
 // The big kernel lock
 struct spinlock kernel_lock = {
-#ifdef DEBUG_SPINLOCK
 	.name = "kernel_lock"
-#endif
 };
 
+#ifdef SPINLOCK_STATS
+// All locks, for spin_print_stats(), protected by the kernel lock.
+static struct spinlock *spin_locks = &kernel_lock;
+
+// How many locks spin_print_stats() ranks at most.
+#define SPIN_STATS_MAX	64
+#endif
+
+// The queue nodes of each CPU, one for every MCS lock it may hold or
+// wait for at once.
+#define MCS_NODES	4
+
+static struct mcs_node mcs_nodes[NCPU][MCS_NODES];
+
 #ifdef DEBUG_SPINLOCK
 // Record the current call stack in pcs[] by following the %ebp chain.
 static void
@@ -35,23 +48,248 @@ get_caller_pcs(uint32_t pcs[])
 		pcs[i] = 0;
 }
 
+// Is the lock held by any CPU?
+static int
+locked(struct spinlock *lock)
+{
+#if SPINLOCK_KIND == SPINLOCK_TICKET
+	return lock->lock.next != lock->lock.owner;
+#elif SPINLOCK_KIND == SPINLOCK_MCS
+	return lock->lock.tail != NULL;
+#else
+	return lock->lock.locked;
+#endif
+}
+
 // Check whether this CPU is holding the lock.
 static int
 holding(struct spinlock *lock)
 {
-	return lock->locked;
+	return locked(lock) && lock->cpu == thiscpu;
 }
 #endif
 
 void
-__spin_initlock(struct spinlock *lk, char *name)
+__spin_initlock(struct spinlock *lk, const char *name)
 {
-	lk->locked = 0;
-#ifdef DEBUG_SPINLOCK
+	memset(lk, 0, sizeof(*lk));
 	lk->name = name;
+#ifdef SPINLOCK_STATS
+	lk->link = spin_locks;
+	spin_locks = lk;
+#endif
+}
+
+// Forget a lock about to be freed.
+void
+spin_destroylock(struct spinlock *lk)
+{
+#ifdef SPINLOCK_STATS
+	struct spinlock **lkp;
+
+	for (lkp = &spin_locks; *lkp; lkp = &(*lkp)->link)
+		if (*lkp == lk) {
+			*lkp = lk->link;
+			break;
+		}
+#endif
+}
+
+// Wait a little.  Interrupts are off while a CPU spins, so it does
+// the TLB flush that the CPU holding the lock may be waiting for,
+// see tlb_shootdown().
+static void
+spin_pause(void)
+{
+	tlb_shootdown_handle();
+	asm volatile ("pause");
+}
+
+// Test-and-set.  Take the lock, waiting for it if held.  Returns
+// whether it had to wait.
+static bool
+tas_acquire(struct tas_lock *l)
+{
+	// The xchg is atomic.
+	// It also serializes, so that reads after acquire are not
+	// reordered before it.
+	if (xchg(&l->locked, 1) == 0)
+		return 0;
+	while (xchg(&l->locked, 1) != 0)
+		spin_pause();
+	return 1;
+}
+
+// Take the lock if it is free.
+static bool
+tas_tryacquire(struct tas_lock *l)
+{
+	return xchg(&l->locked, 1) == 0;
+}
+
+static void
+tas_release(struct tas_lock *l)
+{
+	// The xchg serializes, so that reads before release are 
+	// not reordered after it.  The 1996 PentiumPro manual (Volume 3,
+	// 7.2) says reads can be carried out speculatively and in
+	// any order, which implies we need to serialize here.
+	// But the 2007 Intel 64 Architecture Memory Ordering White
+	// Paper says that Intel 64 and IA-32 will not move a load
+	// after a store. So lock->locked = 0 would work here.
+	// The xchg being asm volatile ensures gcc emits it after
+	// the above assignments (and after the critical section).
+	xchg(&l->locked, 0);
+}
+
+// Ticket lock, first come first served.
+static bool
+ticket_acquire(struct ticket_lock *l)
+{
+	// The xadd is atomic and serializes, so that reads after
+	// acquire are not reordered before it.
+	uint32_t ticket = xadd(&l->next, 1);
+
+	if (l->owner == ticket)
+		return 0;
+	while (l->owner != ticket)
+		spin_pause();
+	return 1;
+}
+
+static bool
+ticket_tryacquire(struct ticket_lock *l)
+{
+	uint32_t ticket = l->owner;
+
+	return cmpxchg(&l->next, ticket, ticket + 1) == ticket;
+}
+
+static void
+ticket_release(struct ticket_lock *l)
+{
+	// Only the holder writes owner.  x86 does not move stores
+	// before earlier loads or stores, so the barrier that keeps
+	// gcc from moving the critical section after the store is
+	// enough.
+	asm volatile("" ::: "memory");
+	l->owner++;
+}
+
+// MCS lock, first come first served, each waiter spinning on a queue
+// node of its own CPU.
+static struct mcs_node *
+mcs_node_get(void)
+{
+	struct mcs_node *n;
+
+	for (n = mcs_nodes[cpunum()]; n->used; n++)
+		assert(n + 1 < mcs_nodes[cpunum()] + MCS_NODES);
+	n->used = 1;
+	n->next = NULL;
+	n->locked = 1;
+	return n;
+}
+
+static bool
+mcs_acquire(struct mcs_lock *l)
+{
+	// Join the queue at the tail, then wait for the waiter before
+	// to hand the lock over.
+	struct mcs_node *n = mcs_node_get();
+	struct mcs_node *prev;
+
+	prev = (struct mcs_node *) xchg((volatile uint32_t *) &l->tail,
+					(uint32_t) n);
+	if (prev) {
+		prev->next = n;
+		while (n->locked)
+			spin_pause();
+	}
+	l->node = n;
+	return prev != NULL;
+}
+
+static bool
+mcs_tryacquire(struct mcs_lock *l)
+{
+	struct mcs_node *n = mcs_node_get();
+
+	if (cmpxchg((volatile uint32_t *) &l->tail, 0, (uint32_t) n)) {
+		n->used = 0;
+		return 0;
+	}
+	l->node = n;
+	return 1;
+}
+
+static void
+mcs_release(struct mcs_lock *l)
+{
+	struct mcs_node *n = l->node;
+
+	// Without a waiter queued behind, free the lock, unless one
+	// joins the queue meanwhile; then wait until it links up.
+	if (!n->next) {
+		if (cmpxchg((volatile uint32_t *) &l->tail,
+			    (uint32_t) n, 0) == (uint32_t) n) {
+			n->used = 0;
+			return;
+		}
+		while (!n->next)
+			asm volatile ("pause");
+	}
+	n->next->locked = 0;
+	n->used = 0;
+}
+
+// The kind of lock that spin_lock() takes, see SPINLOCK_KIND.
+#if SPINLOCK_KIND == SPINLOCK_TICKET
+#define spin_acquire(lk)	ticket_acquire(&(lk)->lock)
+#define spin_tryacquire(lk)	ticket_tryacquire(&(lk)->lock)
+#define spin_release(lk)	ticket_release(&(lk)->lock)
+#elif SPINLOCK_KIND == SPINLOCK_MCS
+#define spin_acquire(lk)	mcs_acquire(&(lk)->lock)
+#define spin_tryacquire(lk)	mcs_tryacquire(&(lk)->lock)
+#define spin_release(lk)	mcs_release(&(lk)->lock)
+#else
+#define spin_acquire(lk)	tas_acquire(&(lk)->lock)
+#define spin_tryacquire(lk)	tas_tryacquire(&(lk)->lock)
+#define spin_release(lk)	tas_release(&(lk)->lock)
 #endif
+
+#ifdef SPINLOCK_STATS
+// Count an acquisition of 'lk' by 'pc', which waited since 'start'.
+static void
+spin_stats_acquired(struct spinlock *lk, uint64_t start, bool contended,
+		    uintptr_t pc)
+{
+	struct spinlock_stats *st = &lk->stats;
+	uint64_t now = read_tsc();
+
+	st->acquired++;
+	if (contended) {
+		st->contended++;
+		st->spin += now - start;
+		if (now - start > st->spin_max) {
+			st->spin_max = now - start;
+			st->spin_max_pc = pc;
+		}
+	}
+	st->hold_start = now;
 }
 
+static void
+spin_stats_released(struct spinlock *lk)
+{
+	struct spinlock_stats *st = &lk->stats;
+	uint64_t held = read_tsc() - st->hold_start;
+
+	st->hold += held;
+	st->hold_max = MAX(st->hold_max, held);
+}
+#endif
+
 // Acquire the lock.
 // Loops (spins) until the lock is acquired.
 // Holding a lock for a long time may cause
@@ -59,21 +297,51 @@ __spin_initlock(struct spinlock *lk, char *name)
 void
 spin_lock(struct spinlock *lk)
 {
+#ifdef SPINLOCK_STATS
+	uint64_t start = read_tsc();
+#endif
+	bool contended;
+
 #ifdef DEBUG_SPINLOCK
 	if (holding(lk))
 		panic("Cannot acquire %s: already holding", lk->name);
 #endif
 
-	// The xchg is atomic.
-	// It also serializes, so that reads after acquire are not
-	// reordered before it.
-	while (xchg(&lk->locked, 1) != 0)
-		asm volatile ("pause");
+	contended = spin_acquire(lk);
 
 	// Record info about lock acquisition for debugging.
+#ifdef SPINLOCK_STATS
+	spin_stats_acquired(lk, start, contended,
+			    (uintptr_t) __builtin_return_address(0));
+#endif
+#ifdef DEBUG_SPINLOCK
+	lk->cpu = thiscpu;
+	get_caller_pcs(lk->pcs);
+#endif
+	(void) contended;
+}
+
+// Try to acquire the lock once.  Returns 1 if it was free and is now
+// held, 0 if not.
+int
+spin_trylock(struct spinlock *lk)
+{
+#ifdef DEBUG_SPINLOCK
+	if (holding(lk))
+		panic("Cannot acquire %s: already holding", lk->name);
+#endif
+
+	if (!spin_tryacquire(lk))
+		return 0;
+
+#ifdef SPINLOCK_STATS
+	spin_stats_acquired(lk, 0, 0, 0);
+#endif
 #ifdef DEBUG_SPINLOCK
+	lk->cpu = thiscpu;
 	get_caller_pcs(lk->pcs);
 #endif
+	return 1;
 }
 
 // Release the lock.
@@ -101,17 +369,151 @@ spin_unlock(struct spinlock *lk)
 	}
 
 	lk->pcs[0] = 0;
+	lk->cpu = 0;
+#endif
+#ifdef SPINLOCK_STATS
+	spin_stats_released(lk);
 #endif
 
-	// The xchg serializes, so that reads before release are 
-	// not reordered after it.  The 1996 PentiumPro manual (Volume 3,
-	// 7.2) says reads can be carried out speculatively and in
-	// any order, which implies we need to serialize here.
-	// But the 2007 Intel 64 Architecture Memory Ordering White
-	// Paper says that Intel 64 and IA-32 will not move a load
-	// after a store. So lock->locked = 0 would work here.
-	// The xchg being asm volatile ensures gcc emits it after
-	// the above assignments (and after the critical section).
-	xchg(&lk->locked, 0);
+	spin_release(lk);
+}
+
+#ifdef SPINLOCK_STATS
+// Put up to SPIN_STATS_MAX locks in 'locks', most waited for first.
+// Returns how many.
+static unsigned
+spin_stats_rank(struct spinlock **locks)
+{
+	struct spinlock *lk;
+	unsigned n, i;
+
+	n = 0;
+	for (lk = spin_locks; lk && n < SPIN_STATS_MAX; lk = lk->link) {
+		for (i = n++; i > 0 &&
+		     locks[i - 1]->stats.spin < lk->stats.spin; i--)
+			locks[i] = locks[i - 1];
+		locks[i] = lk;
+	}
+	return n;
+}
+#endif
+
+// Print the statistics of the locks, most waited for first, and
+// clear them if 'reset'.  Called with the kernel lock held.
+void
+spin_print_stats(bool reset)
+{
+#ifdef SPINLOCK_STATS
+	struct spinlock *locks[SPIN_STATS_MAX];
+	struct spinlock_stats *st;
+	struct Eipdebuginfo info;
+	unsigned n, j;
+
+	n = spin_stats_rank(locks);
+
+	cprintf("%-16s %10s %10s %12s %10s %12s %10s  %s\n",
+		"lock", "acquired", "contended", "spin", "spin max",
+		"hold", "hold max", "longest waiter");
+	for (j = 0; j < n; j++) {
+		st = &locks[j]->stats;
+		cprintf("%-16s %10llu %10llu %12llu %10llu %12llu %10llu",
+			locks[j]->name, st->acquired, st->contended,
+			st->spin, st->spin_max, st->hold, st->hold_max);
+		if (st->spin_max_pc &&
+		    debuginfo_eip(st->spin_max_pc, &info) >= 0)
+			cprintf("  %.*s+%x", info.eip_fn_namelen,
+				info.eip_fn_name,
+				st->spin_max_pc - info.eip_fn_addr);
+		cprintf("\n");
+		if (reset) {
+			uint64_t hold_start = st->hold_start;
+
+			memset(st, 0, sizeof(*st));
+			st->hold_start = hold_start;
+		}
+	}
+#else
+	cprintf("Lock statistics are disabled, see SPINLOCK_STATS\n");
+#endif
 }
 
+// Check all three kinds of locks, whichever spin_lock() takes, and
+// the ranking of the statistics if they are kept.  Runs on the boot
+// CPU before the others start and before it takes the kernel lock, so
+// nothing else holds a lock; waiters are queued by hand.
+void
+check_spinlock(void)
+{
+	struct tas_lock tas = { 0 };
+	struct ticket_lock ticket = { 0, 0 };
+	struct mcs_lock mcs = { NULL, NULL }, mcs2 = { NULL, NULL };
+	struct mcs_node *n, *prev;
+	uint32_t t;
+	int i;
+
+	// test-and-set
+	assert(tas_acquire(&tas) == 0);
+	assert(!tas_tryacquire(&tas));
+	tas_release(&tas);
+	assert(tas_tryacquire(&tas));
+	tas_release(&tas);
+	assert(!tas.locked);
+
+	// a ticket taken while the lock is held is served next
+	assert(ticket_acquire(&ticket) == 0);
+	assert(!ticket_tryacquire(&ticket));
+	t = xadd(&ticket.next, 1);
+	ticket_release(&ticket);
+	assert(ticket.owner == t);
+	assert(!ticket_tryacquire(&ticket));
+	ticket_release(&ticket);
+	assert(ticket_tryacquire(&ticket));
+	ticket_release(&ticket);
+	assert(ticket.next == ticket.owner);
+
+	// nested MCS locks take nodes of their own, and a waiter
+	// queued behind the holder is handed the lock
+	assert(mcs_acquire(&mcs) == 0);
+	assert(mcs_tryacquire(&mcs2));
+	assert(mcs2.node != mcs.node);
+	assert(!mcs_tryacquire(&mcs));
+	n = mcs_node_get();
+	prev = (struct mcs_node *) xchg((volatile uint32_t *) &mcs.tail,
+					(uint32_t) n);
+	assert(prev == mcs.node);
+	prev->next = n;
+	mcs_release(&mcs);
+	assert(!n->locked && mcs.tail == n);
+	mcs.node = n;
+	mcs_release(&mcs);
+	mcs_release(&mcs2);
+	assert(!mcs.tail && !mcs2.tail);
+	for (i = 0; i < MCS_NODES; i++)
+		assert(!mcs_nodes[cpunum()][i].used);
+
+#ifdef SPINLOCK_STATS
+	{
+		struct spinlock lk, *locks[SPIN_STATS_MAX];
+		unsigned nlocks, j;
+
+		// counted, ranked first once most waited for, and
+		// forgotten when destroyed
+		spin_initlock(&lk);
+		spin_lock(&lk);
+		spin_unlock(&lk);
+		assert(spin_trylock(&lk));
+		spin_unlock(&lk);
+		assert(lk.stats.acquired == 2 && lk.stats.contended == 0);
+		assert(lk.stats.hold_max <= lk.stats.hold);
+		lk.stats.spin = ~0ull;
+		nlocks = spin_stats_rank(locks);
+		assert(nlocks > 0 && locks[0] == &lk);
+		spin_destroylock(&lk);
+		nlocks = spin_stats_rank(locks);
+		for (j = 0; j < nlocks; j++)
+			assert(locks[j] != &lk);
+	}
+#endif
+
+	cprintf("check_spinlock() succeeded!\n");
+}
@@ -3,24 +3,94 @@
 
 #include <inc/types.h>
 
+struct CpuInfo;
+
 // Comment this to disable spinlock debugging
 //#define DEBUG_SPINLOCK
 
+// Uncomment this to enable lock statistics, see spin_print_stats()
+//#define SPINLOCK_STATS
+
+// The kind of lock spin_lock() takes:
+//   SPINLOCK_TAS     test-and-set, no fairness;
+//   SPINLOCK_TICKET  first come first served, all waiters spinning on
+//                    the lock itself;
+//   SPINLOCK_MCS     first come first served, each waiter spinning on
+//                    a queue node of its own CPU.
+#define SPINLOCK_TAS	0
+#define SPINLOCK_TICKET	1
+#define SPINLOCK_MCS	2
+
+#ifndef SPINLOCK_KIND
+#define SPINLOCK_KIND	SPINLOCK_TICKET
+#endif
+
+// The state of each kind of lock.  All kinds are built, so that
+// check_spinlock() can test the ones spin_lock() does not take.
+struct tas_lock {
+	volatile uint32_t locked;	// Is the lock held?
+};
+
+struct ticket_lock {
+	volatile uint32_t next;		// The next ticket to hand out
+	volatile uint32_t owner;	// The ticket that holds the lock
+};
+
+// A waiter in the queue of an MCS lock.
+struct mcs_node {
+	struct mcs_node *volatile next;	// The waiter after this one
+	volatile unsigned locked;	// Set until the lock is handed over
+	bool used;			// Taken by a lock of this CPU
+} __attribute__((aligned(64)));
+
+struct mcs_lock {
+	struct mcs_node *volatile tail;	// The last waiter, NULL if free
+	struct mcs_node *node;		// The holder's node
+};
+
+// Lock statistics, in TSC cycles where not counts.
+struct spinlock_stats {
+	uint64_t acquired;	// Acquisitions
+	uint64_t contended;	// Acquisitions that had to wait
+	uint64_t spin;		// Time spent waiting
+	uint64_t spin_max;	// Longest wait
+	uintptr_t spin_max_pc;	// The caller that waited longest
+	uint64_t hold;		// Time the lock was held
+	uint64_t hold_max;	// Longest hold
+	uint64_t hold_start;	// When the holder got it
+};
+
 // Mutual exclusion lock.
 struct spinlock {
-	unsigned locked;       // Is the lock held?
+#if SPINLOCK_KIND == SPINLOCK_TICKET
+	struct ticket_lock lock;
+#elif SPINLOCK_KIND == SPINLOCK_MCS
+	struct mcs_lock lock;
+#else
+	struct tas_lock lock;
+#endif
+
+	const char *name;      // Name of lock.
+#ifdef SPINLOCK_STATS
+	struct spinlock_stats stats;
+	struct spinlock *link; // Next in the list of all locks
+#endif
 
 #ifdef DEBUG_SPINLOCK
 	// For debugging:
-	char *name;            // Name of lock.
+	struct CpuInfo *cpu;   // The CPU holding the lock.
 	uintptr_t pcs[10];     // The call stack (an array of program counters)
 	                       // that locked the lock.
 #endif
 };
 
-void __spin_initlock(struct spinlock *lk, char *name);
+void __spin_initlock(struct spinlock *lk, const char *name);
+void spin_destroylock(struct spinlock *lk);
 void spin_lock(struct spinlock *lk);
+int spin_trylock(struct spinlock *lk);
 void spin_unlock(struct spinlock *lk);
+void spin_print_stats(bool reset);
+void check_spinlock(void);
 
 #define spin_initlock(lock)   __spin_initlock(lock, #lock)
 
@@ -10,8 +10,10 @@
 #include <kern/pmap.h>
 #include <kern/trap.h>
 #include <kern/syscall.h>
+#include <kern/kmalloc.h>
 #include <kern/console.h>
 #include <kern/sched.h>
+#include <kern/timer.h>
 #include <kern/kclock.h>
 
 // This is the current amount of login attempts
@@ -23,14 +25,24 @@ extern unsigned login_attempts;
 static void
 sys_cputs(const char *s, size_t len)
 {
-	// Check that the user has permission to read memory [s, s+len).
-	// Destroy the environment if not.
+	// Copy the string in, a piece at a time, and destroy the
+	// environment if the user cannot read memory [s, s+len).
+	char buf[128];
+	size_t n;
 
 	// LAB 8: Your code here.
-	user_mem_assert(curenv, (const void *) s, len, PTE_U);
+	for (; len; s += n, len -= n)
+	{
+		n = MIN(len, sizeof(buf));
+
+		if (copy_from_user(buf, s, n) < 0)
+		{
+			user_mem_fault(curenv);
+		}
 
-	// Print the string supplied by the user.
-	cprintf("%.*s", len, s);
+		// Print the string supplied by the user.
+		cprintf("%.*s", n, buf);
+	}
 }
 
 // Read a character from the system console without blocking.
@@ -49,12 +61,15 @@ sys_getenvid(void)
 }
 
 // Destroy a given environment (possibly the currently running environment).
+// An environment that destroys itself exits with 'status', the low 8
+// bits of which go to those waiting for it in sys_env_wait(); others
+// get ENV_EXIT_KILLED.
 //
 // Returns 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
 static int
-sys_env_destroy(envid_t envid)
+sys_env_destroy(envid_t envid, int status)
 {
 	int r;
 	struct Env *e;
@@ -62,6 +77,8 @@ sys_env_destroy(envid_t envid)
 	if ((r = envid2env(envid, &e, 1)) < 0)
 		return r;
 
+	e->env_exit_status = (e == curenv) ? (status & 0xff) : ENV_EXIT_KILLED;
+
 #ifdef DEBUG
 	if (e == curenv)
 		cprintf("[%08x] exiting gracefully\n", curenv->env_id);
@@ -73,6 +90,34 @@ sys_env_destroy(envid_t envid)
 	return 0;
 }
 
+// Block until environment envid is freed.  Any environment may wait
+// for any other while it runs.  Once it has exited, only its parent
+// can still get the status: the environment is kept as a zombie until
+// then, see env_free(), and this call frees it.  A parent that never
+// waits keeps its exited children's Envs taken until it goes away.
+//
+// Returns the exit status of envid, see sys_env_destroy(), or < 0 on
+// error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist, and is
+//		not an exited child of the caller whose status is
+//		still uncollected.
+//	-E_INVAL if envid is the current environment.
+static int
+sys_env_wait(envid_t envid)
+{
+	struct Env *e;
+
+	if (envid2env(envid, &e, 0) < 0)
+		return env_reap(curenv, envid);
+
+	if (e == curenv)
+		return -E_INVAL;
+
+	// The status comes from sched_wake_all() in env_free().
+	sched_wait(&e->env_exit_waiters, curenv);
+	return 0;
+}
+
 // Deschedule current environment and pick a different one to run.
 static void
 sys_yield(void)
@@ -102,7 +147,7 @@ sys_exofork(void)
 		return err;
 	}
 	
-	e->env_status = ENV_NOT_RUNNABLE;
+	sched_set_status(e, ENV_NOT_RUNNABLE);
 	// Copy the parent's trapframe
 	memcpy(&e->env_tf, &curenv->env_tf, sizeof(struct Trapframe));
 	// Set the return value for the child to 0
@@ -112,6 +157,106 @@ sys_exofork(void)
 	//panic("sys_exofork not implemented");
 }
 
+// Fork the current environment in one go.  The child gets the
+// parent's registers, except that sys_fork returns 0 in the child, the
+// parent's page fault upcall, a fresh user exception stack if there is
+// an upcall, and a copy-on-write copy of the parent's address space
+// made by pgdir_fork().  With 'share' (sfork), the child shares all
+// memory but the stacks with the parent instead.  The child is
+// runnable on return.
+//
+// Returns envid of new environment to the parent, < 0 on error.
+// Errors are:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_fork(bool share)
+{
+	int err;
+	struct Env *e;
+	struct PageInfo *p;
+
+	if ((err = env_alloc(&e, curenv->env_id)) < 0)
+	{
+		return err;
+	}
+
+	sched_set_status(e, ENV_NOT_RUNNABLE);
+	e->env_tf = curenv->env_tf;
+	e->env_tf.tf_regs.reg_eax = 0;
+	e->env_pgfault_upcall = curenv->env_pgfault_upcall;
+	e->env_uxstacktop = curenv->env_uxstacktop;
+
+	if ((err = pgdir_fork(e->env_pgdir, curenv->env_pgdir, share)) < 0)
+	{
+		env_destroy(e);
+		return err;
+	}
+
+	if (e->env_pgfault_upcall)
+	{
+		if (!(p = page_alloc(ALLOC_ZERO)) ||
+			page_insert(e->env_pgdir, p,
+				(void *) (e->env_uxstacktop - PGSIZE),
+				PTE_W | PTE_U | PTE_P) < 0)
+		{
+			if (p)
+			{
+				page_free(p);
+			}
+			env_destroy(e);
+			return -E_NO_MEM;
+		}
+	}
+
+	sched_set_status(e, ENV_RUNNABLE);
+
+	return e->env_id;
+}
+
+// Create a thread: a new environment sharing the current one's
+// address space, which starts at 'eip' with stack pointer 'esp' and
+// has its user exception stack below 'uxstacktop'.  The caller sets up
+// the stacks.  The thread inherits the page fault upcall and the
+// registers otherwise, and is runnable on return.  The address space
+// goes away with the last thread using it, see env_free().
+//
+// Returns envid of the new thread, < 0 on error.  Errors are:
+//	-E_INVAL if eip, esp or uxstacktop lie above UTOP, or uxstacktop
+//		is not page-aligned.
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_thread_create(uintptr_t eip, uintptr_t esp, uintptr_t uxstacktop)
+{
+	struct Env *e;
+	int err;
+
+	if (eip >= UTOP || esp > UTOP || uxstacktop > UTOP || PGOFF(uxstacktop))
+	{
+		return -E_INVAL;
+	}
+
+	if ((err = env_alloc(&e, curenv->env_id)) < 0)
+	{
+		return err;
+	}
+
+	// Trade the fresh page directory for ours.
+	page_decref(pa2page(PADDR(e->env_pgdir)));
+	e->env_pgdir = curenv->env_pgdir;
+	pa2page(PADDR(e->env_pgdir))->pp_ref++;
+
+	e->env_type = curenv->env_type;
+	e->env_tf = curenv->env_tf;
+	e->env_tf.tf_eip = eip;
+	e->env_tf.tf_esp = esp;
+	e->env_pgfault_upcall = curenv->env_pgfault_upcall;
+	e->env_uxstacktop = uxstacktop;
+
+	return e->env_id;
+}
+
 // Set envid's env_status to status, which must be ENV_RUNNABLE
 // or ENV_NOT_RUNNABLE.
 //
@@ -141,24 +286,113 @@ sys_env_set_status(envid_t envid, int status)
 		return -E_INVAL;
 	}
 
-	e->env_status = status;
+	sched_set_status(e, status);
 
 	return 0;
 	//panic("sys_env_set_status not implemented");
 }
 
-// Set envid's trap frame to 'tf'.
-// tf is modified to make sure that user environments always run at code
+// Set envid's priority, a nice level between ENV_PRIO_MIN and
+// ENV_PRIO_MAX; the lower it is, the more CPU time envid gets when it
+// competes for it, see kern/sched.c.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if priority is out of range.
+//	-E_PERM if priority is below the caller's own and the caller is
+//		not privileged (env_privileged, see env_create()).
+static int
+sys_env_set_priority(envid_t envid, int priority)
+{
+	struct Env *e;
+
+	if (envid2env(envid, &e, 1) < 0)
+	{
+		return -E_BAD_ENV;
+	}
+
+	if (priority < ENV_PRIO_MIN || priority > ENV_PRIO_MAX)
+	{
+		return -E_INVAL;
+	}
+
+	if (priority < curenv->env_priority && !curenv->env_privileged)
+	{
+		return -E_PERM;
+	}
+
+	e->env_priority = priority;
+
+	return 0;
+}
+
+// Admit envid to the real-time class, which runs it ahead of all
+// others for 'budget_ms' milliseconds of every 'period_ms', change its
+// budget and period, or with a zero budget take it out of the class.
+// See sched_set_deadline().
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if budget_ms exceeds period_ms.
+//	-E_BUSY if the real-time class cannot take the budget.
+//	-E_PERM if budget_ms is not 0 and the caller is not privileged
+//		(env_privileged, see env_create()).  Any env may leave
+//		the class.
+static int
+sys_env_set_deadline(envid_t envid, unsigned budget_ms, unsigned period_ms)
+{
+	struct Env *e;
+
+	if (envid2env(envid, &e, 1) < 0)
+	{
+		return -E_BAD_ENV;
+	}
+
+	if (budget_ms && !curenv->env_privileged)
+	{
+		return -E_PERM;
+	}
+
+	return sched_set_deadline(e, budget_ms, period_ms);
+}
+
+// Keep envid on CPU 'cpu', or let the scheduler move it between CPUs
+// again if 'cpu' is -1.  A caller that pins itself to another CPU
+// returns there.  See sched_set_cpu().
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if cpu is neither -1 nor a running CPU.
+static int
+sys_env_set_cpu(envid_t envid, int cpu)
+{
+	struct Env *e;
+
+	if (envid2env(envid, &e, 1) < 0)
+	{
+		return -E_BAD_ENV;
+	}
+
+	return sched_set_cpu(e, cpu);
+}
+
+// Set envid's trap frame to the one at 'utf' in the caller's memory.
+// The trap frame is modified to make sure that user environments always run at code
 // protection level 3 (CPL 3) with interrupts enabled.
 //
 // Returns 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
+//	-E_FAULT if the caller cannot read utf.
 static int
-sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
+sys_env_set_trapframe(envid_t envid, struct Trapframe *utf)
 {
 	// LAB 11: Your code here.
 	struct Env *env;
+	struct Trapframe tf;
 
 	// Remember to check whether the user has supplied us with a good
 	// address!
@@ -167,30 +401,59 @@ sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 		return -E_BAD_ENV;
 	}
 
-	// Check whether we are allowed to access the trapframe
-	if (user_mem_check(env, (const void *) tf,
-		sizeof(struct Trapframe), PTE_W | PTE_U | PTE_P) < 0)
+	// Fetch the trapframe from the caller
+	if (copy_from_user(&tf, utf, sizeof(struct Trapframe)) < 0)
 	{
-		return -E_BAD_ENV;
+		return -E_FAULT;
 	}
 
 	// Enable interrupts
-	tf->tf_eflags |= FL_IF;
+	tf.tf_eflags |= FL_IF;
 	// Clear IOPL
-	tf->tf_eflags &= ~FL_IOPL_3;
+	tf.tf_eflags &= ~FL_IOPL_3;
 	// Switch to protection ring 3
 	// (see env_alloc() for reference)
-	tf->tf_cs |= 3;
-	tf->tf_ss |= 3;
-	tf->tf_ds |= 3;
-	tf->tf_es |= 3;
+	tf.tf_cs |= 3;
+	tf.tf_ss |= 3;
+	tf.tf_ds |= 3;
+	tf.tf_es |= 3;
 	// Store the trapframe
-	env->env_tf = *tf;
+	env->env_tf = tf;
 
 	// panic("sys_env_set_trapframe not implemented");
 	return 0;
 }
 
+// Set where register messages to 'envid' are copied, see IPC_WORDS:
+// to the IPC_NWORDS words at 'va', or if 'va' is NULL, nowhere, so
+// that sending 'envid' any fails.  The words arrive before the
+// receive returns; if they cannot be written there, it fails with
+// -E_FAULT.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if the words at va are not all below UTOP.
+static int
+sys_env_set_ipc_words(envid_t envid, void *va)
+{
+	struct Env *e;
+
+	if (envid2env(envid, &e, 1) < 0)
+	{
+		return -E_BAD_ENV;
+	}
+
+	if ((uintptr_t) va > UTOP - IPC_NWORDS * sizeof(uint32_t))
+	{
+		return -E_INVAL;
+	}
+
+	e->env_ipc_wordsva = va;
+
+	return 0;
+}
+
 // Set the page fault upcall for 'envid' by modifying the corresponding struct
 // Env's 'env_pgfault_upcall' field.  When 'envid' causes a page fault, the
 // kernel will push a fault record onto the exception stack, then branch to
@@ -224,11 +487,13 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 //
 // perm -- PTE_U | PTE_P must be set, PTE_AVAIL | PTE_W may or may not be set,
 //         but no other bits may be set.  See PTE_SYSCALL in inc/mmu.h.
+//         PTE_PS may be set too, to allocate a 4MB page instead.
 //
 // Return 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
-//	-E_INVAL if va >= UTOP, or va is not page-aligned.
+//	-E_INVAL if va >= UTOP, or va is not page-aligned
+//		(4MB aligned for a 4MB page).
 //	-E_INVAL if perm is inappropriate (see above).
 //	-E_NO_MEM if there's no memory to allocate the new page,
 //		or to allocate any necessary page tables.
@@ -257,12 +522,26 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	}
 
 	if ((perm & (PTE_U | PTE_P)) != (PTE_U | PTE_P) ||
-		(perm & ~PTE_SYSCALL))
+		(perm & ~(PTE_SYSCALL | PTE_PS)))
 	{
 		return -E_INVAL;
 	}
 
-	if (!(p = page_alloc(ALLOC_ZERO)))
+	if (perm & PTE_PS)
+	{
+		if ((uintptr_t) va & (PTSIZE - 1))
+		{
+			return -E_INVAL;
+		}
+
+		p = page_alloc_order(PAGE_MAX_ORDER, ALLOC_ZERO);
+	}
+	else
+	{
+		p = page_alloc(ALLOC_ZERO);
+	}
+
+	if (!p)
 	{
 		return -E_NO_MEM;
 	}
@@ -277,11 +556,29 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	//panic("sys_page_alloc not implemented");
 }
 
+// Check that the page mapped at 'va' in 'pgdir' may be mapped writable
+// elsewhere.  Pages seen through a page table shared since fork are
+// copy-on-write in effect, whatever their PTEs say, so the table is
+// made private first.
+static int
+page_check_writable(pde_t *pgdir, void *va)
+{
+	pte_t *pte;
+
+	if (!(pte = pgdir_walk(pgdir, va, 1)))
+	{
+		return -E_NO_MEM;
+	}
+
+	return (*pte & PTE_W) ? 0 : -E_INVAL;
+}
+
 // Map the page of memory at 'srcva' in srcenvid's address space
 // at 'dstva' in dstenvid's address space with permission 'perm'.
 // Perm has the same restrictions as in sys_page_alloc, except
 // that it also must not grant write access to a read-only
-// page.
+// page.  A 4MB page can only be mapped as a 4MB page (perm has
+// PTE_PS), with both srcva and dstva 4MB aligned.
 //
 // Return 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if srcenvid and/or dstenvid doesn't currently exist,
@@ -292,6 +589,9 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 //	-E_INVAL if perm is inappropriate (see sys_page_alloc).
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in srcenvid's
 //		address space.
+//	-E_INVAL if srcva is mapped by a 4MB page and perm lacks PTE_PS,
+//		or the other way around, or either address is not 4MB
+//		aligned for a 4MB page.
 //	-E_NO_MEM if there's no memory to allocate any necessary page tables.
 static int
 sys_page_map(envid_t srcenvid, void *srcva,
@@ -308,6 +608,7 @@ sys_page_map(envid_t srcenvid, void *srcva,
 	struct Env *srcenv, *dstenv;
 	struct PageInfo *p;
 	pte_t *pte;
+	int r;
 
 	if (envid2env(srcenvid, &srcenv, 1) < 0 ||
 		envid2env(dstenvid, &dstenv, 1) < 0)
@@ -322,7 +623,7 @@ sys_page_map(envid_t srcenvid, void *srcva,
 	}
 
 	if ((perm & (PTE_U | PTE_P)) != (PTE_U | PTE_P) ||
-		(perm & ~PTE_SYSCALL))
+		(perm & ~(PTE_SYSCALL | PTE_PS)))
 	{
 		return -E_INVAL;
 	}
@@ -332,11 +633,18 @@ sys_page_map(envid_t srcenvid, void *srcva,
 		return -E_INVAL;
 	}
 
-	if (((perm & PTE_W) == PTE_W) && !(*pte & PTE_W))
+	if ((*pte & PTE_PS) != (perm & PTE_PS) || ((perm & PTE_PS) &&
+		(((uintptr_t) srcva | (uintptr_t) dstva) & (PTSIZE - 1))))
 	{
 		return -E_INVAL;
 	}
 
+	if (((perm & PTE_W) == PTE_W) &&
+		(r = page_check_writable(srcenv->env_pgdir, srcva)) < 0)
+	{
+		return r;
+	}
+
 	if (page_insert(dstenv->env_pgdir, p, dstva, perm) < 0)
 	{
 		return -E_NO_MEM;
@@ -353,6 +661,7 @@ sys_page_map(envid_t srcenvid, void *srcva,
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
 //	-E_INVAL if va >= UTOP, or va is not page-aligned.
+//	-E_NO_MEM if the page table, shared since fork, couldn't be copied.
 static int
 sys_page_unmap(envid_t envid, void *va)
 {
@@ -371,125 +680,672 @@ sys_page_unmap(envid_t envid, void *va)
 		return -E_INVAL;
 	}
 
-	page_remove(e->env_pgdir, va);
+	return page_remove(e->env_pgdir, va);
+	//panic("sys_page_unmap not implemented");
+}
+
+// Check that [va, va + len) is a page aligned range below UTOP and
+// round len up to a whole number of pages.
+static int
+check_page_range(void *va, size_t *len)
+{
+	if (PGOFF(va) || *len > UTOP ||
+		(uintptr_t) va > UTOP - ROUNDUP(*len, PGSIZE))
+	{
+		return -E_INVAL;
+	}
+
+	*len = ROUNDUP(*len, PGSIZE);
 
 	return 0;
-	//panic("sys_page_unmap not implemented");
 }
 
-// Try to send 'value' to the target env 'envid'.
-// If srcva < UTOP, then also send page currently mapped at 'srcva',
-// so that receiver gets a duplicate mapping of the same page.
+// The range system calls below work like their single page versions
+// on every page of [va, va + len), len rounded up to whole pages, in
+// one kernel entry.  4MB pages are not handled, except for unmapping.
 //
-// The send fails with a return value of -E_IPC_NOT_RECV if the
-// target is not blocked, waiting for an IPC.
-//
-// The send also can fail for the other reasons listed below.
-//
-// Otherwise, the send succeeds, and the target's ipc fields are
-// updated as follows:
-//    env_ipc_recving is set to 0 to block future sends;
-//    env_ipc_from is set to the sending envid;
-//    env_ipc_value is set to the 'value' parameter;
-//    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise.
-// The target environment is marked runnable again, returning 0
-// from the paused sys_ipc_recv system call.  (Hint: does the
-// sys_ipc_recv function ever actually return?)
-//
-// If the sender wants to send a page but the receiver isn't asking for one,
-// then no page mapping is transferred, but no error occurs.
-// The ipc only happens when no errors occur.
+// All arguments are checked before anything is changed, so only
+// -E_NO_MEM can leave a range half done.  In that case the pages below
+// the one that failed have been dealt with and the rest is untouched.
+
+// Allocate zeroed pages over a range, like sys_page_alloc.
 //
-// Returns 0 on success, < 0 on error.
-// Errors are:
-//	-E_BAD_ENV if environment envid doesn't currently exist.
-//		(No need to check permissions.)
-//	-E_IPC_NOT_RECV if envid is not currently blocked in sys_ipc_recv,
-//		or another environment managed to send first.
-//	-E_INVAL if srcva < UTOP but srcva is not page-aligned.
-//	-E_INVAL if srcva < UTOP and perm is inappropriate
-//		(see sys_page_alloc).
-//	-E_INVAL if srcva < UTOP but srcva is not mapped in the caller's
-//		address space.
-//	-E_INVAL if (perm & PTE_W), but srcva is read-only in the
-//		current environment's address space.
-//	-E_NO_MEM if there's not enough memory to map srcva in envid's
-//		address space.
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va is not page-aligned or the range crosses UTOP.
+//	-E_INVAL if perm is inappropriate (see sys_page_alloc), or has
+//		PTE_PS.
+//	-E_NO_MEM if out of memory.
 static int
-sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+sys_page_alloc_range(envid_t envid, void *va, size_t len, int perm)
 {
-	// LAB 9: Your code here.
 	struct Env *e;
 	struct PageInfo *p;
-	pte_t *pte;
+	size_t off;
 
-	if (envid2env(envid, &e, 0) < 0)
+	if (envid2env(envid, &e, 1) < 0)
 	{
 		return -E_BAD_ENV;
 	}
 
-	if (!e->env_ipc_recving)
+	if (check_page_range(va, &len) < 0 ||
+		(perm & (PTE_U | PTE_P)) != (PTE_U | PTE_P) ||
+		(perm & ~PTE_SYSCALL))
 	{
-		return -E_IPC_NOT_RECV;
+		return -E_INVAL;
 	}
 
-	if (srcva < (void *) UTOP)
+	for (off = 0; off < len; off += PGSIZE)
 	{
-		if (PGOFF(srcva))
-		{
-			return -E_INVAL;
-		}
-
-		if ((perm & (PTE_U | PTE_P)) != (PTE_U | PTE_P) ||
-			(perm & ~PTE_SYSCALL))
-		{
-			return -E_INVAL;
-		}
-
-		if (!(p = page_lookup(curenv->env_pgdir, srcva, &pte)))
-		{
-			return -E_INVAL;
-		}
-
-		if (!(*pte & PTE_W) && (perm & PTE_W) == PTE_W)
+		if (!(p = page_alloc(ALLOC_ZERO)))
 		{
-			return -E_INVAL;
+			return -E_NO_MEM;
 		}
 
-		if (page_insert(e->env_pgdir, p, e->env_ipc_dstva, perm))
+		if (page_insert(e->env_pgdir, p, va + off, perm) < 0)
 		{
+			page_free(p);
 			return -E_NO_MEM;
 		}
-
-		e->env_ipc_perm = perm;
-	}
-	else
-	{
-		e->env_ipc_perm = 0;
 	}
 
-	e->env_ipc_recving = 0;
-	e->env_ipc_from = curenv->env_id;
-	e->env_ipc_value = value;
-	e->env_status = ENV_RUNNABLE;
-
 	return 0;
-	//panic("sys_ipc_try_send not implemented");
 }
 
-// Block until a value is ready.  Record that you want to receive
+// Map the pages of a range in srcenvid's address space at dstva in
+// dstenvid's, like sys_page_map.  perm comes in the low bits of dstva.
+// If perm has PTE_COW and not PTE_W, writable source pages that are
+// not PTE_SHARE become copy-on-write too, so neither side can write
+// to the other's copy.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if srcenvid and/or dstenvid doesn't currently exist,
+//		or the caller doesn't have permission to change one of them.
+//	-E_INVAL if either range is not page-aligned or crosses UTOP,
+//		or the two overlap in the same address space at different
+//		addresses.
+//	-E_INVAL if a source page is not mapped or is a 4MB page.
+//	-E_INVAL if perm is inappropriate (see sys_page_alloc), or has
+//		PTE_PS.
+//	-E_INVAL if (perm & PTE_W), but a source page is read-only.
+//	-E_NO_MEM if there's no memory to allocate any necessary page tables.
+static int
+sys_page_map_range(envid_t srcenvid, void *srcva,
+	envid_t dstenvid, void *dstva, size_t len, int perm)
+{
+	struct Env *srcenv, *dstenv;
+	struct PageInfo *p;
+	pte_t *pte;
+	size_t off, dstlen = len;
+	bool cow, flush = 0;
+	int r = 0;
+
+	if (envid2env(srcenvid, &srcenv, 1) < 0 ||
+		envid2env(dstenvid, &dstenv, 1) < 0)
+	{
+		return -E_BAD_ENV;
+	}
+
+	if (check_page_range(srcva, &len) < 0 ||
+		check_page_range(dstva, &dstlen) < 0)
+	{
+		return -E_INVAL;
+	}
+
+	if (srcenv == dstenv && srcva != dstva &&
+		srcva < dstva + len && dstva < srcva + len)
+	{
+		return -E_INVAL;
+	}
+
+	if ((perm & (PTE_U | PTE_P)) != (PTE_U | PTE_P) ||
+		(perm & ~PTE_SYSCALL))
+	{
+		return -E_INVAL;
+	}
+
+	for (off = 0; off < len; off += PGSIZE)
+	{
+		pte = pgdir_walk(srcenv->env_pgdir, srcva + off, 0);
+		if (!pte || (*pte & (PTE_P | PTE_PS)) != PTE_P)
+		{
+			return -E_INVAL;
+		}
+
+		if ((perm & PTE_W) && (r = page_check_writable(
+			srcenv->env_pgdir, srcva + off)) < 0)
+		{
+			return r;
+		}
+	}
+
+	cow = (perm & (PTE_COW | PTE_W)) == PTE_COW;
+
+	for (off = 0; off < len; off += PGSIZE)
+	{
+		p = page_lookup(srcenv->env_pgdir, srcva + off, &pte);
+
+		if (cow && (*pte & (PTE_W | PTE_SHARE)) == PTE_W)
+		{
+			*pte = (*pte & ~PTE_W) | PTE_COW;
+			flush = 1;
+		}
+
+		if (page_insert(dstenv->env_pgdir, p, dstva + off, perm) < 0)
+		{
+			r = -E_NO_MEM;
+			break;
+		}
+	}
+
+	if (flush)
+	{
+		tlb_flush(srcenv->env_pgdir);
+	}
+
+	return r;
+}
+
+// Unmap all pages in a range, like sys_page_unmap.  Page directory
+// entries that are not present are skipped whole.  A 4MB page is
+// unmapped only if the range covers it.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va is not page-aligned or the range crosses UTOP.
+//	-E_INVAL if the range covers only part of a 4MB page.
+//	-E_NO_MEM if a page table, shared since fork, couldn't be copied.
+static int
+sys_page_unmap_range(envid_t envid, void *va, size_t len)
+{
+	struct Env *e;
+	uintptr_t start, end, cur;
+	pde_t pde;
+	int r;
+
+	if (envid2env(envid, &e, 1) < 0)
+	{
+		return -E_BAD_ENV;
+	}
+
+	if (check_page_range(va, &len) < 0)
+	{
+		return -E_INVAL;
+	}
+
+	start = (uintptr_t) va;
+	end = start + len;
+
+	for (cur = start; cur < end; cur = ROUNDDOWN(cur, PTSIZE) + PTSIZE)
+	{
+		pde = e->env_pgdir[PDX(cur)];
+		if ((pde & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS) &&
+			((cur & (PTSIZE - 1)) || end - cur < PTSIZE))
+		{
+			return -E_INVAL;
+		}
+	}
+
+	for (cur = start; cur < end; cur += PGSIZE)
+	{
+		if (!(e->env_pgdir[PDX(cur)] & PTE_P))
+		{
+			cur = ROUNDDOWN(cur, PTSIZE) + PTSIZE - PGSIZE;
+			continue;
+		}
+
+		if ((r = page_remove(e->env_pgdir, (void *) cur)) < 0)
+		{
+			return r;
+		}
+	}
+
+	return 0;
+}
+
+// Register messages on their way, kept here rather than in struct
+// Env, which every environment can read at UENVS: the words of a call
+// queued on its target, and those received, until env_run() copies
+// them out to the receiver.
+static struct {
+	uint32_t call[IPC_NWORDS];
+	uint32_t recv[IPC_NWORDS];
+} ipc_words[NENV];
+
+// Copy the words of a register message at 'srcva' from curenv.
+// Returns 0 on success, -E_FAULT if curenv cannot read them.
+static int
+ipc_copy_words(uint32_t *words, const void *srcva)
+{
+	if (copy_from_user(words, srcva, IPC_NWORDS * sizeof(*words)) < 0)
+	{
+		return -E_FAULT;
+	}
+
+	return 0;
+}
+
+// Copy the register message 'e' received to its env_ipc_wordsva.
+// Called by env_run() once e's page directory is loaded, so that
+// copy_to_user() reaches e's memory.  If e cannot take the words, its
+// receive fails with -E_FAULT.
+void
+ipc_words_copyout(struct Env *e)
+{
+	e->env_ipc_words_in = 0;
+	if (copy_to_user(e->env_ipc_wordsva, ipc_words[ENVX(e->env_id)].recv,
+			 sizeof(ipc_words[0].recv)) < 0)
+	{
+		e->env_ipc_perm = 0;
+		e->env_tf.tf_regs.reg_eax = -E_FAULT;
+	}
+}
+
+// Check that 'src' can send the page at 'srcva' with 'perm' to 'dst',
+// as sys_ipc_try_send() describes, and store it in *pp, or NULL if
+// srcva >= UTOP or perm is IPC_WORDS.
+//
+// Returns 0 on success, < 0 on error, which is that of
+// sys_ipc_try_send() but -E_BAD_ENV, -E_IPC_NOT_RECV, -E_FAULT and
+// -E_NO_MEM.
+static int
+ipc_page_check(struct Env *src, struct Env *dst, void *srcva,
+	       unsigned perm, struct PageInfo **pp)
+{
+	pte_t *pte;
+	int r;
+
+	*pp = NULL;
+	if (perm & IPC_WORDS)
+	{
+		return perm == IPC_WORDS && dst->env_ipc_wordsva ?
+			0 : -E_INVAL;
+	}
+
+	if (srcva >= (void *) UTOP)
+	{
+		return 0;
+	}
+
+	if (PGOFF(srcva))
+	{
+		return -E_INVAL;
+	}
+
+	if ((perm & (PTE_U | PTE_P)) != (PTE_U | PTE_P) ||
+		(perm & ~PTE_SYSCALL))
+	{
+		return -E_INVAL;
+	}
+
+	if (!(*pp = page_lookup(src->env_pgdir, srcva, &pte)) ||
+		(*pte & PTE_PS))
+	{
+		return -E_INVAL;
+	}
+
+	if ((perm & PTE_W) == PTE_W &&
+		(r = page_check_writable(src->env_pgdir, srcva)) < 0)
+	{
+		return r;
+	}
+
+	return 0;
+}
+
+// Give 'dst', which is receiving, the message 'value' from the
+// environment 'from', with the page 'p' mapped at its env_ipc_dstva
+// with 'perm' if both are there, or with 'words' if perm is IPC_WORDS,
+// for env_run() to copy out.
+//
+// Returns 0 on success, -E_NO_MEM if the page cannot be mapped.
+static int
+ipc_give(envid_t from, struct Env *dst, uint32_t value,
+	 struct PageInfo *p, unsigned perm, const uint32_t *words)
+{
+	if (perm == IPC_WORDS)
+	{
+		memcpy(ipc_words[ENVX(dst->env_id)].recv, words,
+		       sizeof(ipc_words[0].recv));
+		dst->env_ipc_words_in = 1;
+		dst->env_ipc_perm = IPC_WORDS;
+	}
+	else if (p && dst->env_ipc_dstva < (void *) UTOP)
+	{
+		if (page_insert(dst->env_pgdir, p, dst->env_ipc_dstva, perm))
+		{
+			return -E_NO_MEM;
+		}
+
+		dst->env_ipc_perm = perm;
+	}
+	else
+	{
+		dst->env_ipc_perm = 0;
+	}
+
+	dst->env_ipc_recving = 0;
+	dst->env_ipc_from = from;
+	dst->env_ipc_value = value;
+	dst->env_stats.es_ipc_received++;
+
+	return 0;
+}
+
+// Deliver 'value', and the page at 'srcva' with 'perm' if srcva < UTOP,
+// from 'src' to 'dst', which is receiving, as sys_ipc_try_send()
+// describes.  If perm is IPC_WORDS, 'words' is delivered instead of
+// the page, for env_run() to copy out.  Does not wake 'dst' up.
+//
+// Returns 0 on success, < 0 on error, which is that of
+// sys_ipc_try_send() but -E_BAD_ENV and -E_IPC_NOT_RECV.
+static int
+ipc_deliver(struct Env *src, struct Env *dst, uint32_t value, void *srcva,
+	    unsigned perm, const uint32_t *words)
+{
+	struct PageInfo *p;
+	int r;
+
+	if ((r = ipc_page_check(src, dst, srcva, perm, &p)) < 0 ||
+		(r = ipc_give(src->env_id, dst, value, p, perm, words)) < 0)
+	{
+		return r;
+	}
+
+	src->env_stats.es_ipc_sent++;
+	return 0;
+}
+
+// The mailbox.  A message sent with sys_ipc_try_send() to an
+// environment that is not receiving waits in its mailbox, up to
+// IPC_MBOX_MAX of them, with a reference to the page it carries, until
+// the next sys_ipc_recv() takes it.  One sender may have at most
+// IPC_MBOX_PER_SENDER of them there, so that it cannot fill the
+// mailbox for everyone else, and they are dropped when it is freed.
+#define IPC_MBOX_MAX		16
+#define IPC_MBOX_PER_SENDER	4
+
+struct IpcMsg {
+	struct IpcMsg *im_next;
+	struct Env *im_from;
+	uint32_t im_value;
+	struct PageInfo *im_page;	// NULL if none
+	unsigned im_perm;
+	uint32_t im_words[IPC_NWORDS];	// If im_perm is IPC_WORDS
+};
+
+static struct kmem_cache *ipc_msg_cache;
+
+void
+ipc_init(void)
+{
+	if (!(ipc_msg_cache = kmem_cache_create("ipc_msg",
+						sizeof(struct IpcMsg), 0)))
+	{
+		panic("ipc_init: no memory for the mailboxes");
+	}
+}
+
+// Queue the message of sys_ipc_try_send() in the mailbox of 'dst'.
+//
+// Returns 0 on success, < 0 on error, which is that of
+// sys_ipc_try_send(), -E_IPC_NOT_RECV if the mailbox is full or holds
+// IPC_MBOX_PER_SENDER messages from 'src' already.
+static int
+ipc_mbox_put(struct Env *src, struct Env *dst, uint32_t value,
+	     void *srcva, unsigned perm, const uint32_t *words)
+{
+	struct IpcMsg *m;
+	struct PageInfo *p;
+	int n, r;
+
+	if (dst->env_ipc_mbox_len >= IPC_MBOX_MAX)
+	{
+		return -E_IPC_NOT_RECV;
+	}
+
+	n = 0;
+	for (m = dst->env_ipc_mbox; m && src->env_ipc_mbox_sent; m = m->im_next)
+	{
+		if (m->im_from == src && ++n >= IPC_MBOX_PER_SENDER)
+		{
+			return -E_IPC_NOT_RECV;
+		}
+	}
+
+	if ((r = ipc_page_check(src, dst, srcva, perm, &p)) < 0)
+	{
+		return r;
+	}
+
+	if (!(m = kmem_cache_alloc(ipc_msg_cache, 0)))
+	{
+		return -E_IPC_NOT_RECV;
+	}
+
+	m->im_next = NULL;
+	m->im_from = src;
+	m->im_value = value;
+	m->im_page = p;
+	m->im_perm = perm;
+	if (p)
+	{
+		p->pp_ref++;
+	}
+	if (perm == IPC_WORDS)
+	{
+		memcpy(m->im_words, words, sizeof(m->im_words));
+	}
+
+	*dst->env_ipc_mbox_tail = m;
+	dst->env_ipc_mbox_tail = &m->im_next;
+	dst->env_ipc_mbox_len++;
+	src->env_ipc_mbox_sent++;
+	src->env_stats.es_ipc_sent++;
+
+	return 0;
+}
+
+// Unlink the message at '*mp' from the mailbox of 'e' and free it,
+// giving it to 'e' if 'give'.  A page that cannot be mapped for lack
+// of memory is dropped.
+static void
+ipc_mbox_remove(struct Env *e, struct IpcMsg **mp, bool give)
+{
+	struct IpcMsg *m = *mp;
+
+	if (!(*mp = m->im_next))
+	{
+		e->env_ipc_mbox_tail = mp;
+	}
+	e->env_ipc_mbox_len--;
+	m->im_from->env_ipc_mbox_sent--;
+
+	if (give && ipc_give(m->im_from->env_id, e, m->im_value, m->im_page,
+			     m->im_perm, m->im_words) < 0)
+	{
+		ipc_give(m->im_from->env_id, e, m->im_value, NULL, 0, NULL);
+	}
+
+	if (m->im_page)
+	{
+		page_decref(m->im_page);
+	}
+	kmem_cache_free(ipc_msg_cache, m);
+}
+
+// Free the messages left in the mailbox of 'e', which is being freed,
+// and those it sent that still wait in other mailboxes.
+void
+ipc_mbox_flush(struct Env *e)
+{
+	struct IpcMsg **mp;
+	struct Env *dst;
+
+	while (e->env_ipc_mbox)
+	{
+		ipc_mbox_remove(e, &e->env_ipc_mbox, 0);
+	}
+
+	for (dst = envs; e->env_ipc_mbox_sent && dst < envs + NENV; dst++)
+	{
+		mp = &dst->env_ipc_mbox;
+		while (*mp)
+		{
+			if ((*mp)->im_from == e)
+			{
+				ipc_mbox_remove(dst, mp, 0);
+			}
+			else
+			{
+				mp = &(*mp)->im_next;
+			}
+		}
+	}
+}
+
+// Make curenv receive, at 'dstva', the oldest message in its mailbox,
+// or else the request of the environment that has waited longest in
+// sys_ipc_call() for it, if any.  The caller goes on waiting, for the
+// reply.  Callers whose request cannot be delivered get the error
+// instead.
+//
+// Returns 1 if a message was received, 0 if none is waiting.
+static int
+ipc_recv_pending(void *dstva)
+{
+	struct Env *e;
+	int r;
+
+	if (curenv->env_ipc_mbox)
+	{
+		curenv->env_ipc_dstva = dstva;
+		ipc_mbox_remove(curenv, &curenv->env_ipc_mbox, 1);
+		return 1;
+	}
+
+	while ((e = sched_wait_dequeue(&curenv->env_ipc_callers)))
+	{
+		curenv->env_ipc_recving = 1;
+		curenv->env_ipc_dstva = dstva;
+		if ((r = ipc_deliver(e, curenv, e->env_ipc_call_value,
+				     e->env_ipc_call_srcva,
+				     e->env_ipc_call_perm,
+				     ipc_words[ENVX(e->env_id)].call)) == 0)
+		{
+			e->env_ipc_recving = 1;
+			return 1;
+		}
+
+		curenv->env_ipc_recving = 0;
+		e->env_tf.tf_regs.reg_eax = r;
+		sched_set_status(e, ENV_RUNNABLE);
+	}
+
+	return 0;
+}
+
+// Try to send 'value' to the target env 'envid'.
+// If srcva < UTOP, then also send page currently mapped at 'srcva',
+// so that receiver gets a duplicate mapping of the same page.
+//
+// If the target is not blocked, waiting for an IPC, the message waits
+// in its mailbox for the next sys_ipc_recv(), see ipc_mbox_put().  The
+// send fails with a return value of -E_IPC_NOT_RECV if the mailbox is
+// full, or already holds IPC_MBOX_PER_SENDER messages from the caller.
+//
+// The send also can fail for the other reasons listed below.
+//
+// Otherwise, the send succeeds, and the target's ipc fields are
+// updated as follows:
+//    env_ipc_recving is set to 0 to block future sends;
+//    env_ipc_from is set to the sending envid;
+//    env_ipc_value is set to the 'value' parameter;
+//    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise.
+// The target environment is marked runnable again, returning 0
+// from the paused sys_ipc_recv system call.  (Hint: does the
+// sys_ipc_recv function ever actually return?)
+//
+// If the sender wants to send a page but the receiver isn't asking for one,
+// then no page mapping is transferred, but no error occurs.
+// The ipc only happens when no errors occur.
+//
+// If perm is IPC_WORDS, the IPC_NWORDS words at 'srcva' are copied to
+// the target's env_ipc_wordsva instead, see sys_env_set_ipc_words(),
+// and env_ipc_perm is IPC_WORDS.
+//
+// Returns 0 on success, < 0 on error.
+// Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist.
+//		(No need to check permissions.)
+//	-E_IPC_NOT_RECV if envid is not currently blocked in sys_ipc_recv
+//		and its mailbox is full, or has too many of ours.
+//	-E_INVAL if perm has IPC_WORDS and other bits, or the target has
+//		no env_ipc_wordsva.
+//	-E_FAULT if perm has IPC_WORDS, but the caller cannot read the
+//		words at srcva.
+//	-E_INVAL if srcva < UTOP but srcva is not page-aligned.
+//	-E_INVAL if srcva < UTOP and perm is inappropriate
+//		(see sys_page_alloc).
+//	-E_INVAL if srcva < UTOP but srcva is not mapped in the caller's
+//		address space, or is mapped by a 4MB page.
+//	-E_INVAL if (perm & PTE_W), but srcva is read-only in the
+//		current environment's address space.
+//	-E_NO_MEM if there's not enough memory to map srcva in envid's
+//		address space.
+static int
+sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+{
+	// LAB 9: Your code here.
+	uint32_t words[IPC_NWORDS];
+	struct Env *e;
+	int r;
+
+	if (envid2env(envid, &e, 0) < 0)
+	{
+		return -E_BAD_ENV;
+	}
+
+	if ((perm & IPC_WORDS) && (r = ipc_copy_words(words, srcva)) < 0)
+	{
+		return r;
+	}
+
+	if (!e->env_ipc_recving)
+	{
+		return ipc_mbox_put(curenv, e, value, srcva, perm, words);
+	}
+
+	if ((r = ipc_deliver(curenv, e, value, srcva, perm, words)) < 0)
+	{
+		return r;
+	}
+
+	sched_set_status(e, ENV_RUNNABLE);
+	return 0;
+	//panic("sys_ipc_try_send not implemented");
+}
+
+// Block until a value is ready.  Record that you want to receive
 // using the env_ipc_recving and env_ipc_dstva fields of struct Env,
 // mark yourself not runnable, and then give up the CPU.
 //
 // If 'dstva' is < UTOP, then you are willing to receive a page of data.
 // 'dstva' is the virtual address at which the sent page should be mapped.
 //
+// If 'deadline' is not 0, give up waiting when the TSC reaches it.
+// A message in the mailbox, or a request of sys_ipc_call() waiting
+// for us, is received right away.
+//
 // This function only returns on error, but the system call will eventually
 // return 0 on success.
 // Return < 0 on error.  Errors are:
 //	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_TIMEOUT if the deadline passes before a value is sent.
 static int
-sys_ipc_recv(void *dstva)
+sys_ipc_recv(void *dstva, uint64_t deadline)
 {
 	// LAB 9: Your code here.
 	if (dstva < (void *) UTOP && PGOFF(dstva))
@@ -497,16 +1353,384 @@ sys_ipc_recv(void *dstva)
 		return -E_INVAL;
 	}
 
+	if (ipc_recv_pending(dstva))
+	{
+		return 0;
+	}
+
+	if (deadline && deadline <= read_tsc())
+	{
+		return -E_TIMEOUT;
+	}
+
 	curenv->env_ipc_recving = 1;
 	curenv->env_ipc_dstva = dstva;
 	// By doing this we give up the CPU implicitly,
 	// so there is no need to call sched_yield().
-	curenv->env_status = ENV_NOT_RUNNABLE;
+	sched_set_status(curenv, ENV_NOT_RUNNABLE);
+	if (deadline)
+	{
+		timer_add(curenv, deadline);
+	}
 
 	//panic("sys_ipc_recv not implemented");
 	return 0;
 }
 
+// Send 'value', and the page at 'srcva' with 'perm' if srcva < UTOP,
+// to 'envid' as sys_ipc_try_send() does, and wait for the reply as
+// sys_ipc_recv() does, with the page of the reply mapped at 'dstva'.
+// If 'envid' is receiving, this switches to it at once, without a
+// pass of the scheduler.  Otherwise the call waits in the kernel until
+// 'envid' receives, callers being served in the order they came.
+//
+// This function only returns on error, but the system call will
+// eventually return 0 once the reply is in.
+// Returns < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist, or
+//		exits before receiving the request.
+//	-E_INVAL if envid is the caller itself.
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	Those of sys_ipc_try_send() for the page, which a waiting
+//		call may only get when it is received.
+static int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+	     void *dstva)
+{
+	uint32_t words[IPC_NWORDS];
+	struct Env *e;
+	int r;
+
+	if (dstva < (void *) UTOP && PGOFF(dstva))
+	{
+		return -E_INVAL;
+	}
+
+	if (envid2env(envid, &e, 0) < 0)
+	{
+		return -E_BAD_ENV;
+	}
+
+	if (e == curenv)
+	{
+		return -E_INVAL;
+	}
+
+	if ((perm & IPC_WORDS) && (r = ipc_copy_words(words, srcva)) < 0)
+	{
+		return r;
+	}
+
+	curenv->env_ipc_dstva = dstva;
+	if (!e->env_ipc_recving)
+	{
+		curenv->env_ipc_call_value = value;
+		curenv->env_ipc_call_srcva = srcva;
+		curenv->env_ipc_call_perm = perm;
+		if (perm & IPC_WORDS)
+		{
+			memcpy(ipc_words[ENVX(curenv->env_id)].call, words,
+			       sizeof(words));
+		}
+		sched_wait(&e->env_ipc_callers, curenv);
+		return 0;
+	}
+
+	if ((r = ipc_deliver(curenv, e, value, srcva, perm, words)) < 0)
+	{
+		return r;
+	}
+
+	curenv->env_ipc_recving = 1;
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	sched_set_status(curenv, ENV_NOT_RUNNABLE);
+	sched_set_status(e, ENV_RUNNABLE);
+	sched_handoff(e);
+}
+
+// Reply 'value', and the page at 'srcva' with 'perm' if srcva < UTOP,
+// to 'envid', which waits in sys_ipc_call() or sys_ipc_recv(), then
+// receive the next request as sys_ipc_recv() does.  If no request is
+// waiting, this switches to 'envid' at once.  A reply to an
+// environment that is gone is dropped; one whose page cannot be
+// delivered makes its call fail with the error.  One to an
+// environment that is not receiving yet, say because it sent with
+// sys_ipc_try_send(), goes to its mailbox.
+//
+// This function only returns on error, but the system call will
+// eventually return 0 once a request is in.
+// Returns < 0 on error, with nothing done.  Errors are:
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	Those of sys_ipc_try_send() if the reply goes to the mailbox
+//		and cannot.
+static int
+sys_ipc_reply_wait(envid_t envid, uint32_t value, void *srcva,
+		   unsigned perm, void *dstva)
+{
+	uint32_t words[IPC_NWORDS];
+	struct Env *e;
+	int r;
+
+	if (dstva < (void *) UTOP && PGOFF(dstva))
+	{
+		return -E_INVAL;
+	}
+
+	if ((perm & IPC_WORDS) && (r = ipc_copy_words(words, srcva)) < 0)
+	{
+		return r;
+	}
+
+	if (envid2env(envid, &e, 0) < 0)
+	{
+		e = NULL;
+	}
+	else if (!e->env_ipc_recving)
+	{
+		if ((r = ipc_mbox_put(curenv, e, value, srcva, perm,
+				      words)) < 0)
+		{
+			return r;
+		}
+		e = NULL;
+	}
+	else
+	{
+		if ((r = ipc_deliver(curenv, e, value, srcva, perm,
+				     words)) < 0)
+		{
+			e->env_ipc_recving = 0;
+			e->env_tf.tf_regs.reg_eax = r;
+		}
+		sched_set_status(e, ENV_RUNNABLE);
+	}
+
+	if (ipc_recv_pending(dstva))
+	{
+		return 0;
+	}
+
+	curenv->env_ipc_recving = 1;
+	curenv->env_ipc_dstva = dstva;
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	sched_set_status(curenv, ENV_NOT_RUNNABLE);
+	if (e)
+	{
+		sched_handoff(e);
+	}
+
+	return 0;
+}
+
+// Set the notification bits 'bits' of 'envid', waking it up if it
+// waits for any of them in sys_wait_notify().  Bits already pending
+// are not counted twice, so many notifications before the target gets
+// to run cost it one wakeup.  Never blocks.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist.
+//		(No need to check permissions.)
+//	-E_INVAL if bits is 0 or not within NOTIFY_ALL.
+static int
+sys_notify(envid_t envid, uint32_t bits)
+{
+	struct Env *e;
+	uint32_t got;
+
+	if (!bits || (bits & ~NOTIFY_ALL))
+	{
+		return -E_INVAL;
+	}
+
+	if (envid2env(envid, &e, 0) < 0)
+	{
+		return -E_BAD_ENV;
+	}
+
+	e->env_notify_pending |= bits;
+	if (e->env_notify_waiters && (got = e->env_notify_pending &
+					e->env_notify_mask))
+	{
+		e->env_notify_pending &= ~got;
+		sched_wake_all(&e->env_notify_waiters, got);
+	}
+
+	return 0;
+}
+
+// Block until any of the notification bits in 'mask' is set by
+// sys_notify(), unless one is already, and take them.
+//
+// Returns the bits of 'mask' taken, < 0 on error.  Errors are:
+//	-E_INVAL if mask is 0 or not within NOTIFY_ALL.
+static int
+sys_wait_notify(uint32_t mask)
+{
+	uint32_t got;
+
+	if (!mask || (mask & ~NOTIFY_ALL))
+	{
+		return -E_INVAL;
+	}
+
+	if ((got = curenv->env_notify_pending & mask))
+	{
+		curenv->env_notify_pending &= ~got;
+		return got;
+	}
+
+	curenv->env_notify_mask = mask;
+	sched_wait(&curenv->env_notify_waiters, curenv);
+	return 0;
+}
+
+// Environments blocked in sys_futex_wait(), in wait queues hashed by
+// the physical address of the word they wait on, so that envs sharing
+// the page find each other whatever address they map it at.
+#define FUTEX_HASH_SIZE	64
+
+static struct Env *futex_queues[FUTEX_HASH_SIZE];
+
+static struct Env **
+futex_queue(physaddr_t pa)
+{
+	return &futex_queues[(pa >> 2) % FUTEX_HASH_SIZE];
+}
+
+// Find the physical address of the word at user address 'addr' of
+// the current environment.
+//
+// Returns 0 on success, -E_INVAL if addr is not 4-byte aligned, is
+// above UTOP or is not mapped in the caller's address space.
+static int
+futex_lookup(uint32_t *addr, physaddr_t *pa_store)
+{
+	pte_t *pte;
+
+	if ((uintptr_t) addr & 3 || (uintptr_t) addr >= UTOP)
+	{
+		return -E_INVAL;
+	}
+
+	if (!page_lookup(curenv->env_pgdir, addr, &pte) || !(*pte & PTE_U))
+	{
+		return -E_INVAL;
+	}
+
+	*pa_store = PTE_ADDR(*pte) | ((uintptr_t) addr &
+		((*pte & PTE_PS) ? PTSIZE - 1 : PGSIZE - 1));
+	return 0;
+}
+
+// Block until sys_futex_wake() is called on 'addr', unless the word
+// there is not 'expected'.  The check and the blocking are atomic with
+// respect to sys_futex_wake(), so a wakeup between the caller reading
+// the word and blocking is not lost.  The futex is the physical word,
+// so envs must share the page, PTE_SHARE or sfork(): after a
+// copy-on-write fault the two envs have different words.  If
+// 'deadline' is not 0, waits no longer than until the TSC reaches it.
+//
+// Callers must check the word again on return, as it may change again
+// before they run.
+//
+// Returns 0 when woken up, or at once if the word is not 'expected',
+// < 0 on error.  Errors are:
+//	-E_INVAL if addr is not 4-byte aligned, is above UTOP or is not
+//		mapped in the caller's address space.
+//	-E_TIMEOUT if the deadline passed.
+static int
+sys_futex_wait(uint32_t *addr, uint32_t expected, uint64_t deadline)
+{
+	physaddr_t pa;
+	int r;
+
+	if ((r = futex_lookup(addr, &pa)) < 0)
+	{
+		return r;
+	}
+
+	if (*(uint32_t *) KADDR(pa) != expected)
+	{
+		return 0;
+	}
+
+	if (deadline && deadline <= read_tsc())
+	{
+		return -E_TIMEOUT;
+	}
+
+	curenv->env_futex_addr = pa;
+	sched_wait(futex_queue(pa), curenv);
+	if (deadline)
+	{
+		// A timed out wait keeps this return value, sys_futex_wake()
+		// sets 0.
+		timer_add(curenv, deadline);
+		return -E_TIMEOUT;
+	}
+
+	return 0;
+}
+
+// Wake up to 'n' environments blocked in sys_futex_wait() on 'addr',
+// those that have waited longest first.
+//
+// Returns the number of environments woken up, < 0 on error, which is
+// that of sys_futex_wait() but -E_TIMEOUT.
+static int
+sys_futex_wake(uint32_t *addr, unsigned n)
+{
+	struct Env **wq, *e, *oldest;
+	physaddr_t pa;
+	int r, woken;
+
+	if ((r = futex_lookup(addr, &pa)) < 0)
+	{
+		return r;
+	}
+
+	wq = futex_queue(pa);
+	for (woken = 0; woken < n; woken++)
+	{
+		// The queue is newest first.
+		oldest = NULL;
+		for (e = *wq; e; e = e->env_wq_next)
+		{
+			if (e->env_futex_addr == pa)
+			{
+				oldest = e;
+			}
+		}
+
+		if (!oldest)
+		{
+			break;
+		}
+
+		// Runnable, it leaves the queue and loses its timeout.
+		oldest->env_tf.tf_regs.reg_eax = 0;
+		sched_set_status(oldest, ENV_RUNNABLE);
+	}
+
+	return woken;
+}
+
+// Block until the TSC reaches 'deadline'.  vsys[VSYS_tsc_khz] tells
+// the TSC frequency.  Returns 0.
+static int
+sys_sleep_until(uint64_t deadline)
+{
+	if (deadline <= read_tsc())
+	{
+		return 0;
+	}
+
+	sched_set_status(curenv, ENV_NOT_RUNNABLE);
+	timer_add(curenv, deadline);
+
+	return 0;
+}
+
 // Return date and time in UNIX timestamp format: seconds passed
 // from 1970-01-01 00:00:00 UTC.
 static int
@@ -524,22 +1748,23 @@ sys_gettime(void)
 static int
 sys_chdir(const char *dir, size_t len)
 {
-	size_t i;
+	char buf[BUFSIZE];
 
 	if (len >= BUFSIZE)
 	{
 		return -E_INVAL;
 	}
 
-	// Check whether we can read 'len' bytes from 'dir'
-	user_mem_assert(curenv, (const void *) dir, len, PTE_U);
-
-	// Change the directory
-	for (i = 0; i < len; i++)
+	// Read 'len' bytes from 'dir', without touching the old
+	// directory if that fails.
+	if (copy_from_user(buf, dir, len) < 0)
 	{
-		cwd[i] = dir[i];
+		user_mem_fault(curenv);
 	}
 
+	// Change the directory
+	memcpy(cwd, buf, len);
+
 	// Set the new cwd length.
 	cwd_len = len;
 
@@ -552,15 +1777,10 @@ sys_chdir(const char *dir, size_t len)
 static int
 sys_getcwd(char *dir)
 {
-	size_t i;
-
-	// Check whether we can write 'cwd_len' bytes into 'dir'
-	user_mem_assert(curenv, (const void *) dir, cwd_len, PTE_U | PTE_W);
-
 	// Write the directory into the buffer
-	for (i = 0; i < cwd_len; i++)
+	if (copy_to_user(dir, cwd, cwd_len) < 0)
 	{
-		dir[i] = cwd[i];
+		user_mem_fault(curenv);
 	}
 
 	return 0;
@@ -577,13 +1797,53 @@ sys_set_logatt(unsigned attempts)
 static void
 sys_get_logatt(unsigned *attempts)
 {
-	// Check whether we can write an unsigned int into 'attempts'
-	user_mem_assert(curenv, (const void *) attempts, sizeof(unsigned),
-		PTE_U | PTE_W);
-
-	*attempts = login_attempts;
+	if (copy_to_user(attempts, &login_attempts, sizeof(unsigned)) < 0)
+	{
+		user_mem_fault(curenv);
+	}
 }
 
+// The class each system call is counted under in env_stats.
+static const uint8_t syscall_class[NSYSCALLS] = {
+	[SYS_cputs]			= SYSCALL_CLASS_IO,
+	[SYS_cgetc]			= SYSCALL_CLASS_IO,
+	[SYS_getenvid]			= SYSCALL_CLASS_ENV,
+	[SYS_env_destroy]		= SYSCALL_CLASS_ENV,
+	[SYS_page_alloc]		= SYSCALL_CLASS_MEM,
+	[SYS_page_map]			= SYSCALL_CLASS_MEM,
+	[SYS_page_unmap]		= SYSCALL_CLASS_MEM,
+	[SYS_page_alloc_range]		= SYSCALL_CLASS_MEM,
+	[SYS_page_map_range]		= SYSCALL_CLASS_MEM,
+	[SYS_page_unmap_range]		= SYSCALL_CLASS_MEM,
+	[SYS_exofork]			= SYSCALL_CLASS_ENV,
+	[SYS_env_set_status]		= SYSCALL_CLASS_ENV,
+	[SYS_env_set_trapframe]		= SYSCALL_CLASS_ENV,
+	[SYS_env_set_pgfault_upcall]	= SYSCALL_CLASS_MEM,
+	[SYS_yield]			= SYSCALL_CLASS_ENV,
+	[SYS_ipc_try_send]		= SYSCALL_CLASS_IPC,
+	[SYS_ipc_recv]			= SYSCALL_CLASS_IPC,
+	[SYS_gettime]			= SYSCALL_CLASS_TIME,
+	[SYS_chdir]			= SYSCALL_CLASS_IO,
+	[SYS_getcwd]			= SYSCALL_CLASS_IO,
+	[SYS_set_logatt]		= SYSCALL_CLASS_IO,
+	[SYS_get_logatt]		= SYSCALL_CLASS_IO,
+	[SYS_fork]			= SYSCALL_CLASS_ENV,
+	[SYS_sfork]			= SYSCALL_CLASS_ENV,
+	[SYS_thread_create]		= SYSCALL_CLASS_ENV,
+	[SYS_env_set_priority]		= SYSCALL_CLASS_ENV,
+	[SYS_env_set_deadline]		= SYSCALL_CLASS_ENV,
+	[SYS_sleep_until]		= SYSCALL_CLASS_TIME,
+	[SYS_env_wait]			= SYSCALL_CLASS_ENV,
+	[SYS_env_set_cpu]		= SYSCALL_CLASS_ENV,
+	[SYS_ipc_call]			= SYSCALL_CLASS_IPC,
+	[SYS_ipc_reply_wait]		= SYSCALL_CLASS_IPC,
+	[SYS_env_set_ipc_words]		= SYSCALL_CLASS_IPC,
+	[SYS_notify]			= SYSCALL_CLASS_IPC,
+	[SYS_wait_notify]		= SYSCALL_CLASS_IPC,
+	[SYS_futex_wait]		= SYSCALL_CLASS_IPC,
+	[SYS_futex_wake]		= SYSCALL_CLASS_IPC,
+};
+
 // Dispatches to the correct kernel function, passing the arguments.
 int32_t
 syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
@@ -591,10 +1851,17 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	// Call the function corresponding to the 'syscallno' parameter.
 	// Return any appropriate return value.
 	// LAB 8: Your code here.
+	if (syscallno < NSYSCALLS)
+	{
+		curenv->env_stats.es_syscalls[syscall_class[syscallno]]++;
+	}
+
 	switch (syscallno)
 	{
 		case SYS_env_destroy:
-			return sys_env_destroy(a1);
+			return sys_env_destroy(a1, (int) a2);
+		case SYS_env_wait:
+			return sys_env_wait((envid_t) a1);
 		case SYS_cputs:
 			sys_cputs((const char *) a1, (size_t) a2);
 			return 0;
@@ -614,6 +1881,16 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 				(envid_t) a3, (void *) a4, (int) a5);
 		case SYS_page_unmap:
 			return sys_page_unmap((envid_t) a1, (void *) a2);
+		case SYS_page_alloc_range:
+			return sys_page_alloc_range((envid_t) a1, (void *) a2,
+				(size_t) a3, (int) a4);
+		case SYS_page_map_range:
+			return sys_page_map_range((envid_t) a1, (void *) a2,
+				(envid_t) a3, (void *) ROUNDDOWN(a4, PGSIZE),
+				(size_t) a5, (int) PGOFF(a4));
+		case SYS_page_unmap_range:
+			return sys_page_unmap_range((envid_t) a1, (void *) a2,
+				(size_t) a3);
 		case SYS_env_set_pgfault_upcall:
 			return sys_env_set_pgfault_upcall((envid_t) a1,
 				(void *) a2);
@@ -621,10 +1898,29 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 			sys_yield();
 			return 0;
 		case SYS_ipc_recv:
-			return sys_ipc_recv((void *) a1);
+			return sys_ipc_recv((void *) a1,
+				((uint64_t) a3 << 32) | a2);
 		case SYS_ipc_try_send:
 			return sys_ipc_try_send((envid_t) a1, (uint32_t) a2,
 				(void *) a3, (unsigned int) a4);
+		case SYS_ipc_call:
+			return sys_ipc_call((envid_t) a1, (uint32_t) a2,
+				(void *) a3, (unsigned int) a4, (void *) a5);
+		case SYS_ipc_reply_wait:
+			return sys_ipc_reply_wait((envid_t) a1, (uint32_t) a2,
+				(void *) a3, (unsigned int) a4, (void *) a5);
+		case SYS_env_set_ipc_words:
+			return sys_env_set_ipc_words((envid_t) a1,
+				(void *) a2);
+		case SYS_notify:
+			return sys_notify((envid_t) a1, (uint32_t) a2);
+		case SYS_wait_notify:
+			return sys_wait_notify((uint32_t) a1);
+		case SYS_futex_wait:
+			return sys_futex_wait((uint32_t *) a1, (uint32_t) a2,
+				((uint64_t) a4 << 32) | a3);
+		case SYS_futex_wake:
+			return sys_futex_wake((uint32_t *) a1, (unsigned) a2);
 		case SYS_env_set_trapframe:
 			return sys_env_set_trapframe((envid_t) a1,
 				(struct Trapframe *) a2);
@@ -640,6 +1936,21 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		case SYS_get_logatt:
 			sys_get_logatt((unsigned *) a1);
 			return 0;
+		case SYS_fork:
+			return sys_fork(0);
+		case SYS_sfork:
+			return sys_fork(1);
+		case SYS_thread_create:
+			return sys_thread_create(a1, a2, a3);
+		case SYS_env_set_priority:
+			return sys_env_set_priority((envid_t) a1, (int) a2);
+		case SYS_sleep_until:
+			return sys_sleep_until(((uint64_t) a2 << 32) | a1);
+		case SYS_env_set_deadline:
+			return sys_env_set_deadline((envid_t) a1,
+				(unsigned) a2, (unsigned) a3);
+		case SYS_env_set_cpu:
+			return sys_env_set_cpu((envid_t) a1, (int) a2);
 		default:
 			return -E_INVAL;
 	}
@@ -6,6 +6,11 @@
 
 #include <inc/syscall.h>
 
+struct Env;
+
 int32_t syscall(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5);
+void ipc_init(void);
+void ipc_words_copyout(struct Env *e);
+void ipc_mbox_flush(struct Env *e);
 
 #endif /* !JOS_KERN_SYSCALL_H */
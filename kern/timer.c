@@ -0,0 +1,166 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/x86.h>
+#include <inc/error.h>
+#include <inc/assert.h>
+
+#include <kern/env.h>
+#include <kern/sched.h>
+#include <kern/timer.h>
+#include <kern/tsc.h>
+
+// Timeouts of environments blocked in sys_sleep_until() or
+// sys_ipc_recv(), kept in a hierarchical timer wheel with a tick of
+// one millisecond.  Level 0 has a slot for each of the next
+// WHEEL_SIZE ticks, and each slot of level n covers WHEEL_SIZE slots
+// of level n - 1.  timer_run() steps through the ticks, firing the
+// slots of level 0, and moves the timers of a higher level slot down
+// when level 0 gets to its range.  A timeout is added or cancelled in
+// constant time, whatever the number of timers.
+#define WHEEL_BITS	6
+#define WHEEL_SIZE	(1 << WHEEL_BITS)
+#define WHEEL_MASK	(WHEEL_SIZE - 1)
+#define WHEEL_LEVELS	4
+#define WHEEL_SPAN	(1ull << (WHEEL_BITS * WHEEL_LEVELS))
+
+static struct Env *wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static uint64_t wheel_now;	// The next tick to process
+static unsigned wheel_count;	// Timers pending
+
+// The earliest timeout pending in ticks, if wheel_next_valid.
+static uint64_t wheel_next;
+static bool wheel_next_valid;
+
+static void
+wheel_link(struct Env *e)
+{
+	uint64_t expires = MAX(e->env_timeout, wheel_now);
+	uint64_t delta = expires - wheel_now;
+	struct Env **slot;
+	unsigned level;
+
+	// Timeouts past the top level's range wait in its last slot
+	// and are filed again when it comes up.
+	if (delta >= WHEEL_SPAN)
+		expires = wheel_now + (delta = WHEEL_SPAN - 1);
+	for (level = 0; delta >= (1ull << (WHEEL_BITS * (level + 1))); level++)
+		;
+
+	slot = &wheel[level][(expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+	if ((e->env_timer_next = *slot))
+		(*slot)->env_timer_pprev = &e->env_timer_next;
+	e->env_timer_pprev = slot;
+	*slot = e;
+}
+
+static void
+wheel_unlink(struct Env *e)
+{
+	if (e->env_timer_next)
+		e->env_timer_next->env_timer_pprev = e->env_timer_pprev;
+	*e->env_timer_pprev = e->env_timer_next;
+	e->env_timer_next = NULL;
+	e->env_timer_pprev = NULL;
+}
+
+// Wake up 'e' at TSC value 'deadline' or soon after, unless it
+// becomes runnable before.  'e' must be blocked by then.
+void
+timer_add(struct Env *e, uint64_t deadline)
+{
+	assert(!e->env_timer_pprev);
+
+	// Round up, so that the timer never fires early, without
+	// overflowing for deadlines as far as ~0.
+	e->env_timeout = deadline / cpu_freq + !!(deadline % cpu_freq);
+	if (!wheel_count++)
+		wheel_now = read_tsc() / cpu_freq;
+	wheel_link(e);
+
+	if (wheel_next_valid && e->env_timeout < wheel_next)
+		wheel_next = e->env_timeout;
+}
+
+// Cancel the timeout of 'e', if it has one.
+void
+timer_cancel(struct Env *e)
+{
+	if (!e->env_timer_pprev)
+		return;
+
+	wheel_unlink(e);
+	wheel_count--;
+	if (e->env_timeout == wheel_next)
+		wheel_next_valid = 0;
+}
+
+// The timeout of 'e' passed.  A timed out sys_ipc_recv() returns
+// -E_TIMEOUT, sys_sleep_until() returns 0, which it already set.
+static void
+timer_fire(struct Env *e)
+{
+	timer_cancel(e);
+	if (e->env_ipc_recving) {
+		e->env_ipc_recving = 0;
+		e->env_tf.tf_regs.reg_eax = -E_TIMEOUT;
+	}
+	sched_set_status(e, ENV_RUNNABLE);
+}
+
+// Fire the timers that are due.
+void
+timer_run(void)
+{
+	uint64_t now = read_tsc() / cpu_freq;
+	unsigned level, i;
+	struct Env *e;
+
+	while (wheel_count && wheel_now <= now) {
+		// Move the timers of the higher level slots that start
+		// at this tick down.
+		for (level = 1; level < WHEEL_LEVELS &&
+		     !(wheel_now & ((1ull << (WHEEL_BITS * level)) - 1)); level++) {
+			i = (wheel_now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+			while ((e = wheel[level][i])) {
+				wheel_unlink(e);
+				wheel_link(e);
+			}
+		}
+
+		while ((e = wheel[0][wheel_now & WHEEL_MASK]))
+			timer_fire(e);
+		wheel_now++;
+	}
+}
+
+// Return the TSC value at which the earliest timer is due, or 0 if
+// there is none.  One too far away to count in TSC cycles is ~0.
+uint64_t
+timer_next(void)
+{
+	unsigned level, i, slot;
+	struct Env *e;
+
+	if (!wheel_count)
+		return 0;
+
+	if (!wheel_next_valid) {
+		// At each level, the first slot in use holds the earliest
+		// timeouts of the level.  Above level 0, the current slot
+		// comes last: its timers were filed a whole turn ahead.
+		wheel_next = ~0ull;
+		for (level = 0; level < WHEEL_LEVELS; level++) {
+			slot = wheel_now >> (WHEEL_BITS * level);
+			for (i = !!level; i <= WHEEL_SIZE; i++)
+				if ((e = wheel[level][(slot + i) & WHEEL_MASK]))
+					break;
+			for (; e; e = e->env_timer_next)
+				wheel_next = MIN(wheel_next, e->env_timeout);
+		}
+		wheel_next_valid = 1;
+	}
+
+	if (wheel_next > ~0ull / cpu_freq)
+		return ~0ull;
+	return wheel_next * cpu_freq;
+}
@@ -0,0 +1,18 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_TIMER_H
+#define JOS_KERN_TIMER_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct Env;
+
+void timer_add(struct Env *e, uint64_t deadline);
+void timer_cancel(struct Env *e);
+void timer_run(void);
+uint64_t timer_next(void);
+
+#endif	// !JOS_KERN_TIMER_H
@@ -12,14 +12,15 @@
 #include <kern/syscall.h>
 #include <kern/sched.h>
 #include <kern/kclock.h>
+#include <kern/clockev.h>
 #include <kern/picirq.h>
 #include <kern/cpu.h>
+#include <kern/spinlock.h>
 
 #ifndef debug
 # define debug 0
 #endif
 
-static struct Taskstate ts;
 
 /* For debugging, so print_trapframe can distinguish between printing
  * a saved trapframe and printing the current trapframe and print some
@@ -98,6 +99,9 @@ trap_init(void)
 	void syscall_thdlr();
 	void kbd_thdlr();
 	void serial_thdlr();
+	void spurious_thdlr();
+	void resched_thdlr();
+	void tlb_thdlr();
 
 	SETGATE(idt[T_DIVIDE], 0, GD_KT, &divide_thdlr, 0);
 	SETGATE(idt[T_DEBUG], 0, GD_KT, &debug_thdlr, 0);
@@ -120,6 +124,9 @@ trap_init(void)
 	SETGATE(idt[T_SYSCALL], 0, GD_KT, &syscall_thdlr, 3);
 	SETGATE(idt[IRQ_OFFSET + IRQ_KBD], 0, GD_KT, &kbd_thdlr, 3);
 	SETGATE(idt[IRQ_OFFSET + IRQ_SERIAL], 0, GD_KT, &serial_thdlr, 3);
+	SETGATE(idt[IRQ_OFFSET + IRQ_SPURIOUS], 0, GD_KT, &spurious_thdlr, 0);
+	SETGATE(idt[IRQ_OFFSET + IRQ_RESCHED], 0, GD_KT, &resched_thdlr, 0);
+	SETGATE(idt[IRQ_OFFSET + IRQ_TLB], 0, GD_KT, &tlb_thdlr, 0);
 
 	// Per-CPU setup 
 	trap_init_percpu();
@@ -129,19 +136,24 @@ trap_init(void)
 void
 trap_init_percpu(void)
 {
+	struct Taskstate *ts = &thiscpu->cpu_ts;
+	int i = cpunum();
+
 	// Setup a TSS so that we get the right stack
-	// when we trap to the kernel.
-	ts.ts_esp0 = KSTACKTOP;
-	ts.ts_ss0 = GD_KD;
+	// when we trap to the kernel, the stack of this CPU
+	// (see mem_init_mp()).
+	ts->ts_esp0 = KSTACKTOP - i * (KSTKSIZE + KSTKGAP);
+	ts->ts_ss0 = GD_KD;
+	ts->ts_iomb = sizeof(struct Taskstate);
 
 	// Initialize the TSS slot of the gdt.
-	gdt[GD_TSS0 >> 3] = SEG16(STS_T32A, (uint32_t) (&ts),
+	gdt[(GD_TSS0 >> 3) + i] = SEG16(STS_T32A, (uint32_t) ts,
 					sizeof(struct Taskstate), 0);
-	gdt[GD_TSS0 >> 3].sd_s = 0;
+	gdt[(GD_TSS0 >> 3) + i].sd_s = 0;
 
 	// Load the TSS selector (like other segment selectors, the
 	// bottom three bits are special; we leave them 0)
-	ltr(GD_TSS0);
+	ltr(GD_TSS0 + (i << 3));
 
 	// Load the IDT
 	lidt(&idt_pd);
@@ -152,8 +164,10 @@ void
 clock_idt_init(void)
 {
 	extern void (*clock_thdlr)(void);
+	extern void (*timer_thdlr)(void);
 	// init idt structure
 	SETGATE(idt[IRQ_OFFSET + IRQ_CLOCK], 0, GD_KT, (int)(&clock_thdlr), 0);
+	SETGATE(idt[IRQ_OFFSET + IRQ_TIMER], 0, GD_KT, (int)(&timer_thdlr), 0);
 	lidt(&idt_pd);
 }
 
@@ -240,12 +254,28 @@ trap_dispatch(struct Trapframe *tf)
 		return;
 	}
 
+	// The RTC still interrupts twice a second, but only to keep the
+	// time in vsys current: the scheduler runs on IRQ_TIMER deadlines.
 	if (tf->tf_trapno == IRQ_OFFSET + IRQ_CLOCK)
 	{
 		rtc_check_status();
-		vsys[VSYS_gettime] = gettime();
+		vsys[VSYS_gettime] = time_now();
 		pic_send_eoi(IRQ_CLOCK);
-		sched_yield();
+		return;
+	}
+
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TIMER)
+	{
+		clockev_interrupt();
+		sched_tick();
+		return;
+	}
+
+	// Another CPU queued an environment for this one to run, see
+	// sched_kick().  trap() goes on to the scheduler.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_RESCHED)
+	{
+		lapic_eoi();
 		return;
 	}
 
@@ -294,13 +324,44 @@ trap(struct Trapframe *tf)
 	// the interrupt path.
 	assert(!(read_eflags() & FL_IF));
 
+	// Another CPU holds the kernel lock and waits for this one to
+	// flush its TLB, so do it without the lock, then resume.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TLB)
+	{
+		tlb_shootdown_handle();
+		lapic_eoi();
+		return;
+	}
+
 	if (debug) {
 		cprintf("Incoming TRAP frame at %p\n", tf);
 	}
 
-	assert(curenv);
+	// A page fault in the kernel itself has no environment state to
+	// save.  page_fault_handler() either panics or points the trap
+	// frame at fixup code, in which case we return straight to it.
+	// The kernel lock is held already.
+	if (tf->tf_trapno == T_PGFLT && !(tf->tf_cs & 3))
+	{
+		page_fault_handler(tf);
+		return;
+	}
 
-	// Garbage collect if current enviroment is a zombie
+	// The CPU was idle in sched_halt().  There is no environment
+	// to save the state of, only the interrupt to handle.
+	if (!curenv) {
+		assert((tf->tf_cs & 3) == 0);
+		lock_kernel();
+		trap_dispatch(tf);
+		sched_yield();
+	}
+
+	// Trapped from user mode.  Acquire the big kernel lock before
+	// doing any serious kernel work; env_run() releases it.
+	if ((tf->tf_cs & 3) == 3)
+		lock_kernel();
+
+	// Garbage collect if current enviroment is dying
 	if (curenv->env_status == ENV_DYING) {
 		env_free(curenv);
 		curenv = NULL;
@@ -313,6 +374,7 @@ trap(struct Trapframe *tf)
 	curenv->env_tf = *tf;
 	// The trapframe on the stack should be ignored from here on.
 	tf = &curenv->env_tf;
+	sched_account(curenv);
 
 	// Record that tf is the last real trapframe so
 	// print_trapframe can print some additional information.
@@ -324,18 +386,34 @@ trap(struct Trapframe *tf)
 	// If we made it to this point, then no other environment was
 	// scheduled, so we should return to the current environment
 	// if doing so makes sense.
-	if (curenv && curenv->env_status == ENV_RUNNING)
-		env_run(curenv);
-	else
-		sched_yield();
+	sched_resume();
 }
 
 
+// Find the fixup for a kernel-mode fault at 'eip', or return 0.
+static uintptr_t
+ex_table_lookup(uintptr_t eip)
+{
+	extern struct ExTableEntry __ex_table_start[], __ex_table_end[];
+	struct ExTableEntry *ex;
+
+	for (ex = __ex_table_start; ex < __ex_table_end; ex++)
+	{
+		if (ex->insn == eip)
+		{
+			return ex->fixup;
+		}
+	}
+
+	return 0;
+}
+
 void
 page_fault_handler(struct Trapframe *tf)
 {
 	uint32_t fault_va;
 	struct UTrapframe *utf;
+	uintptr_t fixup;
 
 	// Read processor's CR2 register to find the faulting address
 	fault_va = rcr2();
@@ -346,8 +424,24 @@ page_fault_handler(struct Trapframe *tf)
 	// The current privilege level (CPL) is stored in the lowest two
 	// bits of CS.
 	// !(CS & 0x3) == not in the user mode.
+	// Faults on user memory in copy_from_user() and copy_to_user()
+	// are listed in the exception table and resume at their fixup.
 	if (!(tf->tf_cs & 0x3))
 	{
+		// copy_to_user() writing to a copy-on-write page.
+		if ((tf->tf_err & FEC_WR) && fault_va < UTOP && curenv &&
+			page_cow_fault(curenv->env_pgdir, (void *) fault_va) == 0)
+		{
+			curenv->env_stats.es_cow_faults++;
+			return;
+		}
+
+		if ((fixup = ex_table_lookup(tf->tf_eip)))
+		{
+			tf->tf_eip = fixup;
+			return;
+		}
+
 		panic("page_fault_handler: kernel mode: page fault");
 	}
 
@@ -356,7 +450,8 @@ page_fault_handler(struct Trapframe *tf)
 
 	// Call the environment's page fault upcall, if one exists.  Set up a
 	// page fault stack frame on the user exception stack (below
-	// UXSTACKTOP), then branch to curenv->env_pgfault_upcall.
+	// UXSTACKTOP, or the thread's env_uxstacktop), then branch to
+	// curenv->env_pgfault_upcall.
 	//
 	// The page fault upcall might cause another page fault, in which case
 	// we branch to the page fault upcall recursively, pushing another
@@ -384,12 +479,24 @@ page_fault_handler(struct Trapframe *tf)
 
 	// LAB 9: Your code here.
 
+	// Copy-on-write faults are resolved here, without the round trip
+	// through the upcall.  trap() then resumes the environment.  The
+	// upcall still gets them if the kernel is out of memory.
+	if ((tf->tf_err & FEC_WR) &&
+		page_cow_fault(curenv->env_pgdir, (void *) fault_va) == 0)
+	{
+		curenv->env_stats.es_cow_faults++;
+		return;
+	}
+
 	if (curenv->env_pgfault_upcall)
 	{
+		curenv->env_stats.es_upcall_faults++;
+
 		// Page fault happened while handling a
 		// page fault
-		if (tf->tf_esp >= UXSTACKTOP - PGSIZE &&
-			tf->tf_esp < UXSTACKTOP)
+		if (tf->tf_esp >= curenv->env_uxstacktop - PGSIZE &&
+			tf->tf_esp < curenv->env_uxstacktop)
 		{
 			// Push an extra word
 			*((uint32_t *) (tf->tf_esp - 4)) = 0;
@@ -401,7 +508,8 @@ page_fault_handler(struct Trapframe *tf)
 		else
 		{
 			utf = (struct UTrapframe *)
-				(UXSTACKTOP - sizeof(struct UTrapframe));
+				(curenv->env_uxstacktop -
+				sizeof(struct UTrapframe));
 		}
 
 		// If the stack overflows, this assertion will fail
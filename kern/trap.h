@@ -9,6 +9,14 @@
 #include <inc/trap.h>
 #include <inc/mmu.h>
 
+/* An entry of the exception table.  A kernel-mode page fault at
+ * instruction 'insn' resumes at 'fixup' instead of panicking.
+ * Entries live in the __ex_table section, see kern/kernel.ld. */
+struct ExTableEntry {
+	uintptr_t insn;
+	uintptr_t fixup;
+};
+
 /* The kernel's interrupt descriptor table */
 extern struct Gatedesc idt[];
 extern struct Pseudodesc idt_pd;
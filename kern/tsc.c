@@ -5,8 +5,6 @@
 
 #include <kern/tsc.h>
 
-/* The clock frequency of the i8253/i8254 PIT */
-#define PIT_TICK_RATE 1193182ul
 #define DEFAULT_FREQ 2500000
 #define TIMES 100
 
@@ -6,6 +6,13 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/types.h>
+
+/* The clock frequency of the i8253/i8254 PIT */
+#define PIT_TICK_RATE 1193182ul
+
+extern unsigned long cpu_freq;	// TSC frequency in KHz
+
 void tsc_calibrate(void);
 void timer_start(void);
 void timer_stop(void);
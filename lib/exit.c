@@ -3,8 +3,15 @@
 
 void
 exit(void)
+{
+	exit_status(0);
+}
+
+// Exit, passing 'status' (0 to 255) to the envs that wait() for this one.
+void
+exit_status(int status)
 {
 	close_all();
-	sys_env_destroy(0);
+	sys_env_exit(status);
 }
 
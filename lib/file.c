@@ -10,6 +10,8 @@
 
 union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 
+static envid_t fsenv;
+
 // Send an inter-environment request to the file server, and wait for
 // a reply.  The request body should be in fsipcbuf, and parts of the
 // response may be written back to fsipcbuf.
@@ -19,7 +21,6 @@ union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 static int
 fsipc(unsigned type, void *dstva)
 {
-	static envid_t fsenv;
 	if (fsenv == 0)
 		fsenv = ipc_find_env(ENV_TYPE_FS);
 
@@ -28,8 +29,28 @@ fsipc(unsigned type, void *dstva)
 	if (debug)
 		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
 
-	ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-	return ipc_recv(NULL, dstva, NULL);
+	return ipc_call(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U,
+			dstva, NULL);
+}
+
+// Like fsipc, for a request whose 'len' byte body 'req' fits in the
+// words of a register message, see IPC_WORDS, and whose reply is just
+// the result.  This saves mapping fsipcbuf into the file server.
+static int
+fsipc_words(unsigned type, const void *req, size_t len)
+{
+	uint32_t words[IPC_NWORDS] = { 0 };
+
+	if (fsenv == 0)
+		fsenv = ipc_find_env(ENV_TYPE_FS);
+
+	assert(len <= sizeof(words));
+	memcpy(words, req, len);
+
+	if (debug)
+		cprintf("[%08x] fsipc_words %d %08x\n", thisenv->env_id, type, words[0]);
+
+	return ipc_call(fsenv, type, words, IPC_WORDS, NULL, NULL);
 }
 
 static int devfile_flush(struct Fd *fd);
@@ -103,8 +124,9 @@ open(const char *path, int mode)
 static int
 devfile_flush(struct Fd *fd)
 {
-	fsipcbuf.flush.req_fileid = fd->fd_file.id;
-	return fsipc(FSREQ_FLUSH, NULL);
+	struct Fsreq_flush req = { .req_fileid = fd->fd_file.id };
+
+	return fsipc_words(FSREQ_FLUSH, &req, sizeof(req));
 }
 
 // Read at most 'n' bytes from 'fd' at the current position into 'buf'.
@@ -182,9 +204,12 @@ devfile_stat(struct Fd *fd, struct Stat *st)
 static int
 devfile_trunc(struct Fd *fd, off_t newsize)
 {
-	fsipcbuf.set_size.req_fileid = fd->fd_file.id;
-	fsipcbuf.set_size.req_size = newsize;
-	return fsipc(FSREQ_SET_SIZE, NULL);
+	struct Fsreq_set_size req = {
+		.req_fileid = fd->fd_file.id,
+		.req_size = newsize
+	};
+
+	return fsipc_words(FSREQ_SET_SIZE, &req, sizeof(req));
 }
 
 
@@ -195,7 +220,7 @@ sync(void)
 	// Ask the file server to update the disk
 	// by writing any dirty blocks in the buffer cache.
 
-	return fsipc(FSREQ_SYNC, NULL);
+	return fsipc_words(FSREQ_SYNC, NULL, 0);
 }
 
 // Delete a file
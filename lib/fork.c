@@ -3,13 +3,11 @@
 #include <inc/string.h>
 #include <inc/lib.h>
 
-// PTE_COW marks copy-on-write page table entries.
-// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW		0x800
-
 //
 // Custom page fault handler - if faulting page is copy-on-write,
 // map in our own private writable copy.
+// The kernel resolves copy-on-write faults itself, so this only runs
+// when it could not, i.e. when it was out of memory.
 //
 static void
 pgfault(struct UTrapframe *utf)
@@ -33,7 +31,8 @@ pgfault(struct UTrapframe *utf)
 
 	// LAB 9: Your code here.
 
-	if (!(err & FEC_WR) || !(pte & PTE_COW))
+	// 4MB pages are never copy-on-write, and uvpt has no entry for them.
+	if (!(err & FEC_WR) || (uvpd[PDX(addr)] & PTE_PS) || !(pte & PTE_COW))
 	{
 		panic("pgfault: invalid address");
 	}
@@ -74,98 +73,26 @@ pgfault(struct UTrapframe *utf)
 	//panic("pgfault not implemented");
 }
 
-//
-// Map our virtual page pn (address pn*PGSIZE) into the target envid
-// at the same virtual address.  If the page is writable or copy-on-write,
-// the new mapping must be created copy-on-write, and then our mapping must be
-// marked copy-on-write as well.  (Exercise: Why do we need to mark ours
-// copy-on-write again if it was already copy-on-write at the beginning of
-// this function?)
-//
-// Returns: 0 on success, < 0 on error.
-// It is also OK to panic on error.
-//
-static int
-duppage(envid_t envid, unsigned pn)
-{
-	// LAB 9: Your code here.
-	envid_t penvid;
-	void *va;
-	int err;
-
-	penvid = sys_getenvid();
-	va = (void *) (pn * PGSIZE);
-
-	if ((uvpt[pn] & PTE_SHARE) == PTE_SHARE)
-	{
-		// Don't map child's memory copy-on-write.
-		if ((err = sys_page_map(penvid, va, envid, va,
-			uvpt[pn] & PTE_SYSCALL)) < 0)
-		{
-			panic("duppage: sys_page_map: %i", err);
-		}
-	}
-	else if (((uvpt[pn] & PTE_W) == PTE_W) ||
-		((uvpt[pn] & PTE_COW) == PTE_COW))
-	{
-		// Map child's memory copy-on-write.
-		if ((err = sys_page_map(penvid, va, envid, va,
-			PTE_COW | PTE_U | PTE_P)) < 0)
-		{
-			panic("duppage: sys_page_map: %i", err);
-		}
-
-		// Map our own memory COW again.
-		if ((err = sys_page_map(penvid, va, penvid, va,
-			PTE_COW | PTE_U | PTE_P)) < 0)
-		{
-			panic("duppage: sys_page_map: %i", err);
-		}
-	}
-	else
-	{
-		// Map child's memory non-COW.
-		if ((err = sys_page_map(penvid, va, envid, va,
-			PTE_U | PTE_P)) < 0)
-		{
-			panic("duppage: sys_page_map: %i", err);
-		}
-	}
-
-	//panic("duppage not implemented");
-	return 0;
-}
-
 //
 // User-level fork with copy-on-write.
-// Set up our page fault handler appropriately.
-// Create a child.
-// Copy our address space and page fault handler setup to the child.
-// Then mark the child as runnable and return.
+// Set up our page fault handler appropriately, then let sys_fork
+// create the child.  The kernel copies our address space to the child
+// copy-on-write, gives it our page fault upcall and a fresh user
+// exception stack, and marks it runnable, all in one system call.
 //
 // Returns: child's envid to the parent, 0 to the child, < 0 on error.
-// It is also OK to panic on error.
-//
-// Hint:
-//   Use uvpd, uvpt, and duppage.
-//   Remember to fix "thisenv" in the child process.
-//   Neither user exception stack should ever be marked copy-on-write,
-//   so you must allocate a new page for the child's user exception stack.
 //
 envid_t
 fork(void)
 {
 	// LAB 9: Your code here.
-	void _pgfault_upcall();
 	envid_t envid;
-	uint32_t addr;
-	int err;
 
 	set_pgfault_handler(pgfault);
 
-	if ((envid = sys_exofork()) < 0)
+	if ((envid = sys_fork()) < 0)
 	{
-		panic("sys_exofork: %i", envid);
+		return envid;
 	}
 
 	// Child.
@@ -173,83 +100,35 @@ fork(void)
 	{
 		// Get the child's ENVID.
 		thisenv = envs + ENVX(sys_getenvid());
-		return 0;
 	}
 
-	for (addr = 0; addr < USTACKTOP; addr += PGSIZE)
-	{
-		// If the page is present, copy our address space to the child.
-#ifdef SANITIZE_USER_SHADOW_BASE
-		if (addr >= SANITIZE_USER_SHADOW_BASE &&
-			addr <= SANITIZE_USER_SHADOW_BASE +
-			SANITIZE_USER_SHADOW_SIZE)			
-		{
-			continue;
-		}
-
-		if (addr >= SANITIZE_USER_EXTRA_SHADOW_BASE &&
-			 addr <= SANITIZE_USER_EXTRA_SHADOW_BASE +
-			 SANITIZE_USER_EXTRA_SHADOW_SIZE)
-		{
-			continue;
-		}
-
-		if (addr >= SANITIZE_USER_FS_SHADOW_BASE &&
-			 addr <= SANITIZE_USER_FS_SHADOW_BASE +
-			 SANITIZE_USER_FS_SHADOW_SIZE)
-		{
-			continue;
-		}
-#endif
-		if (((uvpd[PDX(addr)] & PTE_P) == PTE_P) &&
-			((uvpt[PGNUM(addr)] & PTE_P) == PTE_P))
-		{
-			duppage(envid, PGNUM(addr));
-		}
-	}
+	return envid;
+}
 
-	if ((err = sys_env_set_pgfault_upcall(envid, _pgfault_upcall)) < 0)
-	{
-		panic("fork: sys_env_set_pgfault_upcall: %i", err);
-	}
+// Challenge!
+//
+// Like fork, but the child shares all our memory except the stacks,
+// so writes to globals and the heap are seen by both.  The stacks, and
+// the per-thread data page holding thisenv, stay private and
+// copy-on-write.
+//
+envid_t
+sfork(void)
+{
+	envid_t envid;
 
-	// Allocate the child's exception stack.
-	if ((err = sys_page_alloc(envid, (void *) (UXSTACKTOP - PGSIZE),
-		PTE_W | PTE_U | PTE_P)) < 0)
+	set_pgfault_handler(pgfault);
+
+	if ((envid = sys_sfork()) < 0)
 	{
-		panic("fork: sys_page_alloc: %i", err);
+		return envid;
 	}
 
-// Duplicating shadow addresses is insane. Make sure to skip shadow addresses in COW above.
-
-#ifdef SANITIZE_USER_SHADOW_BASE
-	for (addr = SANITIZE_USER_SHADOW_BASE; addr < SANITIZE_USER_SHADOW_BASE +
-		SANITIZE_USER_SHADOW_SIZE; addr += PGSIZE)
-		if (sys_page_alloc(envid, (void *) addr, PTE_P | PTE_U | PTE_W))
-			panic("Fork: failed to alloc shadow base page");
-	for (addr = SANITIZE_USER_EXTRA_SHADOW_BASE; addr < SANITIZE_USER_EXTRA_SHADOW_BASE +
-		SANITIZE_USER_EXTRA_SHADOW_SIZE; addr += PGSIZE)
-		if (sys_page_alloc(envid, (void *) addr, PTE_P | PTE_U | PTE_W))
-			panic("Fork: failed to alloc shadow extra base page");
-	for (addr = SANITIZE_USER_FS_SHADOW_BASE; addr < SANITIZE_USER_FS_SHADOW_BASE +
-		SANITIZE_USER_FS_SHADOW_SIZE; addr += PGSIZE)
-		if (sys_page_alloc(envid, (void *) addr, PTE_P | PTE_U | PTE_W))
-			panic("Fork: failed to alloc shadow fs base page");
-#endif
-
-	if ((err = sys_env_set_status(envid, ENV_RUNNABLE)) < 0)
+	// Child.
+	if (!envid)
 	{
-		panic("fork: sys_env_set_status: %i", err);
+		thisenv = envs + ENVX(sys_getenvid());
 	}
 
 	return envid;
-	//panic("fork not implemented");
-}
-
-// Challenge!
-int
-sfork(void)
-{
-	panic("sfork not implemented");
-	return -E_INVAL;
 }
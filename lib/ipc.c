@@ -2,6 +2,42 @@
 
 #include <inc/lib.h>
 
+// Finish a receive that the system call returned 'err' from, as
+// ipc_recv describes.
+static int32_t
+ipc_result(int err, envid_t *from_env_store, void *pg, int *perm_store)
+{
+	if (err < 0)
+	{
+		if (from_env_store)
+		{
+			*from_env_store = 0;
+		}
+
+		if (perm_store)
+		{
+			*perm_store = 0;
+		}
+
+		return err;
+	}
+
+	if (from_env_store)
+	{
+		*from_env_store = thisenv->env_ipc_from;
+	}
+
+	if (perm_store)
+	{
+		*perm_store = thisenv->env_ipc_perm;
+	}
+
+#ifdef SANITIZE_USER_SHADOW_BASE
+	platform_asan_unpoison(pg, PGSIZE);
+#endif
+	return thisenv->env_ipc_value;
+}
+
 // Receive a value via IPC and return it.
 // If 'pg' is nonnull, then any page sent by the sender will be mapped at
 //	that address.
@@ -22,42 +58,61 @@
 int32_t
 ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 {
-	// LAB 9: Your code here.
-	int err;
+	return ipc_recv_until(from_env_store, pg, perm_store, 0);
+}
 
+// Like ipc_recv, but give up with -E_TIMEOUT when the TSC reaches
+// 'deadline', unless it is 0.
+int32_t
+ipc_recv_until(envid_t *from_env_store, void *pg, int *perm_store,
+	       uint64_t deadline)
+{
+	// LAB 9: Your code here.
 	pg = (pg) ? pg : (void *) UTOP;
 
-	if ((err = sys_ipc_recv(pg)) < 0)
-	{
-		if (from_env_store)
-		{
-			*from_env_store = 0;
-		}
+	return ipc_result(sys_ipc_recv_until(pg, deadline), from_env_store,
+			  pg, perm_store);
+	//panic("ipc_recv not implemented");
+}
 
-		if (perm_store)
-		{
-			*perm_store = 0;
-		}
+// Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'to_env'
+// and wait for its reply, which is returned as by ipc_recv, with any
+// page of it mapped at 'rcv_pg'.  Unlike ipc_send followed by
+// ipc_recv this never spins: the kernel switches to 'to_env' right
+// away, or queues the call until 'to_env' receives.
+int32_t
+ipc_call(envid_t to_env, uint32_t val, void *pg, int perm, void *rcv_pg,
+	 int *perm_store)
+{
+	pg = (pg) ? pg : (void *) UTOP;
+	rcv_pg = (rcv_pg) ? rcv_pg : (void *) UTOP;
 
-		return err;
-	}
+	return ipc_result(sys_ipc_call(to_env, val, pg, perm, rcv_pg), NULL,
+			  rcv_pg, perm_store);
+}
 
-	if (from_env_store)
-	{
-		*from_env_store = thisenv->env_ipc_from;
-	}
+// Reply 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'to_env',
+// and wait for the next request, which is returned as by ipc_recv.
+// The reply is dropped if 'to_env' is gone.  A client that sent its
+// request with ipc_send may not be receiving yet; the reply waits in
+// its mailbox then, or goes out with ipc_send if that is full.
+int32_t
+ipc_reply_wait(envid_t to_env, uint32_t val, void *pg, int perm,
+	       envid_t *from_env_store, void *rcv_pg, int *perm_store)
+{
+	int err;
 
-	if (perm_store)
+	pg = (pg) ? pg : (void *) UTOP;
+	rcv_pg = (rcv_pg) ? rcv_pg : (void *) UTOP;
+
+	err = sys_ipc_reply_wait(to_env, val, pg, perm, rcv_pg);
+	if (err == -E_IPC_NOT_RECV)
 	{
-		*perm_store = thisenv->env_ipc_perm;
+		ipc_send(to_env, val, pg, perm);
+		return ipc_recv(from_env_store, rcv_pg, perm_store);
 	}
 
-	//panic("ipc_recv not implemented");
-
-#ifdef SANITIZE_USER_SHADOW_BASE
-	platform_asan_unpoison(pg, PGSIZE);
-#endif
-	return thisenv->env_ipc_value;
+	return ipc_result(err, from_env_store, rcv_pg, perm_store);
 }
 
 // Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv'.
@@ -83,11 +138,10 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 			panic("ipc_send: sys_ipc_try_send: %i", err);
 		}
 
-		sys_yield();
+		// Sleep on the kernel's timer wheel until the next try,
+		// instead of taking whole time slices by yielding.
+		sleep_ms(1);
 	}
-
-	// In case we never entered the loop.
-	sys_yield();
 	//panic("ipc_send not implemented");
 }
 
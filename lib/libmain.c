@@ -5,7 +5,9 @@
 
 extern void umain(int argc, char **argv);
 
+#ifdef CONFIG_KSPACE
 const volatile struct Env *thisenv;
+#endif
 const char *binaryname = "<unknown>";
 
 #ifdef JOS_PROG
@@ -20,6 +22,9 @@ libmain(int argc, char **argv)
 	extern void (*__ctors_start)();
 	extern void (*__ctors_end)();
 	void (**ctor)() = &__ctors_start;
+#ifndef CONFIG_KSPACE
+	int r;
+#endif
 	while (ctor < &__ctors_end) {
 		(*ctor)();
 		ctor++;
@@ -27,6 +32,11 @@ libmain(int argc, char **argv)
 
 	// set thisenv to point at our Env structure in envs[].
 	// LAB 8: Your code here.
+#ifndef CONFIG_KSPACE
+	// It lives in the per-thread data page, see inc/lib.h.
+	if ((r = sys_page_alloc(0, (void *) UTHREADDATA, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_alloc: %i", r);
+#endif
 	thisenv = envs + ENVX(sys_getenvid());
 
 	// save the name of the program so that panic() can use it
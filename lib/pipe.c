@@ -23,9 +23,16 @@ struct Dev devpipe =
 
 #define PIPEBUFSIZ 32		// small to provoke races
 
+// How long a reader or writer blocks at a time.  The other end wakes
+// it up when it moves its position or closes, but not when it is
+// destroyed, which is only noticed by checking again.
+#define PIPE_WAIT_MS 10
+
 struct Pipe {
 	off_t p_rpos;		// read position
 	off_t p_wpos;		// write position
+	uint32_t p_rwaiting;	// a reader may wait for wpos to move
+	uint32_t p_wwaiting;	// a writer may wait for rpos to move
 	uint8_t p_buf[PIPEBUFSIZ];	// data buffer
 };
 
@@ -105,6 +112,37 @@ pipeisclosed(int fdnum)
 	return _pipeisclosed(fd, p);
 }
 
+// Tell the other end to wake us up, before checking whether it closed
+// and blocking in pipe_wait(), so that it cannot move or close in
+// between unnoticed.
+static void
+pipe_will_wait(uint32_t *waiting)
+{
+	*waiting = 1;
+	__sync_synchronize();
+}
+
+// Block until the position at 'pos' moves from 'old', woken up by
+// pipe_wake(), or for PIPE_WAIT_MS at most.
+static void
+pipe_wait(off_t *pos, off_t old)
+{
+	sys_futex_wait((volatile uint32_t *) pos, old,
+		       read_tsc() + (uint64_t) PIPE_WAIT_MS * vsys_tsc_khz());
+}
+
+// Wake up the other end if it waits for 'pos' to move, which we just
+// did, or for us to close.  Makes no system call if it does not.
+static void
+pipe_wake(uint32_t *waiting, off_t *pos)
+{
+	__sync_synchronize();
+	if (*waiting) {
+		*waiting = 0;
+		sys_futex_wake((volatile uint32_t *) pos, ~0u);
+	}
+}
+
 static ssize_t
 devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 {
@@ -123,20 +161,24 @@ devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 			// pipe is empty
 			// if we got any data, return it
 			if (i > 0)
-				return i;
+				goto out;
 			// if all the writers are gone, note eof
+			pipe_will_wait(&p->p_rwaiting);
 			if (_pipeisclosed(fd, p))
 				return 0;
-			// yield and see what happens
+			// wait for a writer to move wpos
 			if (debug)
-				cprintf("devpipe_read yield\n");
-			sys_yield();
+				cprintf("devpipe_read wait\n");
+			pipe_wait(&p->p_wpos, p->p_rpos);
 		}
 		// there's a byte.  take it.
 		// wait to increment rpos until the byte is taken!
 		buf[i] = p->p_buf[p->p_rpos % PIPEBUFSIZ];
 		p->p_rpos++;
 	}
+    out:
+	// let the writers know there is room
+	pipe_wake(&p->p_wwaiting, &p->p_rpos);
 	return i;
 }
 
@@ -159,12 +201,15 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 			// if all the readers are gone
 			// (it's only writers like us now),
 			// note eof
+			pipe_will_wait(&p->p_wwaiting);
 			if (_pipeisclosed(fd, p))
 				return 0;
-			// yield and see what happens
+			// let the readers at what we wrote,
+			// and wait for one to move rpos
 			if (debug)
-				cprintf("devpipe_write yield\n");
-			sys_yield();
+				cprintf("devpipe_write wait\n");
+			pipe_wake(&p->p_rwaiting, &p->p_wpos);
+			pipe_wait(&p->p_rpos, p->p_wpos - sizeof(p->p_buf));
 		}
 		// there's room for a byte.  store it.
 		// wait to increment wpos until the byte is stored!
@@ -172,6 +217,7 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 		p->p_wpos++;
 	}
 
+	pipe_wake(&p->p_rwaiting, &p->p_wpos);
 	return i;
 }
 
@@ -189,7 +235,15 @@ devpipe_stat(struct Fd *fd, struct Stat *stat)
 static int
 devpipe_close(struct Fd *fd)
 {
+	struct Pipe *p = (struct Pipe*) fd2data(fd);
+
+	// Wake the other end to check whether the pipe is closed once
+	// the fd is gone.  The data page can only be woken on while it
+	// is mapped; if the other end checks before it is unmapped too,
+	// it sees the close after PIPE_WAIT_MS.
 	(void) sys_page_unmap(0, fd);
-	return sys_page_unmap(0, fd2data(fd));
+	pipe_wake(&p->p_rwaiting, &p->p_wpos);
+	pipe_wake(&p->p_wwaiting, &p->p_rpos);
+	return sys_page_unmap(0, p);
 }
 
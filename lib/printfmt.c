@@ -39,6 +39,9 @@ static const char * const error_string[MAXERROR] =
 	[E_NOT_A_DIR]	= "not a directory",
 	[E_INVAL_REC]	= "invalid user record",
 	[E_DMGD_FILE]	= "damaged file in /etc",
+	[E_PERM]	= "operation not permitted",
+	[E_BUSY]	= "resource busy",
+	[E_TIMEOUT]	= "timed out",
 };
 
 /*
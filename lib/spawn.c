@@ -226,10 +226,8 @@ init_stack(envid_t child, const char **argv, uintptr_t *init_esp)
 		return -E_NO_MEM;
 
 	// Allocate the stack pages at UTEMP.
-	for (int i = 0; i < USTACKSIZE; i += PGSIZE) {
-		if ((r = sys_page_alloc(0, (void*) UTEMP + i, PTE_P|PTE_U|PTE_W)) < 0)
-			return r;
-	}
+	if ((r = sys_page_alloc_range(0, UTEMP, USTACKSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+		goto error;
 
 	//	* Initialize 'argv_store[i]' to point to argument string i,
 	//	  for all 0 <= i < argc.
@@ -262,18 +260,15 @@ init_stack(envid_t child, const char **argv, uintptr_t *init_esp)
 
 	// After completing the stack, map it into the child's address space
 	// and unmap it from ours!
-	for (int i = 0; i < USTACKSIZE; i += PGSIZE) {
-		if ((r = sys_page_map(0, UTEMP + i, child, (void*) (USTACKTOP - USTACKSIZE + i), PTE_P | PTE_U | PTE_W)) < 0)
-			goto error;
-		if ((r = sys_page_unmap(0, UTEMP + i)) < 0)
-			goto error;
-	}
+	if ((r = sys_page_map_range(0, UTEMP, child, (void*) (USTACKTOP - USTACKSIZE), USTACKSIZE, PTE_P | PTE_U | PTE_W)) < 0)
+		goto error;
+	if ((r = sys_page_unmap_range(0, UTEMP, USTACKSIZE)) < 0)
+		goto error;
 
 	return 0;
 
 error:
-	for (int i = 0; i < USTACKSIZE; i += PGSIZE)
-		sys_page_unmap(0, UTEMP + i);
+	sys_page_unmap_range(0, UTEMP, USTACKSIZE);
 	return r;
 }
 
@@ -281,7 +276,7 @@ static int
 map_segment(envid_t child, uintptr_t va, size_t memsz,
 	int fd, size_t filesz, off_t fileoffset, int perm)
 {
-	int i, r;
+	int i, n, r;
 
 	//cprintf("map_segment %x+%x\n", va, memsz);
 
@@ -292,25 +287,29 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 		fileoffset -= i;
 	}
 
-	for (i = 0; i < memsz; i += PGSIZE) {
-		if (i >= filesz) {
-			// allocate a blank page
-			if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
-				return r;
-		} else {
-			// from file
-			if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
-				return r;
-			if ((r = seek(fd, fileoffset + i)) < 0)
-				return r;
-			if ((r = readn(fd, UTEMP, MIN(PGSIZE, filesz-i))) < 0)
-				return r;
-			if ((r = sys_page_map(0, UTEMP, child, (void*) (va + i), perm)) < 0)
-				panic("spawn: sys_page_map data: %i", r);
-			sys_page_unmap(0, UTEMP);
-		}
+	// Pages from the file are read at UTEMP, as many at a time as fit
+	// below PFTEMP, and then moved to the child.
+	for (i = 0; i < memsz && i < filesz; i += n) {
+		n = MIN(MIN(memsz, ROUNDUP(filesz, PGSIZE)) - i, PTSIZE - PGSIZE);
+		if ((r = sys_page_alloc_range(0, UTEMP, n, PTE_P|PTE_U|PTE_W)) < 0)
+			goto error;
+		if ((r = seek(fd, fileoffset + i)) < 0)
+			goto error;
+		if ((r = readn(fd, UTEMP, MIN(n, filesz-i))) < 0)
+			goto error;
+		if ((r = sys_page_map_range(0, UTEMP, child, (void*) (va + i), n, perm)) < 0)
+			panic("spawn: sys_page_map_range data: %i", r);
+		sys_page_unmap_range(0, UTEMP, n);
 	}
+
+	// The rest are blank pages.
+	if (i < memsz && (r = sys_page_alloc_range(child, (void*) (va + i), memsz - i, perm)) < 0)
+		return r;
 	return 0;
+
+error:
+	sys_page_unmap_range(0, UTEMP, n);
+	return r;
 }
 
 // Copy the mappings for shared pages into the child address space.
@@ -327,6 +326,21 @@ copy_shared_pages(envid_t child)
 	// Do the same thing as we do in fork(), but only copy the mappings.
 	for (addr = 0; addr < USTACKTOP; addr += PGSIZE)
 	{
+		// Shared 4MB pages are mapped whole.
+		if ((uvpd[PDX(addr)] & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS))
+		{
+			if ((uvpd[PDX(addr)] & PTE_SHARE) == PTE_SHARE &&
+				(err = sys_page_map(parent, (void *) addr,
+				child, (void *) addr,
+				(uvpd[PDX(addr)] & PTE_SYSCALL) | PTE_PS)) < 0)
+			{
+				panic("copy_shared_pages: sys_page_map: %i",
+					err);
+			}
+			addr += PTSIZE - PGSIZE;
+			continue;
+		}
+
 		if ((uvpd[PDX(addr)] & PTE_P) == PTE_P &&
 			(uvpt[PGNUM(addr)] & (PTE_P | PTE_SHARE)) ==
 			(PTE_P | PTE_SHARE))
@@ -55,6 +55,18 @@ sys_env_destroy(envid_t envid)
 	return syscall(SYS_env_destroy, 1, envid, 0, 0, 0, 0);
 }
 
+int
+sys_env_exit(int status)
+{
+	return syscall(SYS_env_destroy, 1, 0, status, 0, 0, 0);
+}
+
+int
+sys_env_wait(envid_t envid)
+{
+	return syscall(SYS_env_wait, 0, envid, 0, 0, 0, 0);
+}
+
 envid_t
 sys_getenvid(void)
 {
@@ -90,14 +102,81 @@ sys_page_unmap(envid_t envid, void *va)
 	return syscall(SYS_page_unmap, 1, envid, (uint32_t) va, 0, 0, 0);
 }
 
+int
+sys_page_alloc_range(envid_t envid, void *va, size_t len, int perm)
+{
+	int r = syscall(SYS_page_alloc_range, 1, envid, (uint32_t) va, len, perm, 0);
+#ifdef SANITIZE_USER_SHADOW_BASE
+	// Unpoison the allocated pages
+	if (!r) platform_asan_unpoison(va, ROUNDUP(len, PGSIZE));
+#endif
+	return r;
+}
+
+// There are only five argument registers, so perm travels in the low
+// bits of the page aligned dstva.
+int
+sys_page_map_range(envid_t srcenv, void *srcva, envid_t dstenv, void *dstva, size_t len, int perm)
+{
+	if (PGOFF(dstva) || (perm & ~(PGSIZE - 1)))
+		return -E_INVAL;
+	return syscall(SYS_page_map_range, 1, srcenv, (uint32_t) srcva, dstenv, (uint32_t) dstva | perm, len);
+}
+
+int
+sys_page_unmap_range(envid_t envid, void *va, size_t len)
+{
+	return syscall(SYS_page_unmap_range, 1, envid, (uint32_t) va, len, 0, 0);
+}
+
 // sys_exofork is inlined in lib.h
 
+// Unlike sys_exofork, this need not be inlined: the child's stack is a
+// copy-on-write snapshot taken inside the system call, so the child
+// returns through this very frame.
+envid_t
+sys_fork(void)
+{
+	return syscall(SYS_fork, 0, 0, 0, 0, 0, 0);
+}
+
+// Same as sys_fork.
+envid_t
+sys_sfork(void)
+{
+	return syscall(SYS_sfork, 0, 0, 0, 0, 0, 0);
+}
+
+envid_t
+sys_thread_create(void *eip, void *esp, void *uxstacktop)
+{
+	return syscall(SYS_thread_create, 0, (uint32_t) eip, (uint32_t) esp, (uint32_t) uxstacktop, 0, 0);
+}
+
 int
 sys_env_set_status(envid_t envid, int status)
 {
 	return syscall(SYS_env_set_status, 1, envid, status, 0, 0, 0);
 }
 
+int
+sys_env_set_priority(envid_t envid, int priority)
+{
+	return syscall(SYS_env_set_priority, 1, envid, priority, 0, 0, 0);
+}
+
+int
+sys_env_set_deadline(envid_t envid, unsigned budget_ms, unsigned period_ms)
+{
+	return syscall(SYS_env_set_deadline, 1, envid, budget_ms, period_ms, 0, 0);
+}
+
+int
+sys_env_set_cpu(envid_t envid, int cpu)
+{
+	return syscall(SYS_env_set_cpu, 1, envid, cpu, 0, 0, 0);
+}
+
 int
 sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 {
@@ -122,6 +201,67 @@ sys_ipc_recv(void *dstva)
 	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
 }
 
+int
+sys_ipc_recv_until(void *dstva, uint64_t deadline)
+{
+	return syscall(SYS_ipc_recv, 1, (uint32_t) dstva, (uint32_t) deadline,
+		       (uint32_t) (deadline >> 32), 0, 0);
+}
+
+int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, int perm,
+	     void *dstva)
+{
+	return syscall(SYS_ipc_call, 0, envid, value, (uint32_t) srcva, perm,
+		       (uint32_t) dstva);
+}
+
+int
+sys_ipc_reply_wait(envid_t envid, uint32_t value, void *srcva, int perm,
+		   void *dstva)
+{
+	return syscall(SYS_ipc_reply_wait, 0, envid, value, (uint32_t) srcva,
+		       perm, (uint32_t) dstva);
+}
+
+int
+sys_env_set_ipc_words(envid_t envid, void *va)
+{
+	return syscall(SYS_env_set_ipc_words, 1, envid, (uint32_t) va, 0, 0, 0);
+}
+
+int
+sys_notify(envid_t envid, uint32_t bits)
+{
+	return syscall(SYS_notify, 0, envid, bits, 0, 0, 0);
+}
+
+int
+sys_wait_notify(uint32_t mask)
+{
+	return syscall(SYS_wait_notify, 0, mask, 0, 0, 0, 0);
+}
+
+int
+sys_futex_wait(volatile uint32_t *addr, uint32_t expected, uint64_t deadline)
+{
+	return syscall(SYS_futex_wait, 0, (uint32_t) addr, expected,
+		       (uint32_t) deadline, (uint32_t) (deadline >> 32), 0);
+}
+
+int
+sys_futex_wake(volatile uint32_t *addr, unsigned n)
+{
+	return syscall(SYS_futex_wake, 0, (uint32_t) addr, n, 0, 0, 0);
+}
+
+int
+sys_sleep_until(uint64_t deadline)
+{
+	return syscall(SYS_sleep_until, 1, (uint32_t) deadline,
+		       (uint32_t) (deadline >> 32), 0, 0, 0);
+}
+
 int sys_gettime(void)
 {
 	return syscall(SYS_gettime, 0, 0, 0, 0, 0, 0);
@@ -0,0 +1,99 @@
+// Threads: environments sharing one address space.
+//
+// Each thread but the main one runs in a slot of the thread stack area
+// below the normal user stack, with its own stack and exception stack
+// (see UTHREADTOP in inc/memlayout.h).  Its thisenv is the slot's entry
+// in the per-thread data page.  Nothing else in this library is thread-safe; in
+// particular exit() closes the file descriptors of all threads, so
+// threads should end with thread_exit().
+
+#include <inc/lib.h>
+
+// The envid of the thread in each slot, 0 if the slot is free.
+static volatile envid_t thread_slots[NUTHREAD];
+
+static void
+thread_main(void (*func)(void *), void *arg)
+{
+	thisenv = envs + ENVX(sys_getenvid());
+	func(arg);
+	thread_exit();
+}
+
+//
+// Start a new thread running func(arg) in our address space.
+// It inherits our page fault handler.
+//
+// Returns: the thread's envid, < 0 on error.
+//
+envid_t
+thread_create(void (*func)(void *), void *arg)
+{
+	uintptr_t top, *esp;
+	envid_t envid;
+	int slot, r;
+
+	// Claim a free slot.  -1 keeps it taken until the envid is known.
+	for (slot = 0; slot < NUTHREAD; slot++)
+		if (xchg((volatile uint32_t *) &thread_slots[slot], -1) == 0)
+			break;
+	if (slot == NUTHREAD)
+		return -E_NO_FREE_ENV;
+
+	top = UTHREADTOP - slot * UTHREADSIZE;
+
+	if ((r = sys_page_alloc_range(0, (void *) (top - UTHREADSIZE), UTHREADSTKSIZE, PTE_P|PTE_U|PTE_W)) < 0 ||
+	    (r = sys_page_alloc(0, (void *) (top - 2 * PGSIZE), PTE_P|PTE_U|PTE_W)) < 0)
+		goto error;
+
+	// thread_main(func, arg), returning nowhere.
+	esp = (uintptr_t *) (top - 3 * PGSIZE);
+	*--esp = (uintptr_t) arg;
+	*--esp = (uintptr_t) func;
+	*--esp = 0;
+
+	if ((r = sys_thread_create((void *) thread_main, esp, (void *) (top - PGSIZE))) < 0)
+		goto error;
+
+	thread_slots[slot] = envid = r;
+	return envid;
+
+error:
+	sys_page_unmap_range(0, (void *) (top - UTHREADSIZE), UTHREADSIZE);
+	thread_slots[slot] = 0;
+	return r;
+}
+
+//
+// End the calling thread.  The address space lives on as long as
+// other threads use it.
+//
+void
+thread_exit(void)
+{
+	sys_env_destroy(0);
+	panic("thread_exit: still running");
+}
+
+//
+// Wait for a thread started by thread_create to end, then free its
+// stacks and slot.
+//
+void
+thread_join(envid_t envid)
+{
+	uintptr_t top;
+	int slot;
+
+	for (slot = 0; slot < NUTHREAD; slot++)
+		if (thread_slots[slot] == envid)
+			break;
+	if (slot == NUTHREAD)
+		panic("thread_join: %08x is not a thread", envid);
+
+	wait(envid);
+
+	top = UTHREADTOP - slot * UTHREADSIZE;
+	sys_page_unmap_range(0, (void *) (top - UTHREADSIZE), UTHREADSIZE);
+	thread_slots[slot] = 0;
+}
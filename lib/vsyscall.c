@@ -6,10 +6,22 @@ vsyscall(int num)
 {
 	// LAB 12: Your code here.
 	// cprintf("vsyscall() is not implemented yet!");
-	return (num == VSYS_gettime) ? vsys[num] : -E_INVAL;
+	return (num >= 0 && num < NVSYSCALLS) ? vsys[num] : -E_INVAL;
 }
 
 int vsys_gettime(void)
 {
 	return vsyscall(VSYS_gettime);
 }
+
+int vsys_tsc_khz(void)
+{
+	return vsyscall(VSYS_tsc_khz);
+}
+
+// Sleeps for at least 'ms' milliseconds.
+void
+sleep_ms(unsigned ms)
+{
+	sys_sleep_until(read_tsc() + (uint64_t) ms * vsys_tsc_khz());
+}
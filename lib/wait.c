@@ -1,13 +1,12 @@
 #include <inc/lib.h>
 
-// Waits until 'envid' exits.
-void
+// Waits until 'envid' exits.  Returns its exit status, ENV_EXIT_KILLED
+// if it did not exit by itself, or -E_BAD_ENV if it is gone already.
+// An exited child stays around until its parent waits for it, so the
+// parent always gets the status, see sys_env_wait().
+int
 wait(envid_t envid)
 {
-	const volatile struct Env *e;
-
 	assert(envid != 0);
-	e = &envs[ENVX(envid)];
-	while (e->env_id == envid && e->env_status != ENV_FREE)
-		sys_yield();
+	return sys_env_wait(envid);
 }
@@ -0,0 +1,60 @@
+// Test the real-time scheduling class: admission control, and that
+// an admitted env runs ahead of best-effort spinners.
+
+#include <inc/lib.h>
+
+#define NSPIN	4
+
+void
+umain(int argc, char **argv)
+{
+	envid_t spinners[NSPIN], child;
+	uint64_t runtime;
+	int i, r;
+
+	if ((r = sys_env_set_deadline(0, 30, 20)) != -E_INVAL)
+		panic("budget above period: got %i, want %i", r, -E_INVAL);
+
+	// Half the CPU, then another half: the second must be rejected.
+	if ((r = sys_env_set_deadline(0, 10, 20)) < 0)
+		panic("sys_env_set_deadline: %i", r);
+	if ((child = fork()) < 0)
+		panic("fork: %i", child);
+	if (child == 0) {
+		// Only envs the kernel started may admit to the class.
+		if ((r = sys_env_set_deadline(0, 1, 20)) != -E_PERM)
+			panic("child admitting itself: got %i, want %i",
+			      r, -E_PERM);
+		ipc_recv(NULL, NULL, NULL);
+		return;
+	}
+	if (envs[ENVX(child)].env_rt_budget)
+		panic("child inherited the real-time class");
+	if ((r = sys_env_set_deadline(child, 10, 20)) != -E_BUSY)
+		panic("oversubscription: got %i, want %i", r, -E_BUSY);
+	ipc_send(child, 0, NULL, 0);
+	cprintf("admission control OK\n");
+
+	// Against spinners, a real-time env gets its budget.
+	for (i = 0; i < NSPIN; i++) {
+		if ((spinners[i] = fork()) < 0)
+			panic("fork: %i", spinners[i]);
+		if (spinners[i] == 0)
+			while (1)
+				asm volatile("pause");
+	}
+	runtime = thisenv->env_runtime;
+	for (i = 0; i < 20000000; i++)
+		asm volatile("pause");
+	for (i = 0; i < NSPIN; i++) {
+		if (envs[ENVX(spinners[i])].env_runtime * 2 >
+		    thisenv->env_runtime - runtime)
+			panic("spinner %08x got more than half the real-time env's share",
+			      spinners[i]);
+		sys_env_destroy(spinners[i]);
+	}
+
+	if ((r = sys_env_set_deadline(0, 0, 0)) < 0)
+		panic("leaving the real-time class: %i", r);
+	cprintf("deadline OK\n");
+}
@@ -99,6 +99,9 @@ dumbfork(void)
 	// Also copy the stack we are currently running on.
 	duppage(envid, ROUNDDOWN(&addr, PGSIZE));
 
+	// And the per-thread data page holding thisenv.
+	duppage(envid, (void *) UTHREADDATA);
+
 #ifdef SANITIZE_USER_SHADOW_BASE
 	for (addr = (uint8_t *) SANITIZE_USER_SHADOW_BASE;
 		(uintptr_t) addr < SANITIZE_USER_SHADOW_BASE +
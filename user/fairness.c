@@ -1,25 +1,63 @@
-// Demonstrate lack of fairness in IPC.
-// Start three instances of this program as envs 1, 2, and 3.
-// (user/idle is env 0).
+// Check that the scheduler shares the CPU by priority.
+// Three children spin at nice levels 0, 0 and 5 for a few seconds;
+// their CPU time should follow their weights, 1024 : 1024 : 335.
 
 #include <inc/lib.h>
 
+#define NCHILD	3
+#define SECONDS	3
+
+static const int prio[NCHILD] = { 0, 0, 5 };
+
 void
 umain(int argc, char **argv)
 {
-	envid_t who, id;
+	envid_t kids[NCHILD];
+	uint64_t runtime[NCHILD], even;
+	int i, r, end;
 
-	id = sys_getenvid();
+	// The kernel started us, so we may raise our priority ...
+	if ((r = sys_env_set_priority(0, ENV_PRIO_DEFAULT - 1)) < 0)
+		panic("raising our priority: %i", r);
+	if ((r = sys_env_set_priority(0, ENV_PRIO_DEFAULT)) < 0)
+		panic("sys_env_set_priority: %i", r);
 
-	if (thisenv == &envs[1]) {
-		while (1) {
-			ipc_recv(&who, 0, 0);
-			cprintf("%x recv from %x\n", id, who);
+	for (i = 0; i < NCHILD; i++) {
+		if ((kids[i] = fork()) < 0)
+			panic("fork: %i", kids[i]);
+		if (kids[i] == 0) {
+			// ... but our children may not.
+			if ((r = sys_env_set_priority(0, ENV_PRIO_DEFAULT - 1)) != -E_PERM)
+				panic("child raising its priority: got %i, want %i",
+				      r, -E_PERM);
+			while (1)
+				asm volatile("pause");
 		}
-	} else {
-		cprintf("%x loop sending to %x\n", id, envs[1].env_id);
-		while (1)
-			ipc_send(envs[1].env_id, 0, 0, 0);
+		if ((r = sys_env_set_priority(kids[i], prio[i])) < 0)
+			panic("sys_env_set_priority: %i", r);
 	}
-}
 
+	end = sys_gettime() + SECONDS;
+	while (sys_gettime() < end)
+		sys_yield();
+
+	for (i = 0; i < NCHILD; i++) {
+		runtime[i] = envs[ENVX(kids[i])].env_runtime;
+		sys_env_destroy(kids[i]);
+	}
+
+	// Shares in percent of the average of the two nice 0 children.
+	even = (runtime[0] + runtime[1]) / 2;
+	if (!even)
+		panic("children did not run");
+	cprintf("fairness: nice 0 %d%%, nice 0 %d%%, nice 5 %d%%\n",
+		(int) (runtime[0] * 100 / even),
+		(int) (runtime[1] * 100 / even),
+		(int) (runtime[2] * 100 / even));
+
+	if (runtime[0] * 4 < even * 3 || runtime[1] * 4 < even * 3)
+		panic("nice 0 children got unequal shares");
+	if (runtime[2] * 2 > even || runtime[2] * 5 < even)
+		panic("nice 5 child got a share out of proportion");
+	cprintf("fairness OK\n");
+}
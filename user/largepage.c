@@ -0,0 +1,56 @@
+// Test 4MB pages: allocation, mapping, fork and unmapping.
+
+#include <inc/lib.h>
+
+#define VA	((char *) 0xA0000000)
+#define VA2	((char *) 0xA0400000)
+
+void
+umain(int argc, char **argv)
+{
+	envid_t child;
+	int r, i;
+
+	if ((r = sys_page_alloc(0, VA + PGSIZE, PTE_P|PTE_W|PTE_U|PTE_PS)) != -E_INVAL)
+		panic("sys_page_alloc of a misaligned 4MB page: %i", r);
+	if ((r = sys_page_alloc(0, VA, PTE_P|PTE_W|PTE_U|PTE_PS)) < 0)
+		panic("sys_page_alloc: %i", r);
+	if (!(uvpd[PDX(VA)] & PTE_PS))
+		panic("%p is not mapped by a 4MB page", VA);
+	for (i = 0; i < PTSIZE; i += PGSIZE)
+		if (VA[i] != 0)
+			panic("4MB page is not zeroed at %p", VA + i);
+	VA[0] = 'a';
+	VA[PTSIZE - 1] = 'z';
+
+	// a 4MB page can only be mapped as a 4MB page
+	if ((r = sys_page_map(0, VA, 0, VA2, PTE_P|PTE_U)) != -E_INVAL)
+		panic("sys_page_map of a 4MB page as 4KB: %i", r);
+	if ((r = sys_page_map(0, VA, 0, VA2, PTE_P|PTE_U|PTE_PS)) < 0)
+		panic("sys_page_map: %i", r);
+	if (VA2[0] != 'a' || VA2[PTSIZE - 1] != 'z')
+		panic("4MB page mapped twice has different contents");
+
+	// fork gives the child its own copy of a writable 4MB page
+	if ((child = fork()) < 0)
+		panic("fork: %i", child);
+	if (child == 0) {
+		if (VA[0] != 'a' || VA[PTSIZE - 1] != 'z')
+			panic("child sees wrong 4MB page contents");
+		VA[0] = 'b';
+		exit();
+	}
+	wait(child);
+	if (VA[0] != 'a')
+		panic("child wrote to the parent's 4MB page");
+
+	// unmapping any part of a 4MB page unmaps all of it
+	if ((r = sys_page_unmap(0, VA + PGSIZE)) < 0)
+		panic("sys_page_unmap: %i", r);
+	if (uvpd[PDX(VA)] & PTE_P)
+		panic("4MB page is still mapped");
+	if (VA2[PTSIZE - 1] != 'z')
+		panic("second mapping lost its contents");
+
+	cprintf("largepage: OK\n");
+}
@@ -0,0 +1,48 @@
+// Test sys_sleep_until and IPC receive timeouts.
+
+#include <inc/lib.h>
+
+static uint64_t
+ms(unsigned n)
+{
+	return (uint64_t) n * vsys_tsc_khz();
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t start, slept;
+	envid_t child;
+	int r;
+
+	start = read_tsc();
+	sleep_ms(100);
+	slept = read_tsc() - start;
+	if (slept < ms(100) || slept > ms(1000))
+		panic("sleep_ms(100) slept %d ms", (int) (slept / ms(1)));
+	cprintf("sleep OK\n");
+
+	start = read_tsc();
+	if ((r = ipc_recv_until(NULL, NULL, NULL, start + ms(50))) != -E_TIMEOUT)
+		panic("ipc_recv_until: got %i, want %i", r, -E_TIMEOUT);
+	if (read_tsc() - start < ms(50))
+		panic("ipc_recv_until timed out early");
+	if (thisenv->env_ipc_recving)
+		panic("still receiving after the timeout");
+
+	// A value sent before the deadline cancels the timeout.
+	if ((child = fork()) < 0)
+		panic("fork: %i", child);
+	if (child == 0) {
+		ipc_send(thisenv->env_parent_id, 42, NULL, 0);
+		sleep_ms(10000);
+		panic("child woke up");
+	}
+	if ((r = ipc_recv_until(NULL, NULL, NULL, read_tsc() + ms(5000))) != 42)
+		panic("ipc_recv_until: got %i, want 42", r);
+
+	// The sleeping child's timeout goes away with it.
+	sys_env_destroy(child);
+	sleep_ms(20);
+	cprintf("ipc timeout OK\n");
+}
@@ -5,7 +5,8 @@ volatile int counter;
 void
 umain(int argc, char **argv)
 {
-	int i, j;
+	int i, j, r;
+	uint64_t vstart;
 	envid_t parent = sys_getenvid();
 
 	// Fork several environments
@@ -31,8 +32,28 @@ umain(int argc, char **argv)
 	if (counter != 10*10000)
 		panic("ran on two CPUs at once (counter is %d)", counter);
 
-	// Check that we see environments running on different CPUs
-	//cprintf("[%08x] stresssched on CPU %d\n", thisenv->env_id, thisenv->env_cpunum);
-
+	// Check that the scheduler is fair.  Virtual runtimes only
+	// compare on one CPU, so first move every sibling to CPU 0
+	// and wait until all of them, but those that are done, are
+	// there.  None sleeps, so that all stay runnable.
+	if ((r = sys_env_set_cpu(0, 0)) < 0)
+		panic("sys_env_set_cpu: %i", r);
+	for (i = 0; i < NENV; i++)
+		while (envs[i].env_parent_id == parent &&
+		       (envs[i].env_status == ENV_RUNNABLE ||
+			envs[i].env_status == ENV_RUNNING) &&
+		       (envs[i].env_cpu_pin != 0 || envs[i].env_cpunum != 0))
+			asm volatile("pause");
+
+	// Each yield runs the env with the least virtual runtime, so
+	// once this env runs again, every runnable sibling must have
+	// caught up to where it started.
+	vstart = thisenv->env_vruntime;
+	for (i = 0; i < 10; i++)
+		sys_yield();
+	for (i = 0; i < NENV; i++)
+		if (envs[i].env_parent_id == parent &&
+		    envs[i].env_status == ENV_RUNNABLE &&
+		    envs[i].env_vruntime < vstart)
+			panic("env %08x starved", envs[i].env_id);
 }
-
@@ -0,0 +1,80 @@
+// Test sys_futex_wait and sys_futex_wake.
+
+#include <inc/lib.h>
+
+#define NWAITERS	3
+
+// The word, on a page shared with the children, which map it at ALIAS
+// too and wait there.
+#define SHARED	((volatile uint32_t *) 0xA0000000)
+#define ALIAS	((volatile uint32_t *) 0xB0000000)
+#define MISALIGNED	((volatile uint32_t *) 0xA0000002)
+
+static void
+waiter(void)
+{
+	int r;
+
+	if ((r = sys_page_map(0, (void *) SHARED, 0, (void *) ALIAS,
+			      PTE_P | PTE_U | PTE_W | PTE_SHARE)) < 0)
+		panic("sys_page_map: %i", r);
+	if ((r = sys_futex_wait(ALIAS, 0, 0)) < 0)
+		panic("waiter: %i", r);
+	exit();
+}
+
+static bool
+waiting(envid_t envid)
+{
+	return envs[ENVX(envid)].env_status == ENV_NOT_RUNNABLE;
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t kids[NWAITERS];
+	int i, r;
+
+	if ((r = sys_page_alloc(0, (void *) SHARED,
+				PTE_P | PTE_U | PTE_W | PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %i", r);
+
+	if ((r = sys_futex_wait(SHARED, 1, 0)) != 0)
+		panic("wait for a changed word: got %i, want 0", r);
+	if ((r = sys_futex_wait(SHARED, 0, read_tsc() +
+				10ull * vsys_tsc_khz())) != -E_TIMEOUT)
+		panic("timed wait: got %i, want %i", r, -E_TIMEOUT);
+	if ((r = sys_futex_wait(MISALIGNED, 0, 0)) != -E_INVAL)
+		panic("wait on a misaligned word: got %i, want %i",
+		      r, -E_INVAL);
+	if ((r = sys_futex_wake(MISALIGNED, 1)) != -E_INVAL)
+		panic("wake on a misaligned word: got %i, want %i",
+		      r, -E_INVAL);
+
+	// The waiters queue up one by one, at another address.
+	for (i = 0; i < NWAITERS; i++) {
+		if ((kids[i] = fork()) < 0)
+			panic("fork: %i", kids[i]);
+		if (kids[i] == 0)
+			waiter();
+		while (!waiting(kids[i]))
+			sys_yield();
+	}
+
+	if ((r = sys_futex_wake(SHARED, 1)) != 1)
+		panic("wake 1: got %i, want 1", r);
+	if (waiting(kids[0]))
+		panic("the oldest waiter is still waiting");
+	for (i = 1; i < NWAITERS; i++)
+		if (!waiting(kids[i]))
+			panic("waiter %d woke up too", i);
+
+	if ((r = sys_futex_wake(SHARED, NWAITERS)) != NWAITERS - 1)
+		panic("wake the rest: got %i, want %i", r, NWAITERS - 1);
+	for (i = 0; i < NWAITERS; i++)
+		if ((r = wait(kids[i])) != 0)
+			panic("waiter %d: exit status %i", i, r);
+	if ((r = sys_futex_wake(SHARED, 1)) != 0)
+		panic("wake with no waiters: got %i, want 0", r);
+	cprintf("futex OK\n");
+}
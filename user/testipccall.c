@@ -0,0 +1,93 @@
+// Test ipc_call() and ipc_reply_wait(), with the server waiting for a
+// request and busy when one comes, and a server that exits on a
+// queued call.
+
+#include <inc/lib.h>
+
+#define REQ_NAP		0	// Reply, then wait for *SHARED to receive
+#define SHARED		((volatile int *) 0xA0000000)
+
+static void
+server(void)
+{
+	envid_t from;
+	int32_t v;
+
+	v = ipc_recv(&from, 0, 0);
+	for (;;) {
+		if (v == REQ_NAP) {
+			ipc_send(from, 0, 0, 0);
+			while (!*SHARED)
+				sleep_ms(1);
+			*SHARED = 0;
+			v = ipc_recv(&from, 0, 0);
+			continue;
+		}
+		v = ipc_reply_wait(from, v + 1, 0, 0, &from, 0, 0);
+	}
+}
+
+// Fork a client that calls 'srv' with 'v' and exits with the reply,
+// and wait until its call is queued.
+static envid_t
+client(envid_t srv, int32_t v)
+{
+	envid_t id;
+	int32_t r;
+
+	if ((id = fork()) < 0)
+		panic("fork: %i", id);
+	if (id == 0) {
+		r = ipc_call(srv, v, 0, 0, 0, 0);
+		exit_status(r == -E_BAD_ENV ? 255 : r);
+	}
+	while (envs[ENVX(id)].env_status != ENV_NOT_RUNNABLE)
+		sleep_ms(1);
+	return id;
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t srv, c;
+	int32_t i, r;
+
+	if ((r = sys_page_alloc(0, (void *) SHARED,
+				PTE_P | PTE_U | PTE_W | PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %i", r);
+	if ((srv = fork()) < 0)
+		panic("fork: %i", srv);
+	if (srv == 0)
+		server();
+
+	// The server is receiving: each call is handed to it, and
+	// ipc_reply_wait() switches straight back.
+	while (!envs[ENVX(srv)].env_ipc_recving)
+		sleep_ms(1);
+	for (i = 1; i <= 100; i++)
+		if ((r = ipc_call(srv, i, 0, 0, 0, 0)) != i + 1)
+			panic("call %d: got %i, want %d", i, r, i + 1);
+
+	// The server is not receiving: the call waits for its next
+	// ipc_recv().
+	if ((r = ipc_call(srv, REQ_NAP, 0, 0, 0, 0)) != 0)
+		panic("call REQ_NAP: got %i", r);
+	c = client(srv, 41);
+	if (envs[ENVX(srv)].env_ipc_recving)
+		panic("server receiving while it naps");
+	*SHARED = 1;
+	if ((r = wait(c)) != 42)
+		panic("queued call: got %i, want 42", r);
+
+	// A call still queued when the server exits fails.
+	if ((r = ipc_call(srv, REQ_NAP, 0, 0, 0, 0)) != 0)
+		panic("call REQ_NAP: got %i", r);
+	c = client(srv, 7);
+	if ((r = sys_env_destroy(srv)) < 0)
+		panic("destroy: %i", r);
+	if ((r = wait(c)) != 255)
+		panic("call to an exiting server: got %i, want -E_BAD_ENV",
+		      r);
+
+	cprintf("ipc call OK\n");
+}
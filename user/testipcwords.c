@@ -0,0 +1,100 @@
+// Test register messages (IPC_WORDS), between environments and to the
+// file server.
+
+#include <inc/lib.h>
+
+static uint32_t words[IPC_NWORDS];
+
+// Receive one message into 'words', if 'set', and exit with 0 if it
+// is the register message umain sends.
+static void
+receiver(bool set)
+{
+	int32_t v;
+	int perm, i;
+
+	if (set && sys_env_set_ipc_words(0, words) < 0)
+		exit_status(1);
+	v = ipc_recv(NULL, 0, &perm);
+	if (!set)
+		exit_status(v == 1 ? 0 : 1);
+	if (v != 7 || perm != IPC_WORDS)
+		exit_status(1);
+	for (i = 0; i < IPC_NWORDS; i++)
+		if (words[i] != i + 1)
+			exit_status(1);
+	exit_status(0);
+}
+
+static envid_t
+fork_receiver(bool set)
+{
+	envid_t id;
+
+	if ((id = fork()) < 0)
+		panic("fork: %i", id);
+	if (id == 0)
+		receiver(set);
+	while (!envs[ENVX(id)].env_ipc_recving)
+		sleep_ms(1);
+	return id;
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t msg[IPC_NWORDS];
+	struct Stat st;
+	envid_t id;
+	int fd, i, r;
+
+	for (i = 0; i < IPC_NWORDS; i++)
+		msg[i] = i + 1;
+
+	// Words the sender cannot read, or mixed with page bits, are
+	// not sent; the receiver still gets the good ones.
+	id = fork_receiver(1);
+	if ((r = sys_ipc_try_send(id, 7, 0, IPC_WORDS)) != -E_FAULT)
+		panic("send from an unmapped buffer: got %i, want %i",
+		      r, -E_FAULT);
+	if ((r = sys_ipc_try_send(id, 7, msg, IPC_WORDS | PTE_P)) != -E_INVAL)
+		panic("send with page bits: got %i, want %i", r, -E_INVAL);
+	if ((r = sys_ipc_try_send(id, 7, msg, IPC_WORDS)) < 0)
+		panic("send: %i", r);
+	if ((r = wait(id)) != 0)
+		panic("receiver got the wrong message");
+
+	// A receiver without a place for them cannot get any.
+	id = fork_receiver(0);
+	if ((r = sys_ipc_try_send(id, 7, msg, IPC_WORDS)) != -E_INVAL)
+		panic("send to no buffer: got %i, want %i", r, -E_INVAL);
+	ipc_send(id, 1, 0, 0);
+	if ((r = wait(id)) != 0)
+		panic("receiver without a buffer failed");
+
+	// The file server takes flush, set size and sync requests in
+	// register messages, and only those.
+	if ((fd = open("/testipcwords", O_RDWR | O_CREAT)) < 0)
+		panic("open /testipcwords: %i", fd);
+	if ((r = write(fd, msg, sizeof(msg))) != sizeof(msg))
+		panic("write: %i", r);
+	if ((r = ftruncate(fd, 10)) < 0)
+		panic("ftruncate: %i", r);
+	if ((r = fstat(fd, &st)) < 0)
+		panic("fstat: %i", r);
+	if (st.st_size != 10)
+		panic("size after ftruncate: %d, want 10", st.st_size);
+	if ((r = close(fd)) < 0)
+		panic("close: %i", r);
+	if ((r = sync()) < 0)
+		panic("sync: %i", r);
+	if ((r = remove("/testipcwords")) < 0)
+		panic("remove: %i", r);
+	r = ipc_call(ipc_find_env(ENV_TYPE_FS), FSREQ_OPEN, msg, IPC_WORDS,
+		     0, 0);
+	if (r != -E_INVAL)
+		panic("open in a register message: got %i, want %i",
+		      r, -E_INVAL);
+
+	cprintf("ipc words OK\n");
+}
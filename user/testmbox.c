@@ -0,0 +1,84 @@
+// Test the IPC mailbox: messages sent while the target is busy, the
+// limit per sender, and messages of a sender that exits.
+
+#include <inc/lib.h>
+
+#define SHARED		((volatile int *) 0xA0000000)
+#define PAGE		((char *) 0xB0000000)
+#define NMSG		4	// IPC_MBOX_PER_SENDER in kern/syscall.c
+
+// Wait until *SHARED is set, then take the queued messages from
+// 'parent' and exit with 0 if they are all there, in order.
+static void
+receiver(envid_t parent)
+{
+	envid_t from;
+	int32_t v;
+	int perm, i;
+
+	while (!*SHARED)
+		sleep_ms(1);
+	for (i = 1; i <= NMSG; i++) {
+		v = ipc_recv(&from, PAGE, &perm);
+		if (v != i || from != parent)
+			exit_status(1);
+		if (i == NMSG && (!perm || strcmp(PAGE, "mailbox") != 0))
+			exit_status(1);
+		if (i < NMSG && perm)
+			exit_status(1);
+	}
+	v = ipc_recv_until(&from, 0, 0, read_tsc() + 10 * vsys_tsc_khz());
+	exit_status(v == -E_TIMEOUT ? 0 : 1);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t parent = thisenv->env_id, rcv, id;
+	int i, r;
+
+	if ((r = sys_page_alloc(0, (void *) SHARED,
+				PTE_P | PTE_U | PTE_W | PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %i", r);
+	if ((r = sys_page_alloc(0, PAGE, PTE_P | PTE_U | PTE_W)) < 0)
+		panic("sys_page_alloc: %i", r);
+	strcpy(PAGE, "mailbox");
+
+	if ((rcv = fork()) < 0)
+		panic("fork: %i", rcv);
+	if (rcv == 0)
+		receiver(parent);
+
+	// The receiver is busy: the messages wait in its mailbox, up to
+	// NMSG of ours.
+	for (i = 1; i < NMSG; i++)
+		if ((r = sys_ipc_try_send(rcv, i, (void *) UTOP, 0)) < 0)
+			panic("send %d: %i", i, r);
+	if ((r = sys_ipc_try_send(rcv, NMSG, PAGE, PTE_P | PTE_U)) < 0)
+		panic("send %d: %i", NMSG, r);
+	r = sys_ipc_try_send(rcv, 0, (void *) UTOP, 0);
+	if (r != -E_IPC_NOT_RECV)
+		panic("send past the limit: got %i, want %i",
+		      r, -E_IPC_NOT_RECV);
+	if (envs[ENVX(rcv)].env_ipc_mbox_len != NMSG)
+		panic("mailbox holds %d, want %d",
+		      envs[ENVX(rcv)].env_ipc_mbox_len, NMSG);
+
+	// Another sender still can queue one, and it is dropped when
+	// that sender exits.
+	if ((id = fork()) < 0)
+		panic("fork: %i", id);
+	if (id == 0)
+		exit_status(sys_ipc_try_send(rcv, 100, (void *) UTOP, 0) == 0 ?
+			    0 : 1);
+	if ((r = wait(id)) != 0)
+		panic("other sender could not queue: %d", r);
+	if (envs[ENVX(rcv)].env_ipc_mbox_len != NMSG)
+		panic("message of an exited sender left in the mailbox");
+
+	*SHARED = 1;
+	if ((r = wait(rcv)) != 0)
+		panic("receiver got the wrong messages");
+
+	cprintf("mailbox OK\n");
+}
@@ -0,0 +1,48 @@
+// Test sys_notify and sys_wait_notify.
+
+#include <inc/lib.h>
+
+#define PING	0x1
+#define PONG	0x2
+#define ROUNDS	100
+
+void
+umain(int argc, char **argv)
+{
+	envid_t parent = thisenv->env_id, child;
+	int i, r;
+
+	if ((child = fork()) < 0)
+		panic("fork: %i", child);
+	if (child == 0) {
+		for (i = 0; i < ROUNDS; i++) {
+			if ((r = sys_wait_notify(PING)) != PING)
+				panic("child wait: got %i, want %i", r, PING);
+			if ((r = sys_notify(parent, PONG)) < 0)
+				panic("child notify: %i", r);
+		}
+		return;
+	}
+
+	for (i = 0; i < ROUNDS; i++) {
+		if ((r = sys_notify(child, PING)) < 0)
+			panic("notify: %i", r);
+		if ((r = sys_wait_notify(PONG)) != PONG)
+			panic("wait: got %i, want %i", r, PONG);
+	}
+
+	// Pending bits coalesce, and are taken only if waited for.
+	if ((r = sys_notify(parent, 0x4)) < 0 ||
+	    (r = sys_notify(parent, 0x4 | 0x8)) < 0)
+		panic("notify itself: %i", r);
+	if ((r = sys_wait_notify(0x4 | 0x10)) != 0x4)
+		panic("wait for pending: got %i, want %i", r, 0x4);
+	if ((r = sys_wait_notify(0x8)) != 0x8)
+		panic("wait for pending: got %i, want %i", r, 0x8);
+
+	if ((r = sys_wait_notify(0)) != -E_INVAL)
+		panic("waiting for nothing: got %i, want %i", r, -E_INVAL);
+	if ((r = sys_notify(parent, ~NOTIFY_ALL)) != -E_INVAL)
+		panic("notify bad bits: got %i, want %i", r, -E_INVAL);
+	cprintf("notify OK\n");
+}
@@ -0,0 +1,68 @@
+// Test sys_env_wait, exit statuses and zombies.
+
+#include <inc/lib.h>
+
+#define NZOMBIE	40
+
+void
+umain(int argc, char **argv)
+{
+	envid_t child, kids[NZOMBIE];
+	int r, i;
+
+	// Waiting before the child exits blocks until it does.
+	if ((child = fork()) < 0)
+		panic("fork: %i", child);
+	if (child == 0) {
+		sleep_ms(10);
+		exit_status(7);
+	}
+	if ((r = wait(child)) != 7)
+		panic("wait for exit_status(7): got %i", r);
+	if ((r = wait(child)) != -E_BAD_ENV)
+		panic("wait for a freed env: got %i, want %i", r, -E_BAD_ENV);
+
+	// A child that exits first stays a zombie until we wait.
+	if ((child = fork()) < 0)
+		panic("fork: %i", child);
+	if (child == 0)
+		exit_status(3);
+	while (envs[ENVX(child)].env_status != ENV_ZOMBIE)
+		sleep_ms(1);
+
+	// Nobody but the parent can collect it.
+	if ((r = fork()) < 0)
+		panic("fork: %i", r);
+	if (r == 0)
+		exit_status(wait(child) == -E_BAD_ENV ? 0 : 1);
+	if ((r = wait(r)) != 0)
+		panic("a sibling collected a zombie");
+	if ((r = wait(child)) != 3)
+		panic("wait for a zombie: got %i", r);
+
+	if ((child = fork()) < 0)
+		panic("fork: %i", child);
+	if (child == 0)
+		while (1)
+			sys_yield();
+	if ((r = sys_env_destroy(child)) < 0)
+		panic("destroy: %i", r);
+	if ((r = wait(child)) != ENV_EXIT_KILLED)
+		panic("wait for a destroyed env: got %i, want %i",
+		      r, ENV_EXIT_KILLED);
+
+	// No status is lost, however many children exit unwaited.
+	for (i = 0; i < NZOMBIE; i++) {
+		if ((kids[i] = fork()) < 0)
+			panic("fork: %i", kids[i]);
+		if (kids[i] == 0)
+			exit_status(i);
+	}
+	for (i = 0; i < NZOMBIE; i++)
+		if ((r = wait(kids[i])) != i)
+			panic("wait for child %d: got %i", i, r);
+
+	if ((r = sys_env_wait(0)) != -E_INVAL)
+		panic("waiting for itself: got %i, want %i", r, -E_INVAL);
+	cprintf("wait OK\n");
+}
@@ -0,0 +1,58 @@
+// Test threads sharing one address space, and sfork.
+
+#include <inc/lib.h>
+
+#define NTHREADS	4
+#define NITER		1000
+
+static volatile int counter[NTHREADS];
+static volatile int shared;
+
+static void
+worker(void *arg)
+{
+	int i, n = (int) arg;
+
+	for (i = 0; i < NITER; i++) {
+		counter[n]++;
+		if (i % 100 == 0)
+			sys_yield();
+	}
+	if (thisenv->env_id != sys_getenvid())
+		panic("thread %d has the wrong thisenv", n);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t ids[NTHREADS], child;
+	volatile int local = 0;
+	int i;
+
+	for (i = 0; i < NTHREADS; i++)
+		if ((ids[i] = thread_create(worker, (void *) i)) < 0)
+			panic("thread_create: %i", ids[i]);
+	for (i = 0; i < NTHREADS; i++)
+		thread_join(ids[i]);
+	for (i = 0; i < NTHREADS; i++)
+		if (counter[i] != NITER)
+			panic("thread %d counted to %d", i, counter[i]);
+	if (thisenv->env_id != sys_getenvid())
+		panic("main thread has the wrong thisenv");
+	cprintf("threads ok\n");
+
+	// sfork shares globals, not the stack
+	if ((child = sfork()) < 0)
+		panic("sfork: %i", child);
+	if (child == 0) {
+		if (thisenv->env_id != sys_getenvid())
+			panic("sfork child has the wrong thisenv");
+		shared = 1;
+		local = 1;
+		exit();
+	}
+	wait(child);
+	if (shared != 1 || local != 0)
+		panic("sfork: shared %d, local %d", shared, local);
+	cprintf("sfork ok\n");
+}
@@ -0,0 +1,103 @@
+// Show what each environment is using, from the counters in envs[].
+
+#include <inc/lib.h>
+
+static const char *status_names[] = {
+	[ENV_FREE]		= "free",
+	[ENV_DYING]		= "dying",
+	[ENV_RUNNABLE]		= "ready",
+	[ENV_RUNNING]		= "run",
+	[ENV_NOT_RUNNABLE]	= "block",
+	[ENV_ZOMBIE]		= "zombie",
+};
+
+// The previous sample, to show rates over the interval.
+static envid_t last_id[NENV];
+static uint64_t last_runtime[NENV];
+static uint32_t last_syscalls[NENV];
+
+static uint32_t
+nsyscalls(const volatile struct Env *e)
+{
+	uint32_t n = 0;
+	int i;
+
+	for (i = 0; i < NSYSCALL_CLASSES; i++)
+		n += e->env_stats.es_syscalls[i];
+	return n;
+}
+
+// Take a sample, and print it if 'interval', the TSC cycles since
+// the previous one, is not 0.
+static void
+sample(uint64_t interval)
+{
+	const volatile struct Env *e;
+	uint64_t runtime;
+	uint32_t calls;
+	unsigned permille;
+	int i;
+
+	if (interval)
+		cprintf("   ENVID STAT  NI  CPU%%  PAGES  SYSCALLS      S/INT    COW  UPCALL   SENT   RECV\n");
+	for (i = 0; i < NENV; i++) {
+		e = &envs[i];
+		if (e->env_status == ENV_FREE)
+			continue;
+
+		runtime = e->env_runtime;
+		calls = nsyscalls(e);
+		if (last_id[i] != e->env_id) {
+			last_id[i] = e->env_id;
+			last_runtime[i] = 0;
+			last_syscalls[i] = 0;
+		}
+
+		if (interval) {
+			permille = (runtime - last_runtime[i]) * 1000 / interval;
+			cprintf("%08x %-5s %3d %3u.%u %6u %9u %10u %6u %7u %6u %6u\n",
+				e->env_id, status_names[e->env_status],
+				e->env_priority, permille / 10, permille % 10,
+				e->env_stats.es_npages, calls,
+				calls - last_syscalls[i],
+				e->env_stats.es_cow_faults,
+				e->env_stats.es_upcall_faults,
+				e->env_stats.es_ipc_sent,
+				e->env_stats.es_ipc_received);
+		}
+
+		last_runtime[i] = runtime;
+		last_syscalls[i] = calls;
+	}
+}
+
+void
+usage(void)
+{
+	cprintf("usage: top [count]\n");
+	exit();
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t interval, start;
+	int count = 1;
+
+	if (argc > 2)
+		usage();
+	if (argc == 2 && (count = strtol(argv[1], NULL, 10)) <= 0)
+		usage();
+
+	// The first sample only sets the counters to take rates from.
+	start = read_tsc();
+	sample(0);
+	while (count-- > 0) {
+		sleep_ms(1000);
+		interval = read_tsc() - start;
+		start += interval;
+		sample(interval);
+		if (count)
+			cprintf("\n");
+	}
+}